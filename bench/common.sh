@@ -0,0 +1,95 @@
+# common.sh - helpers shared by the benchmark scripts (sourced, not run).
+#
+# Callers set ROOT before sourcing. Every proxy started here runs from its
+# own scratch directory with a generated proxy.conf, so benchmarks never
+# touch the repository's proxy.conf, blacklist.txt or proxy.log.
+
+PROXY_PORT=${BENCH_PROXY_PORT:-18888}
+ORIGIN_PORT=${BENCH_ORIGIN_PORT:-19080}
+ECHO_PORT=${BENCH_ECHO_PORT:-19081}
+
+CLIENT="$ROOT/test_client"
+PROXY_BIN=${BENCH_PROXY_BIN:-$ROOT/proxy_server}  # e.g. an instrumented or PGO build
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/proxy-bench.XXXXXX")
+STUB_PID=""
+PROXY_PID=""
+
+cleanup() {
+    [ -n "$PROXY_PID" ] && kill -9 "$PROXY_PID" 2>/dev/null
+    [ -n "$STUB_PID" ] && kill -INT "$STUB_PID" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+require_binaries() {
+    for bin in "$PROXY_BIN" "$ROOT/test_client" "$ROOT/origin_stub"; do
+        [ -x "$bin" ] || { echo "bench: $bin is not built (run make)" >&2; exit 1; }
+    done
+}
+
+wait_for_port() {
+    for _ in $(seq 1 50); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "bench: nothing listening on port $1" >&2
+    return 1
+}
+
+start_origin() { # start_origin [origin_stub options]
+    "$ROOT/origin_stub" -p "$ORIGIN_PORT" -e "$ECHO_PORT" "$@" > "$WORK/stub.log" 2>&1 &
+    STUB_PID=$!
+    wait_for_port "$ORIGIN_PORT"
+}
+
+# start_proxy <huge_pages> [proxy.conf lines]: fresh proxy with an empty cache in its own directory
+start_proxy() {
+    mkdir -p "$WORK/proxy"
+    rm -f "$WORK/proxy/proxy.log"
+    : > "$WORK/proxy/blacklist.txt"
+    cat > "$WORK/proxy/proxy.conf" <<EOF
+port = $PROXY_PORT
+threads = 16
+miss_threads = 32
+cache_size_mb = 512
+cache_huge_pages = $1
+element_size_mb = 16
+# All load comes from one address, so lift the per-client limits
+client_max_concurrent = 4096
+client_max_queued = 8192
+${2:-}
+${BENCH_PROXY_CONF_EXTRA:-}
+EOF
+    (cd "$WORK/proxy" && ulimit -n "$(ulimit -Hn)" 2>/dev/null; exec "$PROXY_BIN" > /dev/null 2>&1) &
+    PROXY_PID=$!
+    wait_for_port "$PROXY_PORT"
+}
+
+stop_proxy() {
+    kill -INT "$PROXY_PID" 2>/dev/null
+    for _ in $(seq 1 50); do
+        kill -0 "$PROXY_PID" 2>/dev/null || break
+        sleep 0.1
+    done
+    kill -9 "$PROXY_PID" 2>/dev/null
+    wait "$PROXY_PID" 2>/dev/null
+    PROXY_PID=""
+}
+
+# CPU time (user + system) the proxy has used so far, in clock ticks
+proxy_cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$PROXY_PID/stat" 2>/dev/null || echo 0
+}
+
+load() {
+    "$CLIENT" -j "$@" 127.0.0.1 "$PROXY_PORT" 2>/dev/null | tail -n 1
+}
+
+field() { # field <json> <name>: numeric field
+    echo "$1" | sed -n "s/.*\"$2\":\([0-9.]*\).*/\1/p"
+}
+
+p99() {
+    echo "$1" | sed -n 's/.*"latency_us":{[^}]*"p99":\([0-9]*\).*/\1/p'
+}
@@ -0,0 +1,144 @@
+#!/usr/bin/env bash
+# run_bench.sh - offline benchmark suite for the proxy (run it with `make bench`).
+#
+# Starts origin_stub and a fresh proxy_server on loopback for every scenario,
+# drives them with test_client, and writes one JSON record per scenario to
+# bench/results.json. If bench/baseline.json exists, each scenario is
+# compared against it and the script exits non-zero when throughput drops or
+# p99 latency rises past the configured thresholds.
+#
+# Environment overrides:
+#   BENCH_DURATION=5            seconds per scenario
+#   BENCH_SCENARIOS="..."       subset of: hot_hits cold_misses zipf large_objects
+#                               tunnels overload zipf_hugepages large_cold
+#                               large_cold_parallel
+#   BENCH_THRESHOLD=10          allowed throughput drop, percent
+#   BENCH_P99_THRESHOLD=25      allowed p99 increase, percent
+#   BENCH_OVERLOAD_RATE=40000   open-loop request rate for the overload scenario
+#   BENCH_UPDATE_BASELINE=1     store the results as the new baseline instead of comparing
+#   BENCH_BASELINE=FILE         compare against FILE instead (empty: record results only)
+#   BENCH_PROXY_BIN=PATH        proxy binary to measure (default ./proxy_server)
+#   BENCH_PROXY_CONF_EXTRA="k = v"  extra proxy.conf lines for every scenario
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+DURATION=${BENCH_DURATION:-5}
+SCENARIOS=${BENCH_SCENARIOS:-"hot_hits cold_misses zipf large_objects tunnels overload"}
+THRESHOLD=${BENCH_THRESHOLD:-10}
+P99_THRESHOLD=${BENCH_P99_THRESHOLD:-25}
+OVERLOAD_RATE=${BENCH_OVERLOAD_RATE:-40000}
+RESULTS=${BENCH_RESULTS:-$ROOT/bench/results.json}
+BASELINE=${BENCH_BASELINE-$ROOT/bench/baseline.json}
+
+. "$ROOT/bench/common.sh"
+
+make_urls() { # make_urls <file> <count> <path prefix> [query]
+    seq 1 "$2" | sed "s|.*|http://127.0.0.1:$ORIGIN_PORT$3&$4|" > "$WORK/$1"
+}
+
+run_scenario() {
+    local huge=0 extra=""
+    [ "$1" = zipf_hugepages ] && huge=1
+    [ "$1" = large_cold_parallel ] && extra="origin_range_streams = 4"
+    start_proxy "$huge" "$extra" || return 1
+    local out=""
+    case "$1" in
+        hot_hits)
+            load -c 64 -d 1 -u "$WORK/hot.txt" > /dev/null   # warm the cache
+            out=$(load -c 64 -d "$DURATION" -k -u "$WORK/hot.txt") ;;
+        cold_misses)
+            out=$(load -c 64 -d "$DURATION" -u "$WORK/cold.txt") ;;
+        zipf|zipf_hugepages)
+            out=$(load -c 64 -d "$DURATION" -u "$WORK/zipf.txt" -z 0.9) ;;
+        large_objects)
+            out=$(load -c 8 -d "$DURATION" -u "$WORK/large.txt") ;;
+        large_cold|large_cold_parallel) # never-seen objects from an origin capped per connection
+            out=$(load -c 4 -d "$DURATION" -u "$WORK/large_cold.txt") ;;
+        tunnels)
+            out=$(load -c 16 -d "$DURATION" -T "127.0.0.1:$ECHO_PORT" -b 16384) ;;
+        overload)
+            out=$(load -c 512 -d "$DURATION" -r "$OVERLOAD_RATE" -u "$WORK/zipf.txt" -z 0.9) ;;
+        *)
+            echo "bench: unknown scenario $1" >&2 ;;
+    esac
+    stop_proxy
+    [ -z "$out" ] && return 1
+    # Attach the proxy's dTLB miss count when the perf counter was available
+    local dtlb
+    dtlb=$(sed -n 's/.*dTLB load misses: \([0-9]*\).*/\1/p' "$WORK/proxy/proxy.log" | tail -n 1)
+    [ -n "$dtlb" ] && out="${out%\}},\"dtlb_misses\":$dtlb}"
+    echo "$out"
+}
+
+compare() { # compare <name> <result json>: returns 1 on regression
+    local base
+    base=$(grep "^  \"$1\":" "$BASELINE" 2>/dev/null | sed 's/^[^{]*//; s/,$//')
+    if [ -z "$base" ]; then
+        printf '  %-16s no baseline\n' "$1"
+        return 0
+    fi
+    awk -v name="$1" -v r="$(field "$2" rps)" -v br="$(field "$base" rps)" \
+        -v p="$(p99 "$2")" -v bp="$(p99 "$base")" -v t="$THRESHOLD" -v pt="$P99_THRESHOLD" 'BEGIN {
+        dr = br > 0 ? (r - br) * 100 / br : 0
+        dp = bp > 0 ? (p - bp) * 100 / bp : 0
+        bad = (dr < -t) || (dp > pt)
+        printf "  %-16s rps %10.1f vs %10.1f (%+6.1f%%)  p99 %8dus vs %8dus (%+6.1f%%)%s\n",
+               name, r, br, dr, p, bp, dp, bad ? "  REGRESSION" : ""
+        exit bad
+    }'
+}
+
+require_binaries
+
+make_urls hot.txt 32 /hot/ "?size=16k"
+make_urls cold.txt 100000 /cold/ "?size=8k"
+make_urls zipf.txt 10000 /zipf/ ""
+make_urls large.txt 16 /large/ "?size=4m"
+make_urls large_cold.txt 10000 /large_cold/ "?size=24m\\&rate=20000"  # sed needs the \& escaped
+
+start_origin -s pareto:2k:1.1 -M 2m || exit 1
+
+echo "Running benchmarks (${DURATION}s per scenario)"
+status=0
+records=()
+for s in $SCENARIOS; do
+    echo "  $s..."
+    result=$(run_scenario "$s")
+    if [ -z "$result" ] || [ "$(field "$result" requests)" = 0 ]; then
+        echo "bench: scenario $s produced no completed requests" >&2
+        status=1
+        continue
+    fi
+    records+=("  \"$s\": $result")
+done
+
+# One scenario per line; the comparison below relies on that layout
+{
+    echo "{"
+    printf '  "duration_s": %s' "$DURATION"
+    for r in "${records[@]}"; do printf ',\n%s' "$r"; done
+    printf '\n}\n'
+} > "$RESULTS"
+echo "Results written to $RESULTS"
+[ -z "$BASELINE" ] && exit $status
+
+if [ "${BENCH_UPDATE_BASELINE:-0}" = 1 ]; then
+    cp "$RESULTS" "$BASELINE"
+    echo "Baseline updated: $BASELINE"
+    exit $status
+fi
+
+if [ ! -f "$BASELINE" ]; then
+    echo "No baseline at $BASELINE; run 'make bench-baseline' to create one"
+    exit $status
+fi
+
+echo "Comparison against $BASELINE (throughput -${THRESHOLD}%, p99 +${P99_THRESHOLD}%):"
+for s in $SCENARIOS; do
+    line=$(grep "^  \"$s\":" "$RESULTS" | sed 's/^[^{]*//; s/,$//')
+    [ -z "$line" ] && continue
+    compare "$s" "$line" || status=1
+done
+[ $status -eq 0 ] && echo "No regressions." || echo "Performance regression detected." >&2
+exit $status
@@ -0,0 +1,93 @@
+#!/usr/bin/env bash
+# tunnel_bench.sh - CONNECT tunnel throughput and concurrency benchmark
+# (run it with `make bench-tunnels`).
+#
+# Part 1 opens 1..N busy tunnels through a fresh proxy to origin_stub's echo
+# port. For each tunnel count it reports aggregate bandwidth, per-tunnel
+# fairness (Jain's index over bytes moved per tunnel) and the proxy's CPU
+# time per GiB tunnelled. Tunnelled bytes count both directions.
+#
+# Part 2 holds a growing number of idle tunnels open while one probe tunnel
+# does small echo round trips. A step is degraded when the idle tunnels
+# can't all be established, or when the probe's p99 exceeds
+# TUNNEL_DEGRADE_FACTOR times the p99 with no idle tunnels. The largest
+# healthy step is reported as the maximum number of concurrent idle tunnels.
+#
+# Environment overrides:
+#   BENCH_DURATION=5                    seconds per run
+#   TUNNEL_COUNTS="1 4 16"              busy tunnel counts for part 1
+#   TUNNEL_PAYLOAD=262144               bytes per echo exchange in part 1
+#   TUNNEL_IDLE_STEPS="16 31 64 ..."    idle tunnel counts for part 2
+#   TUNNEL_DEGRADE_FACTOR=2             allowed probe p99 growth in part 2
+#   BENCH_PROXY_CONF_EXTRA="k = v"      extra proxy.conf lines (e.g. miss_threads)
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+DURATION=${BENCH_DURATION:-5}
+TUNNEL_COUNTS=${TUNNEL_COUNTS:-"1 4 16"}
+TUNNEL_PAYLOAD=${TUNNEL_PAYLOAD:-262144}
+TUNNEL_IDLE_STEPS=${TUNNEL_IDLE_STEPS:-"16 31 64 128 256 512 1024 2048 4096"}
+TUNNEL_DEGRADE_FACTOR=${TUNNEL_DEGRADE_FACTOR:-2}
+RESULTS=${BENCH_RESULTS:-$ROOT/bench/tunnel_results.json}
+
+. "$ROOT/bench/common.sh"
+
+require_binaries
+start_origin || exit 1
+CLK_TCK=$(getconf CLK_TCK)
+
+echo "Tunnel bandwidth (${DURATION}s per run, ${TUNNEL_PAYLOAD}-byte exchanges):"
+bandwidth=()
+for n in $TUNNEL_COUNTS; do
+    start_proxy 0 || exit 1
+    before=$(proxy_cpu_ticks)
+    out=$(load -c "$n" -d "$DURATION" -T "127.0.0.1:$ECHO_PORT" -b "$TUNNEL_PAYLOAD")
+    after=$(proxy_cpu_ticks)
+    stop_proxy
+    [ -z "$out" ] && { echo "bench: no result for $n tunnels" >&2; exit 1; }
+    cpu_per_gib=$(awk -v t=$((after - before)) -v hz="$CLK_TCK" -v b="$(field "$out" bytes)" \
+        'BEGIN { v = b > 0 ? (t / hz) / (2 * b / 1073741824) : 0; printf "%.3f", v }')
+    printf '  %4d tunnels: %9.2f MiB/s echoed, fairness %s, per-tunnel %s..%s MiB/s, proxy CPU %ss/GiB\n' \
+        "$n" "$(field "$out" mib_per_s)" "$(field "$out" fairness)" \
+        "$(field "$out" tunnel_min_mib_per_s)" "$(field "$out" tunnel_max_mib_per_s)" "$cpu_per_gib"
+    bandwidth+=("    \"$n\": ${out%\}},\"proxy_cpu_s_per_gib\":$cpu_per_gib}")
+done
+
+echo "Idle tunnels (probe: one tunnel doing 1 KiB round trips):"
+idle=()
+start_proxy 0 || exit 1
+base=$(load -c 1 -d "$DURATION" -T "127.0.0.1:$ECHO_PORT" -b 1024)
+stop_proxy
+base_p99=$(p99 "$base")
+printf '  %6d idle: probe p99 %sus\n' 0 "$base_p99"
+max_idle=0
+for n in $TUNNEL_IDLE_STEPS; do
+    start_proxy 0 || exit 1
+    out=$(load -c 1 -d "$DURATION" -T "127.0.0.1:$ECHO_PORT" -b 1024 -i "$n")
+    stop_proxy
+    est=$(field "$out" idle_established)
+    probe_p99=$(p99 "$out")
+    ok=$(awk -v est="${est:-0}" -v n="$n" -v req="$(field "$out" requests)" -v p="${probe_p99:-0}" \
+        -v bp="$base_p99" -v f="$TUNNEL_DEGRADE_FACTOR" 'BEGIN { print (est >= n && req > 0 && p <= bp * f) ? 1 : 0 }')
+    printf '  %6d idle: %s established, probe p99 %sus%s\n' "$n" "${est:-0}" "${probe_p99:-0}" \
+        "$([ "$ok" = 1 ] || echo "  DEGRADED")"
+    idle+=("{\"idle\":$n,\"established\":${est:-0},\"probe_requests\":$(field "$out" requests),\"probe_p99_us\":${probe_p99:-0},\"ok\":$ok}")
+    [ "$ok" = 1 ] || break
+    max_idle=$n
+done
+echo "Maximum concurrent idle tunnels before degradation: $max_idle"
+
+{
+    echo "{"
+    echo "  \"duration_s\": $DURATION,"
+    echo "  \"bandwidth\": {"
+    sep=""
+    for r in "${bandwidth[@]}"; do printf '%s%s' "$sep" "$r"; sep=$',\n'; done
+    printf '\n  },\n'
+    printf '  "idle": {"baseline_probe_p99_us":%s,"max_idle_tunnels":%s,"steps":[' "${base_p99:-0}" "$max_idle"
+    sep=""
+    for r in "${idle[@]}"; do printf '%s%s' "$sep" "$r"; sep=","; done
+    printf ']}\n}\n'
+} > "$RESULTS"
+echo "Results written to $RESULTS"
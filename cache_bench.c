@@ -0,0 +1,325 @@
+// cache_bench.c
+// Microbenchmark for the cache engine (proxy_cache.c) without sockets.
+//
+// Worker threads hammer one shared cache with a configurable mix of lookups
+// and inserts, like front workers serving hits and miss workers storing
+// responses. Keys follow a Zipf distribution and are built in the proxy's
+// binary key format. A lookup that misses inserts the object, as the proxy
+// does after an origin fetch, unless -n is given. Each thread count in -t
+// is run for the same duration and reports throughput, hit ratio and
+// per-operation latency percentiles.
+
+#include "proxy_cache.h"
+#include "proxy_cachemem.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 256
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB * 48)
+
+// --- Options ---
+static int thread_counts[64] = { 1, 2, 4, 8, 16, 32, 64 };
+static int n_thread_counts = 7;
+static int read_pct = 90;
+static uint32_t key_count = 100000;
+static double zipf_s = 0.99;
+static size_t size_min = 4096, size_max = 4096;
+static size_t capacity_mb = 256;
+static double duration = 2;
+static int huge_pages = 0;
+static const char *shared_name = NULL;
+static int fill_on_miss = 1;
+static int json = 0;
+
+static LRUCache *cache;
+static char *object_data;
+static double *zipf_cdf;
+static atomic_int stop;
+static pthread_barrier_t start_barrier;
+
+/* --- Latency histogram (log-linear, ~1.5% precision, nanoseconds) --- */
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total, max;
+} Histogram;
+
+static int hist_index(uint64_t v) {
+    if (v < 2 * HIST_SUB) return (int)v;
+    int exp = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    int idx = exp * HIST_SUB + (int)(v >> exp);
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_value(int idx) {
+    if (idx < 2 * HIST_SUB) return (uint64_t)idx;
+    int exp = idx / HIST_SUB - 1;
+    uint64_t sub = (uint64_t)(idx - exp * HIST_SUB);
+    return (sub << exp) + ((1ULL << exp) >> 1);
+}
+
+static void hist_merge(Histogram *into, const Histogram *h) {
+    for (int i = 0; i < HIST_BUCKETS; i++) into->counts[i] += h->counts[i];
+    into->total += h->total;
+    if (h->max > into->max) into->max = h->max;
+}
+
+static uint64_t hist_percentile(const Histogram *h, double p) {
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)ceil(p / 100.0 * h->total);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+typedef struct {
+    pthread_t tid;
+    uint64_t rng;
+    uint64_t gets, hits, puts;
+    Histogram get_lat, put_lat;
+} Worker;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift64(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static double uniform01(uint64_t *s) {
+    return (xorshift64(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint32_t pick_key(uint64_t *s) {
+    double u = uniform01(s);
+    uint32_t lo = 0, hi = key_count - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+// Same layout as the proxy's keys: host id, port, path
+static size_t make_key(char *buf, uint32_t k) {
+    uint32_t host_id = 1 + k % 64;
+    uint16_t port = 80;
+    memcpy(buf, &host_id, 4);
+    memcpy(buf + 4, &port, 2);
+    return 6 + (size_t)sprintf(buf + 6, "/objects/%u", k);
+}
+
+// Sizes are fixed per key so refills store the same object
+static size_t object_size(uint32_t k) {
+    if (size_max == size_min) return size_min;
+    uint64_t s = 0x9E3779B97F4A7C15ULL * (k + 1);
+    return size_min + (size_t)(uniform01(&s) * (double)(size_max - size_min));
+}
+
+static void record(Histogram *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max) h->max = v;
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = (Worker *)arg;
+    char key[64];
+    pthread_barrier_wait(&start_barrier);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        uint32_t k = pick_key(&w->rng);
+        size_t key_len = make_key(key, k);
+        int is_read = (int)(xorshift64(&w->rng) % 100) < read_pct;
+        uint64_t t0 = now_ns();
+        if (is_read) {
+            uint32_t slot;
+            CacheNode *n = get_from_cache(cache, key, key_len, &slot);
+            if (n) {
+                volatile char sink = cache_node_data(n)[0];
+                (void)sink;
+                release_cache_node(cache, slot);
+            }
+            uint64_t t1 = now_ns();
+            record(&w->get_lat, t1 - t0);
+            w->gets++;
+            if (n) { w->hits++; continue; }
+            if (!fill_on_miss) continue;
+            t0 = t1;
+        }
+        put_in_cache(cache, key, key_len, object_data, object_size(k));
+        record(&w->put_lat, now_ns() - t0);
+        w->puts++;
+    }
+    return NULL;
+}
+
+static void run(int threads) {
+    Worker *workers = (Worker *)calloc((size_t)threads, sizeof(Worker));
+    atomic_store(&stop, 0);
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)threads + 1);
+    for (int i = 0; i < threads; i++) {
+        workers[i].rng = 0x2545F4914F6CDD1DULL * (uint64_t)(i + 1) + (uint64_t)threads;
+        pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    usleep((useconds_t)(duration * 1e6));
+    atomic_store(&stop, 1);
+    Histogram *get_lat = (Histogram *)calloc(1, sizeof(Histogram));
+    Histogram *put_lat = (Histogram *)calloc(1, sizeof(Histogram));
+    uint64_t gets = 0, hits = 0, puts = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        gets += workers[i].gets; hits += workers[i].hits; puts += workers[i].puts;
+        hist_merge(get_lat, &workers[i].get_lat);
+        hist_merge(put_lat, &workers[i].put_lat);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    pthread_barrier_destroy(&start_barrier);
+
+    double ops = (gets + puts) / elapsed;
+    double hit_pct = gets ? 100.0 * hits / gets : 0;
+    if (json) {
+        printf("{\"threads\":%d,\"ops_per_s\":%.0f,\"gets\":%llu,\"puts\":%llu,\"hit_pct\":%.2f,"
+               "\"get_ns\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},"
+               "\"put_ns\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+               threads, ops, (unsigned long long)gets, (unsigned long long)puts, hit_pct,
+               (unsigned long long)hist_percentile(get_lat, 50), (unsigned long long)hist_percentile(get_lat, 99),
+               (unsigned long long)hist_percentile(get_lat, 99.9), (unsigned long long)get_lat->max,
+               (unsigned long long)hist_percentile(put_lat, 50), (unsigned long long)hist_percentile(put_lat, 99),
+               (unsigned long long)hist_percentile(put_lat, 99.9), (unsigned long long)put_lat->max);
+    } else {
+        printf("%7d %12.0f %7.2f %9llu %9llu %9llu %9llu %9llu\n", threads, ops, hit_pct,
+               (unsigned long long)hist_percentile(get_lat, 50), (unsigned long long)hist_percentile(get_lat, 99),
+               (unsigned long long)hist_percentile(get_lat, 99.9),
+               (unsigned long long)hist_percentile(put_lat, 50), (unsigned long long)hist_percentile(put_lat, 99));
+    }
+    fflush(stdout);
+    free(get_lat);
+    free(put_lat);
+    free(workers);
+}
+
+static int parse_threads(const char *list) {
+    n_thread_counts = 0;
+    for (const char *p = list; *p && n_thread_counts < 64; ) {
+        int t = atoi(p);
+        if (t < 1 || t > MAX_THREADS) return -1;
+        thread_counts[n_thread_counts++] = t;
+        p = strchr(p, ',');
+        if (!p) break;
+        p++;
+    }
+    return n_thread_counts > 0 ? 0 : -1;
+}
+
+static size_t parse_size(const char *s, char **end) {
+    double v = strtod(s, end);
+    if (**end == 'k' || **end == 'K') { v *= 1024; (*end)++; }
+    else if (**end == 'm' || **end == 'M') { v *= 1024 * 1024; (*end)++; }
+    return (size_t)v;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -t LIST     thread counts to run, comma separated (default 1,2,4,8,16,32,64)\n"
+            "  -r PCT      percentage of operations that are lookups (default 90)\n"
+            "  -k N        number of distinct keys (default 100000)\n"
+            "  -z S        Zipf exponent for key popularity, 0 = uniform (default 0.99)\n"
+            "  -s SIZE     object size, or MIN:MAX for a uniform range (default 4k)\n"
+            "  -c MB       cache capacity (default 256)\n"
+            "  -d SEC      duration of each run (default 2)\n"
+            "  -H          back the cache with huge pages (cache_huge_pages)\n"
+            "  -S NAME     use the shared-memory cache NAME (cache_shared), e.g. /bench_cache\n"
+            "  -n          do not insert on lookup misses\n"
+            "  -j          one JSON record per run\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    char *end;
+    while ((opt = getopt(argc, argv, "t:r:k:z:s:c:d:HS:nj")) != -1) {
+        switch (opt) {
+        case 't':
+            if (parse_threads(optarg) < 0) { usage(argv[0]); return EXIT_FAILURE; }
+            break;
+        case 'r': read_pct = atoi(optarg); break;
+        case 'k': key_count = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'z': zipf_s = atof(optarg); break;
+        case 's':
+            size_min = size_max = parse_size(optarg, &end);
+            if (*end == ':') size_max = parse_size(end + 1, &end);
+            break;
+        case 'c': capacity_mb = (size_t)atol(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'H': huge_pages = 1; break;
+        case 'S': shared_name = optarg; break;
+        case 'n': fill_on_miss = 0; break;
+        case 'j': json = 1; break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (key_count == 0 || size_max < size_min || size_max == 0 || read_pct < 0 || read_pct > 100) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t capacity = capacity_mb * 1024 * 1024;
+    CacheMemMode mode = cachemem_init(capacity, huge_pages);
+    if (shared_name) {
+        char err[256];
+        cache = create_shared_cache(shared_name, capacity, size_max, NULL, err, sizeof(err));
+        if (!cache) { fprintf(stderr, "%s: %s\n", shared_name, err); return EXIT_FAILURE; }
+    } else {
+        cache = create_cache(capacity, size_max, 1024);
+    }
+    object_data = (char *)malloc(size_max);
+    memset(object_data, 'x', size_max);
+
+    zipf_cdf = (double *)malloc(sizeof(double) * key_count);
+    double sum = 0;
+    for (uint32_t i = 0; i < key_count; i++) {
+        sum += 1.0 / pow(i + 1, zipf_s);
+        zipf_cdf[i] = sum;
+    }
+    for (uint32_t i = 0; i < key_count; i++) zipf_cdf[i] /= sum;
+
+    // Warm the cache with the most popular keys, up to its capacity
+    char key[64];
+    size_t warmed = 0;
+    for (uint32_t k = 0; k < key_count && warmed + object_size(k) <= capacity; k++) {
+        put_in_cache(cache, key, make_key(key, k), object_data, object_size(k));
+        warmed += object_size(k);
+    }
+
+    if (!json) {
+        printf("keys=%u zipf=%.2f reads=%d%% sizes=%zu..%zu capacity=%zuMB memory=%s fill_on_miss=%d\n",
+               key_count, zipf_s, read_pct, size_min, size_max, capacity_mb,
+               shared_name ? "shared" : cachemem_mode_name(mode), fill_on_miss);
+        printf("%7s %12s %7s %9s %9s %9s %9s %9s\n", "threads", "ops/s", "hit%",
+               "get p50", "get p99", "get p999", "put p50", "put p99");
+    }
+    for (int i = 0; i < n_thread_counts; i++) run(thread_counts[i]);
+    if (shared_name) close_shared_cache(cache); // the segment stays in /dev/shm for other runs
+    return 0;
+}
@@ -0,0 +1,355 @@
+// cache_warm.c
+// Preloads the proxy's cache from a list of URLs, after a deploy or ahead
+// of a known busy day, so that traffic arrives to a hot cache.
+//
+// The list has one absolute http:// URL per line (blank lines and lines
+// starting with '#' are skipped; "-" reads standard input). Every URL is
+// fetched through the proxy with at most -c requests in flight overall and
+// at most -H per origin host, taking hosts in turn so that a list dominated
+// by one site neither hammers it nor starves the others. Progress is
+// printed every second.
+//
+// Afterwards each URL is checked again with a HEAD request marked
+// Cache-Control: only-if-cached, so the check itself never goes to the
+// origin. URLs the proxy answers with X-Cache: HIT are resident, and their
+// Content-Length adds up to the cache footprint of the warmup. Objects that
+// were not cacheable, or were evicted again because the list is larger than
+// the cache, show up as the difference.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define DEFAULT_CONCURRENCY 16
+#define DEFAULT_PER_HOST 4
+#define DEFAULT_TIMEOUT_S 60
+#define MAX_URL_LEN 4096
+#define MAX_HOST_LEN 256
+#define HEAD_MAX 16384
+#define BODY_BUFFER 65536
+
+typedef struct {
+    char *url;
+    int host;               // index into hosts
+    int hit_before;         // the proxy already had it during the warm pass
+    int resident;           // X-Cache: HIT on the verify pass
+    uint64_t length;        // Content-Length reported on the verify pass
+} WarmUrl;
+
+typedef struct {
+    char name[MAX_HOST_LEN];  // host[:port] from the URL
+    int *queue;               // URL indices, in list order
+    size_t count, head;
+    int active;
+} Host;
+
+static WarmUrl *urls;
+static size_t url_count, url_cap;
+static Host *hosts;
+static int host_count, host_cap;
+
+static int g_concurrency = DEFAULT_CONCURRENCY;
+static int g_per_host = DEFAULT_PER_HOST;
+static int g_timeout_s = DEFAULT_TIMEOUT_S;
+static int g_verify = 1;
+static struct sockaddr_in proxy_addr;
+
+// Scheduling state for the current pass
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t host_freed = PTHREAD_COND_INITIALIZER;
+static size_t untaken;
+static int next_host;
+static const char *pass_method;
+
+static atomic_ulong done, failed, hits, body_bytes;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Authority (host[:port]) of an http:// URL, or -1 if it isn't one
+static int url_authority(const char *url, char *out, size_t len) {
+    if (strncasecmp(url, "http://", 7) != 0) return -1;
+    const char *start = url + 7;
+    size_t n = strcspn(start, "/?#");
+    if (n == 0 || n >= len) return -1;
+    memcpy(out, start, n);
+    out[n] = '\0';
+    return 0;
+}
+
+static int find_host(const char *name) {
+    for (int i = 0; i < host_count; i++) {
+        if (strcasecmp(hosts[i].name, name) == 0) return i;
+    }
+    if (host_count == host_cap) {
+        host_cap = host_cap ? host_cap * 2 : 16;
+        hosts = (Host *)realloc(hosts, host_cap * sizeof(Host));
+        if (!hosts) { perror("realloc"); exit(EXIT_FAILURE); }
+    }
+    Host *h = &hosts[host_count];
+    memset(h, 0, sizeof(*h));
+    snprintf(h->name, sizeof(h->name), "%s", name);
+    return host_count++;
+}
+
+static int load_urls(const char *path) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) { perror(path); return -1; }
+    char line[MAX_URL_LEN];
+    size_t skipped = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char *s = line;
+        while (*s == ' ' || *s == '\t') s++;
+        s[strcspn(s, "\r\n")] = '\0';
+        char *end = s + strlen(s);
+        while (end > s && (end[-1] == ' ' || end[-1] == '\t')) *--end = '\0';
+        if (*s == '\0' || *s == '#') continue;
+        char authority[MAX_HOST_LEN];
+        if (url_authority(s, authority, sizeof(authority)) < 0) {
+            skipped++;
+            continue;
+        }
+        if (url_count == url_cap) {
+            url_cap = url_cap ? url_cap * 2 : 1024;
+            urls = (WarmUrl *)realloc(urls, url_cap * sizeof(WarmUrl));
+            if (!urls) { perror("realloc"); exit(EXIT_FAILURE); }
+        }
+        WarmUrl *u = &urls[url_count++];
+        memset(u, 0, sizeof(*u));
+        u->url = strdup(s);
+        u->host = find_host(authority);
+        hosts[u->host].count++;
+    }
+    if (f != stdin) fclose(f);
+    if (skipped) fprintf(stderr, "Skipped %zu lines that are not http:// URLs\n", skipped);
+
+    for (int i = 0; i < host_count; i++) {
+        hosts[i].queue = (int *)malloc(hosts[i].count * sizeof(int));
+        if (!hosts[i].queue) { perror("malloc"); exit(EXIT_FAILURE); }
+        hosts[i].count = 0;
+    }
+    for (size_t i = 0; i < url_count; i++) {
+        Host *h = &hosts[urls[i].host];
+        h->queue[h->count++] = (int)i;
+    }
+    return 0;
+}
+
+// Next URL whose host is below its limit, taking hosts round robin; -1 when the pass is done
+static int take_url(void) {
+    pthread_mutex_lock(&sched_lock);
+    for (;;) {
+        if (untaken == 0) {
+            pthread_mutex_unlock(&sched_lock);
+            return -1;
+        }
+        for (int k = 0; k < host_count; k++) {
+            int i = (next_host + k) % host_count;
+            Host *h = &hosts[i];
+            if (h->head < h->count && h->active < g_per_host) {
+                int idx = h->queue[h->head++];
+                h->active++;
+                untaken--;
+                next_host = (i + 1) % host_count;
+                pthread_mutex_unlock(&sched_lock);
+                return idx;
+            }
+        }
+        pthread_cond_wait(&host_freed, &sched_lock);
+    }
+}
+
+static void release_host(int host) {
+    pthread_mutex_lock(&sched_lock);
+    hosts[host].active--;
+    pthread_cond_broadcast(&host_freed);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+static const char *find_header(const char *head, const char *name) {
+    size_t nlen = strlen(name);
+    for (const char *line = strstr(head, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, name, nlen) == 0 && line[2 + nlen] == ':') {
+            const char *v = line + 3 + nlen;
+            while (*v == ' ') v++;
+            return v;
+        }
+    }
+    return NULL;
+}
+
+// One request through the proxy. Returns the status (0 on a transport error).
+static int fetch(WarmUrl *u, const char *method, int *hit, uint64_t *content_length, uint64_t *body) {
+    *hit = 0; *content_length = 0; *body = 0;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return 0;
+    struct timeval tv = { g_timeout_s, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) < 0) {
+        close(fd);
+        return 0;
+    }
+    char request[MAX_URL_LEN + MAX_HOST_LEN + 128];
+    int verify = strcmp(method, "HEAD") == 0;
+    int len = snprintf(request, sizeof(request), "%s %s HTTP/1.1\r\nHost: %s\r\n%sConnection: close\r\n\r\n",
+                       method, u->url, hosts[u->host].name, verify ? "Cache-Control: only-if-cached\r\n" : "");
+    if (send(fd, request, (size_t)len, MSG_NOSIGNAL) != len) {
+        close(fd);
+        return 0;
+    }
+
+    char *buf = (char *)malloc(BODY_BUFFER);
+    if (!buf) { close(fd); return 0; }
+    size_t have = 0;
+    char *head_end = NULL;
+    ssize_t n;
+    while (!head_end && have < HEAD_MAX && (n = recv(fd, buf + have, HEAD_MAX - have, 0)) > 0) {
+        have += (size_t)n;
+        buf[have] = '\0';
+        head_end = strstr(buf, "\r\n\r\n");
+    }
+    int status = 0;
+    if (head_end) {
+        head_end[2] = '\0';  // headers only, for the lookups below
+        if (sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1) status = 0;
+        const char *x_cache = find_header(buf, "X-Cache");
+        *hit = x_cache && strncasecmp(x_cache, "HIT", 3) == 0;
+        const char *cl = find_header(buf, "Content-Length");
+        if (cl) *content_length = strtoull(cl, NULL, 10);
+        *body = have - (size_t)(head_end + 4 - buf);
+        while ((n = recv(fd, buf, BODY_BUFFER, 0)) > 0) *body += (size_t)n;
+        if (n < 0) status = 0;  // timed out mid-body
+    }
+    free(buf);
+    close(fd);
+    return status;
+}
+
+static void *worker(void *arg) {
+    (void)arg;
+    int idx;
+    while ((idx = take_url()) >= 0) {
+        WarmUrl *u = &urls[idx];
+        int hit;
+        uint64_t length, body;
+        int status = fetch(u, pass_method, &hit, &length, &body);
+        if (strcmp(pass_method, "GET") == 0) {
+            u->hit_before = hit;
+            if (hit) atomic_fetch_add(&hits, 1);
+            atomic_fetch_add(&body_bytes, body);
+            if (status < 200 || status >= 400) {
+                atomic_fetch_add(&failed, 1);
+                fprintf(stderr, "warm: %s: %s\n", u->url, status ? "error status" : "request failed");
+            }
+        } else {
+            u->resident = hit;
+            u->length = length;
+        }
+        atomic_fetch_add(&done, 1);
+        release_host(u->host);
+    }
+    return NULL;
+}
+
+// Runs one pass over every URL; prints progress each second unless quiet
+static double run_pass(const char *method, int quiet) {
+    pass_method = method;
+    untaken = url_count;
+    next_host = 0;
+    for (int i = 0; i < host_count; i++) hosts[i].head = 0;
+    atomic_store(&done, 0);
+
+    int threads = g_concurrency < (int)url_count ? g_concurrency : (int)url_count;
+    pthread_t *tids = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    double start = now_s();
+    for (int i = 0; i < threads; i++) pthread_create(&tids[i], NULL, worker, NULL);
+    while (!quiet && atomic_load(&done) < url_count) {
+        sleep(1);
+        unsigned long d = atomic_load(&done);
+        double elapsed = now_s() - start;
+        fprintf(stderr, "  %lu/%zu (%.0f%%) %lu failed, %.1f MB, %.0f URLs/s\n", d, url_count,
+                100.0 * d / url_count, atomic_load(&failed), atomic_load(&body_bytes) / 1048576.0,
+                elapsed > 0 ? d / elapsed : 0.0);
+    }
+    for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+    free(tids);
+    return now_s() - start;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <url file|-> <proxy host> <proxy port>\n"
+            "  -c N      requests in flight (default %d)\n"
+            "  -H N      requests in flight per origin host (default %d)\n"
+            "  -t SEC    timeout per request (default %d)\n"
+            "  -n        skip the HEAD pass that measures the resulting cache footprint\n"
+            "  -q        no progress lines\n",
+            prog, DEFAULT_CONCURRENCY, DEFAULT_PER_HOST, DEFAULT_TIMEOUT_S);
+}
+
+int main(int argc, char *argv[]) {
+    int opt, quiet = 0;
+    while ((opt = getopt(argc, argv, "c:H:t:nqh")) != -1) {
+        switch (opt) {
+        case 'c': g_concurrency = atoi(optarg); break;
+        case 'H': g_per_host = atoi(optarg); break;
+        case 't': g_timeout_s = atoi(optarg); break;
+        case 'n': g_verify = 0; break;
+        case 'q': quiet = 1; break;
+        default: usage(argv[0]); exit(opt == 'h' ? 0 : EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 3 || g_concurrency < 1 || g_per_host < 1 || g_timeout_s < 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    struct hostent *proxy = gethostbyname(argv[optind + 1]);
+    if (!proxy) {
+        fprintf(stderr, "Cannot resolve proxy host %s\n", argv[optind + 1]);
+        exit(EXIT_FAILURE);
+    }
+    memset(&proxy_addr, 0, sizeof(proxy_addr));
+    proxy_addr.sin_family = AF_INET;
+    proxy_addr.sin_port = htons(atoi(argv[optind + 2]));
+    memcpy(&proxy_addr.sin_addr, proxy->h_addr, proxy->h_length);
+
+    if (load_urls(argv[optind]) < 0) exit(EXIT_FAILURE);
+    if (url_count == 0) {
+        fprintf(stderr, "No URLs to warm\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Warming %zu URLs on %d hosts (%d in flight, %d per host)\n", url_count, host_count, g_concurrency, g_per_host);
+    double elapsed = run_pass("GET", quiet);
+    unsigned long n_failed = atomic_load(&failed), n_hits = atomic_load(&hits);
+    printf("Warmed in %.1fs: %lu fetched, %lu already cached, %lu failed, %.1f MB\n", elapsed,
+           (unsigned long)url_count - n_hits - n_failed, n_hits, n_failed, atomic_load(&body_bytes) / 1048576.0);
+
+    if (g_verify) {
+        run_pass("HEAD", 1);
+        size_t resident = 0;
+        uint64_t footprint = 0;
+        for (size_t i = 0; i < url_count; i++) {
+            if (!urls[i].resident) continue;
+            resident++;
+            footprint += urls[i].length;
+        }
+        printf("Cache footprint: %zu of %zu URLs resident (%.1f%%), %.1f MB of bodies\n", resident, url_count,
+               100.0 * resident / url_count, footprint / 1048576.0);
+    }
+    return n_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
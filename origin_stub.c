@@ -0,0 +1,548 @@
+// origin_stub.c
+// A small origin server for offline benchmarks of the proxy.
+//
+// Every path names a synthetic object. Its size comes from the configured
+// size distribution seeded by a hash of the path, so the same URL always
+// returns the same bytes (and the same ETag) and can be cached. Query
+// parameters override the defaults per request:
+//
+//   size=N     body size in bytes (k/m suffixes allowed)
+//   delay=MS   response latency in milliseconds
+//   chunked=1  use Transfer-Encoding: chunked instead of Content-Length
+//   nocache=1  send Cache-Control: no-store
+//   ranges=0   don't advertise or honor byte ranges
+//   rate=KB    send the body at no more than KB kilobytes per second
+//   html=N     serve an HTML page that references N subresources (size is ignored)
+//
+// Objects sent with Content-Length support single byte ranges (Range,
+// If-Range), answered with 206 Partial Content.
+//
+// A CONNECT request, or any connection to the echo port, becomes a raw echo
+// so the proxy's tunnel path can be exercised without leaving the machine.
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define REQUEST_MAX 16384
+#define PATTERN_SIZE (1024 * 1024)
+#define STUB_CHUNK_SIZE 65536
+#define THREAD_STACK_SIZE (128 * 1024)
+
+typedef enum { DIST_FIXED, DIST_UNIFORM, DIST_PARETO } SizeDist;
+
+// --- Configuration (set from the command line) ---
+static const char *g_bind_addr = "127.0.0.1";
+static int g_port = 9080;
+static int g_echo_port = 0;
+static SizeDist g_dist = DIST_FIXED;
+static size_t g_size_a = 16384;     // fixed size, uniform min, pareto min
+static double g_size_b = 0;         // uniform max, pareto alpha
+static size_t g_size_max = 64 * 1024 * 1024;
+static int g_latency_ms = 0;
+static int g_jitter_ms = 0;
+static int g_chunked = 0;
+static int g_max_age = 3600;
+static int g_rate_kb = 0;           // per-response bandwidth cap, KB/s; 0 = unlimited
+
+static char *g_pattern;
+static atomic_ulong stat_requests, stat_bytes, stat_not_modified, stat_tunnels, stat_ranges;
+
+typedef struct {
+    int fd;
+    int echo_only;
+} Conn;
+
+static size_t parse_size(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    if (*end == 'k' || *end == 'K') v *= 1024;
+    else if (*end == 'm' || *end == 'M') v *= 1024 * 1024;
+    else if (*end == 'g' || *end == 'G') v *= 1024.0 * 1024 * 1024;
+    return v < 0 ? 0 : (size_t)v;
+}
+
+// fixed:N | uniform:MIN:MAX | pareto:MIN:ALPHA
+static int parse_distribution(const char *spec) {
+    if (strncmp(spec, "fixed:", 6) == 0) {
+        g_dist = DIST_FIXED;
+        g_size_a = parse_size(spec + 6);
+        return 0;
+    }
+    const char *colon = strchr(spec, ':');
+    const char *second = colon ? strchr(colon + 1, ':') : NULL;
+    if (!second) return -1;
+    if (strncmp(spec, "uniform:", 8) == 0) {
+        g_dist = DIST_UNIFORM;
+        g_size_a = parse_size(colon + 1);
+        g_size_b = (double)parse_size(second + 1);
+        return g_size_b >= g_size_a ? 0 : -1;
+    }
+    if (strncmp(spec, "pareto:", 7) == 0) {
+        g_dist = DIST_PARETO;
+        g_size_a = parse_size(colon + 1);
+        g_size_b = atof(second + 1);
+        return g_size_b > 0 ? 0 : -1;
+    }
+    return -1;
+}
+
+static uint64_t path_hash(const char *s, size_t len) { /* FNV-1a */
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) { h ^= (unsigned char)s[i]; h *= 1099511628211ULL; }
+    return h;
+}
+
+static size_t object_size(uint64_t h) {
+    double u = (h >> 11) * (1.0 / 9007199254740992.0);
+    double size;
+    switch (g_dist) {
+    case DIST_UNIFORM: size = g_size_a + u * (g_size_b - g_size_a); break;
+    case DIST_PARETO:  size = g_size_a / pow(1.0 - u, 1.0 / g_size_b); break;
+    default:           size = (double)g_size_a; break;
+    }
+    return size > (double)g_size_max ? g_size_max : (size_t)size;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Sends len bytes of the object starting at offset, in pattern-sized pieces
+static int send_body(int fd, uint64_t offset, size_t len) {
+    while (len > 0) {
+        size_t pos = (size_t)(offset % PATTERN_SIZE);
+        size_t n = PATTERN_SIZE - pos < len ? PATTERN_SIZE - pos : len;
+        if (send_all(fd, g_pattern + pos, n) < 0) return -1;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// send_body at no more than kb_per_sec (0 = unlimited), like an origin that
+// caps each connection's bandwidth
+static int send_body_paced(int fd, uint64_t offset, size_t len, int kb_per_sec) {
+    if (kb_per_sec <= 0) return send_body(fd, offset, len);
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double bytes_per_ns = kb_per_sec * 1024.0 / 1e9;
+    size_t sent = 0;
+    while (sent < len) {
+        size_t n = len - sent < STUB_CHUNK_SIZE ? len - sent : STUB_CHUNK_SIZE;
+        if (send_body(fd, offset + sent, n) < 0) return -1;
+        sent += n;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed_ns = (now.tv_sec - start.tv_sec) * 1e9 + (now.tv_nsec - start.tv_nsec);
+        double ahead_ns = sent / bytes_per_ns - elapsed_ns;
+        if (ahead_ns > 0) {
+            struct timespec ts = { (time_t)(ahead_ns / 1e9), (long)((long long)ahead_ns % 1000000000LL) };
+            while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+        }
+    }
+    return 0;
+}
+
+static int send_chunked_body(int fd, size_t len) {
+    char line[32];
+    uint64_t offset = 0;
+    while (len > 0) {
+        size_t n = len < STUB_CHUNK_SIZE ? len : STUB_CHUNK_SIZE;
+        int l = snprintf(line, sizeof(line), "%zx\r\n", n);
+        if (send_all(fd, line, (size_t)l) < 0 || send_body(fd, offset, n) < 0 || send_all(fd, "\r\n", 2) < 0) return -1;
+        offset += n;
+        len -= n;
+    }
+    return send_all(fd, "0\r\n\r\n", 5);
+}
+
+static void echo_loop(int fd, const char *pending, size_t pending_len) {
+    char buf[65536];
+    atomic_fetch_add(&stat_tunnels, 1);
+    if (pending_len > 0 && send_all(fd, pending, pending_len) < 0) return;
+    for (;;) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || send_all(fd, buf, (size_t)n) < 0) return;
+    }
+}
+
+static void sleep_ms(int ms) {
+    if (ms <= 0) return;
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+}
+
+// Looks up a query parameter; returns a pointer to its value or NULL
+static const char *query_param(const char *query, const char *name) {
+    size_t nlen = strlen(name);
+    for (const char *p = query; p && *p; ) {
+        if (strncmp(p, name, nlen) == 0 && p[nlen] == '=') return p + nlen + 1;
+        p = strchr(p, '&');
+        if (p) p++;
+    }
+    return NULL;
+}
+
+static const char *find_header(const char *headers, const char *name) {
+    size_t nlen = strlen(name);
+    for (const char *line = strstr(headers, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, name, nlen) == 0 && line[2 + nlen] == ':') {
+            const char *v = line + 3 + nlen;
+            while (*v == ' ') v++;
+            return v;
+        }
+    }
+    return NULL;
+}
+
+// An HTML page for path that links n subresources next to it, in the forms
+// pages use: relative, root-relative and unquoted. It also has a navigation
+// link and a cross-origin image, which a prefetcher should leave alone.
+// Returns a malloc'd page and sets *len.
+static char *html_page(const char *path, size_t path_len, int n, size_t *len) {
+    size_t dir_len = path_len;
+    while (dir_len > 0 && path[dir_len - 1] != '/') dir_len--;
+    const char *leaf = path + dir_len;
+    int leaf_len = (int)(path_len - dir_len), d = (int)dir_len;
+    size_t cap = 256 + (size_t)n * (path_len + 64), used = 0;
+    char *page = (char *)malloc(cap);
+    if (!page) return NULL;
+    used += snprintf(page + used, cap - used, "<!DOCTYPE html>\n<html><head><title>%.*s</title></head>\n<body>\n",
+                     leaf_len, leaf);
+    for (int i = 0; i < n; i++) {
+        switch (i % 3) {
+        case 0: used += snprintf(page + used, cap - used, "<link rel=\"stylesheet\" href=\"%.*s-%d.css\">\n", leaf_len, leaf, i); break;
+        case 1: used += snprintf(page + used, cap - used, "<script src='%.*s%.*s-%d.js'></script>\n", d, path, leaf_len, leaf, i); break;
+        default: used += snprintf(page + used, cap - used, "<img alt=\"\" src=%.*s-%d.png>\n", leaf_len, leaf, i); break;
+        }
+    }
+    used += snprintf(page + used, cap - used, "<p><a href=\"%.*s-next.html\">next</a>"
+                     "<img src=\"https://elsewhere.example/logo.png\"></p>\n</body></html>\n", leaf_len, leaf);
+    *len = used;
+    return page;
+}
+
+// Parses a single "bytes=" range against an object of size bytes.
+// Returns 1 with [*first, *last] set, 0 if there is no usable range header,
+// or -1 if the range can't be satisfied.
+static int parse_range(const char *v, size_t size, uint64_t *first, uint64_t *last) {
+    if (!v || strncmp(v, "bytes=", 6) != 0) return 0;
+    v += 6;
+    char *end;
+    if (*v == '-') {  // suffix: the last N bytes
+        uint64_t n = strtoull(v + 1, &end, 10);
+        if (end == v + 1 || n == 0 || size == 0) return -1;
+        *first = n >= size ? 0 : size - n;
+        *last = size - 1;
+        return 1;
+    }
+    *first = strtoull(v, &end, 10);
+    if (end == v || *end != '-') return 0;
+    const char *l = end + 1;
+    *last = (*l >= '0' && *l <= '9') ? strtoull(l, &end, 10) : size - 1;
+    if (*first >= size || *last < *first) return -1;
+    if (*last >= size) *last = size - 1;
+    return 1;
+}
+
+// Serves one request from buf; returns 1 to keep the connection open
+static int serve_request(int fd, char *buf, size_t header_len, size_t have, unsigned int *seed) {
+    char method[16], target[4096], version[16];
+    buf[header_len - 2] = '\0';
+    if (sscanf(buf, "%15s %4095s %15s", method, target, version) != 3) {
+        const char *bad = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(fd, bad, strlen(bad));
+        return 0;
+    }
+
+    if (strcmp(method, "CONNECT") == 0) {
+        const char *ok = "HTTP/1.1 200 Connection established\r\n\r\n";
+        if (send_all(fd, ok, strlen(ok)) == 0) echo_loop(fd, buf + header_len, have - header_len);
+        return 0;
+    }
+
+    // Accept absolute-form targets too
+    char *path = target;
+    char *scheme = strstr(target, "://");
+    if (scheme) {
+        path = strchr(scheme + 3, '/');
+        if (!path) path = "/";
+    }
+    char *query = strchr(path, '?');
+    size_t path_len = query ? (size_t)(query - path) : strlen(path);
+    if (query) query++;
+
+    uint64_t h = path_hash(path, path_len);
+    const char *v;
+    size_t size = (v = query_param(query, "size")) ? parse_size(v) : object_size(h);
+    int delay = (v = query_param(query, "delay")) ? atoi(v) : g_latency_ms;
+    int chunked = (v = query_param(query, "chunked")) ? atoi(v) : g_chunked;
+    int nocache = (v = query_param(query, "nocache")) ? atoi(v) : g_max_age <= 0;
+    int ranges = !chunked && !((v = query_param(query, "ranges")) && atoi(v) == 0);
+    int rate_kb = (v = query_param(query, "rate")) ? atoi(v) : g_rate_kb;
+    if (g_jitter_ms > 0 && !query_param(query, "delay")) delay += (int)(rand_r(seed) % (unsigned)(g_jitter_ms + 1));
+    char *page = NULL;
+    if ((v = query_param(query, "html")) && atoi(v) > 0 && (page = html_page(path, path_len, atoi(v), &size))) {
+        chunked = 0;
+        ranges = 0;
+    }
+
+    int keep_alive = strcmp(version, "HTTP/1.1") == 0;
+    const char *conn_hdr = find_header(buf, "Connection");
+    if (conn_hdr) keep_alive = strncasecmp(conn_hdr, "keep-alive", 10) == 0 || (keep_alive && strncasecmp(conn_hdr, "close", 5) != 0);
+    int head_only = strcmp(method, "HEAD") == 0;
+
+    sleep_ms(delay);
+    atomic_fetch_add(&stat_requests, 1);
+
+    char etag[40];
+    snprintf(etag, sizeof(etag), "\"%016llx-%zx\"", (unsigned long long)h, size);
+    const char *inm = find_header(buf, "If-None-Match");
+    if (inm && strncmp(inm, etag, strlen(etag)) == 0) {
+        char resp[256];
+        int l = snprintf(resp, sizeof(resp), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nConnection: %s\r\n\r\n",
+                         etag, keep_alive ? "keep-alive" : "close");
+        atomic_fetch_add(&stat_not_modified, 1);
+        free(page);
+        return send_all(fd, resp, (size_t)l) == 0 && keep_alive;
+    }
+
+    uint64_t first = 0, last = size ? size - 1 : 0;
+    int range = 0;
+    if (ranges) {
+        const char *if_range = find_header(buf, "If-Range");
+        if (!if_range || strncmp(if_range, etag, strlen(etag)) == 0) range = parse_range(find_header(buf, "Range"), size, &first, &last);
+    }
+    if (range < 0) {
+        char resp[256];
+        int l = snprintf(resp, sizeof(resp), "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%zu\r\n"
+                         "Content-Length: 0\r\nConnection: %s\r\n\r\n", size, keep_alive ? "keep-alive" : "close");
+        return send_all(fd, resp, (size_t)l) == 0 && keep_alive;
+    }
+
+    char cache_control[64];
+    if (nocache) snprintf(cache_control, sizeof(cache_control), "no-store");
+    else snprintf(cache_control, sizeof(cache_control), "public, max-age=%d", g_max_age);
+    char framing[128];
+    size_t body_len = range ? (size_t)(last - first + 1) : size;
+    if (chunked) snprintf(framing, sizeof(framing), "Transfer-Encoding: chunked");
+    else if (range) snprintf(framing, sizeof(framing), "Content-Range: bytes %llu-%llu/%zu\r\nContent-Length: %zu",
+                             (unsigned long long)first, (unsigned long long)last, size, body_len);
+    else snprintf(framing, sizeof(framing), "Content-Length: %zu", size);
+
+    char resp[512];
+    int l = snprintf(resp, sizeof(resp),
+                     "HTTP/1.1 %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "%s\r\n"
+                     "%s"
+                     "Cache-Control: %s\r\n"
+                     "ETag: %s\r\n"
+                     "Last-Modified: Thu, 01 Jan 2026 00:00:00 GMT\r\n"
+                     "Connection: %s\r\n\r\n",
+                     range ? "206 Partial Content" : "200 OK", page ? "text/html" : "application/octet-stream", framing, ranges ? "Accept-Ranges: bytes\r\n" : "",
+                     cache_control, etag, keep_alive ? "keep-alive" : "close");
+    int ok = send_all(fd, resp, (size_t)l) == 0;
+    if (ok && range) atomic_fetch_add(&stat_ranges, 1);
+    if (ok && !head_only) {
+        if (page) ok = send_all(fd, page, size) == 0;
+        else ok = (chunked ? send_chunked_body(fd, size) : send_body_paced(fd, first, body_len, rate_kb)) == 0;
+        if (ok) atomic_fetch_add(&stat_bytes, body_len);
+    }
+    free(page);
+    return ok && keep_alive;
+}
+
+static void *connection_thread(void *arg) {
+    Conn *c = (Conn *)arg;
+    int fd = c->fd;
+    int echo_only = c->echo_only;
+    free(c);
+
+    if (echo_only) {
+        echo_loop(fd, NULL, 0);
+        close(fd);
+        return NULL;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    unsigned int seed = (unsigned int)(uintptr_t)&seed ^ (unsigned int)time(NULL);
+    char buf[REQUEST_MAX + 1];
+    size_t have = 0;
+    for (;;) {
+        char *end;
+        buf[have] = '\0';
+        while (!(end = strstr(buf, "\r\n\r\n"))) {
+            if (have >= REQUEST_MAX) goto done;
+            ssize_t n = recv(fd, buf + have, REQUEST_MAX - have, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) goto done;
+            have += (size_t)n;
+            buf[have] = '\0';
+        }
+        size_t header_len = (size_t)(end - buf) + 4;
+        if (!serve_request(fd, buf, header_len, have, &seed)) break;
+        // Keep any pipelined bytes for the next request
+        memmove(buf, buf + header_len, have - header_len);
+        have -= header_len;
+    }
+done:
+    close(fd);
+    return NULL;
+}
+
+static int open_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); exit(EXIT_FAILURE); }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, g_bind_addr, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid bind address %s\n", g_bind_addr);
+        exit(EXIT_FAILURE);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("bind"); exit(EXIT_FAILURE); }
+    if (listen(fd, 4096) < 0) { perror("listen"); exit(EXIT_FAILURE); }
+    return fd;
+}
+
+typedef struct {
+    int fd;
+    int echo_only;
+} Listener;
+
+static void *listener_thread(void *arg) {
+    Listener *l = (Listener *)arg;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    for (;;) {
+        int fd = accept(l->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE) { sleep_ms(10); continue; }
+            break;
+        }
+        Conn *c = (Conn *)malloc(sizeof(Conn));
+        c->fd = fd;
+        c->echo_only = l->echo_only;
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, connection_thread, c) != 0) {
+            close(fd);
+            free(c);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return NULL;
+}
+
+static volatile sig_atomic_t g_stop = 0;
+static void stop_handler(int sig) { (void)sig; g_stop = 1; }
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -p PORT      HTTP port (default 9080)\n"
+            "  -e PORT      raw echo port for CONNECT tunnels (default off)\n"
+            "  -b ADDR      bind address (default 127.0.0.1)\n"
+            "  -s DIST      object sizes: fixed:N, uniform:MIN:MAX or pareto:MIN:ALPHA (default fixed:16k)\n"
+            "  -M SIZE      cap for generated sizes (default 64m)\n"
+            "  -l MS        response latency in milliseconds\n"
+            "  -j MS        extra random latency of up to MS milliseconds\n"
+            "  -c           chunked transfer encoding by default\n"
+            "  -a SECONDS   Cache-Control max-age; 0 sends no-store (default 3600)\n"
+            "  -r KB        cap each Content-Length response at KB kilobytes per second\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:e:b:s:M:l:j:ca:r:h")) != -1) {
+        switch (opt) {
+        case 'p': g_port = atoi(optarg); break;
+        case 'e': g_echo_port = atoi(optarg); break;
+        case 'b': g_bind_addr = optarg; break;
+        case 's':
+            if (parse_distribution(optarg) < 0) {
+                fprintf(stderr, "Invalid size distribution: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'M': g_size_max = parse_size(optarg); break;
+        case 'l': g_latency_ms = atoi(optarg); break;
+        case 'j': g_jitter_ms = atoi(optarg); break;
+        case 'c': g_chunked = 1; break;
+        case 'a': g_max_age = atoi(optarg); break;
+        case 'r': g_rate_kb = atoi(optarg); break;
+        default: usage(argv[0]); exit(opt == 'h' ? 0 : EXIT_FAILURE);
+        }
+    }
+
+    g_pattern = (char *)malloc(PATTERN_SIZE);
+    for (size_t i = 0; i < PATTERN_SIZE; i++) g_pattern[i] = (char)('A' + (i * 7 + i / 64) % 26);
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // Listener threads must not take the stop signals, so main sees them
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    Listener http = { open_listener(g_port), 0 };
+    Listener echo = { g_echo_port ? open_listener(g_echo_port) : -1, 1 };
+    pthread_t tid;
+    pthread_create(&tid, NULL, listener_thread, &http);
+    pthread_detach(tid);
+    if (echo.fd >= 0) {
+        pthread_create(&tid, NULL, listener_thread, &echo);
+        pthread_detach(tid);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    printf("origin_stub listening on %s:%d", g_bind_addr, g_port);
+    if (g_echo_port) printf(", echo on %d", g_echo_port);
+    printf("\n");
+    fflush(stdout);
+
+    while (!g_stop) pause();
+
+    printf("origin_stub: %lu requests, %lu body bytes, %lu not modified, %lu ranges, %lu tunnels\n",
+           atomic_load(&stat_requests), atomic_load(&stat_bytes),
+           atomic_load(&stat_not_modified), atomic_load(&stat_ranges), atomic_load(&stat_tunnels));
+    return 0;
+}
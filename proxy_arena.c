@@ -0,0 +1,66 @@
+/*
+ * proxy_arena.c -- bump-pointer arena for per-request allocations.
+ */
+#include "proxy_arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+};
+
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define CHUNK_HEADER ALIGN_UP(sizeof(struct ArenaChunk))
+
+int arena_init(Arena *a, size_t size) {
+    memset(a, 0, sizeof(*a));
+    a->base = (char *)malloc(size);
+    if (a->base == NULL) return -1;
+    a->size = size;
+    return 0;
+}
+
+void *arena_alloc(Arena *a, size_t n) {
+    n = ALIGN_UP(n ? n : 1);
+    if (a->used + n <= a->size) {
+        void *p = a->base + a->used;
+        a->used += n;
+        if (a->used > a->high_water) a->high_water = a->used;
+        return p;
+    }
+    // Does not fit: give it its own chunk, freed on reset
+    struct ArenaChunk *c = (struct ArenaChunk *)malloc(CHUNK_HEADER + n);
+    if (c == NULL) return NULL;
+    c->next = a->overflow;
+    a->overflow = c;
+    return (char *)c + CHUNK_HEADER;
+}
+
+char *arena_strndup(Arena *a, const char *s, size_t n) {
+    char *d = (char *)arena_alloc(a, n + 1);
+    if (d != NULL) {
+        memcpy(d, s, n);
+        d[n] = '\0';
+    }
+    return d;
+}
+
+char *arena_strdup(Arena *a, const char *s) {
+    return arena_strndup(a, s, strlen(s));
+}
+
+void arena_reset(Arena *a) {
+    while (a->overflow) {
+        struct ArenaChunk *next = a->overflow->next;
+        free(a->overflow);
+        a->overflow = next;
+    }
+    a->used = 0;
+}
+
+void arena_destroy(Arena *a) {
+    arena_reset(a);
+    free(a->base);
+    a->base = NULL;
+    a->size = 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * proxy_arena.h -- a bump-pointer arena for per-request allocations.
+ *
+ * An Arena owns one fixed block that allocations are carved from by bumping
+ * an offset. Requests that do not fit in the block spill into individually
+ * malloc'd overflow chunks. Nothing is freed individually: arena_reset()
+ * releases everything at once and keeps the main block for the next request.
+ */
+
+#include <stddef.h>
+
+#ifndef PROXY_ARENA
+#define PROXY_ARENA
+
+#define ARENA_ALIGN 16
+
+struct ArenaChunk;
+
+typedef struct Arena {
+     char *base;
+     size_t size;
+     size_t used;
+     size_t high_water;     /* most of the main block in use at once, across resets */
+     struct ArenaChunk *overflow;
+} Arena;
+
+/* Allocate the main block of `size` bytes. Returns 0 on success, -1 on
+ * failure. */
+int arena_init(Arena *a, size_t size);
+
+/* Return `n` bytes aligned to ARENA_ALIGN, or NULL if out of memory. */
+void *arena_alloc(Arena *a, size_t n);
+
+/* Copy a NUL-terminated string, or its first n bytes, into the arena. */
+char *arena_strdup(Arena *a, const char *s);
+char *arena_strndup(Arena *a, const char *s, size_t n);
+
+/* Release every allocation at once; the main block is kept. */
+void arena_reset(Arena *a);
+
+/* Release the main block and any overflow chunks. */
+void arena_destroy(Arena *a);
+
+#endif
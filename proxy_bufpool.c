@@ -0,0 +1,142 @@
+/*
+ * proxy_bufpool.c -- recycled fixed-size I/O buffers with thread-local caches.
+ */
+#include "proxy_bufpool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define LOCAL_MAX 8   // per thread, per class
+#define REFILL 4      // buffers moved from the global list at once
+
+struct FreeBuf {
+    struct FreeBuf *next;
+};
+
+struct FreeList {
+    struct FreeBuf *head;
+    int count;
+};
+
+static const size_t class_size[BUF_CLASS_COUNT] = { BUF_SIZE_SMALL, BUF_SIZE_MEDIUM, BUF_SIZE_LARGE };
+
+static struct FreeList global_free[BUF_CLASS_COUNT];
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static int global_max = 64;
+
+static __thread struct FreeList local_free[BUF_CLASS_COUNT];
+static pthread_key_t flush_key;
+static pthread_once_t flush_once = PTHREAD_ONCE_INIT;
+
+static struct {
+    _Atomic unsigned long gets, local_hits, global_hits, mallocs;
+    _Atomic long in_use, in_use_high_water, allocated;
+} stats[BUF_CLASS_COUNT];
+
+static int size_to_class(size_t size) {
+    for (int c = 0; c < BUF_CLASS_COUNT; c++) {
+        if (size <= class_size[c]) return c;
+    }
+    return -1;
+}
+
+static struct FreeBuf *pop(struct FreeList *l) {
+    struct FreeBuf *b = l->head;
+    if (b) {
+        l->head = b->next;
+        l->count--;
+    }
+    return b;
+}
+
+static void push(struct FreeList *l, struct FreeBuf *b) {
+    b->next = l->head;
+    l->head = b;
+    l->count++;
+}
+
+// Move up to n buffers from one list to another
+static void transfer(struct FreeList *from, struct FreeList *to, int n) {
+    struct FreeBuf *b;
+    while (n-- > 0 && (b = pop(from)) != NULL) push(to, b);
+}
+
+static void release_to_global(int cls, struct FreeList *l, int n) {
+    pthread_mutex_lock(&global_lock);
+    transfer(l, &global_free[cls], n);
+    while (global_free[cls].count > global_max) {
+        free(pop(&global_free[cls]));
+        stats[cls].allocated--;
+    }
+    pthread_mutex_unlock(&global_lock);
+}
+
+// Thread exit: give this thread's cached buffers back to everyone
+static void flush_local(void *unused) {
+    for (int c = 0; c < BUF_CLASS_COUNT; c++) {
+        release_to_global(c, &local_free[c], local_free[c].count);
+    }
+}
+
+static void make_flush_key(void) {
+    pthread_key_create(&flush_key, flush_local);
+}
+
+void bufpool_init(int global_max_per_class) {
+    if (global_max_per_class >= 0) global_max = global_max_per_class;
+    pthread_once(&flush_once, make_flush_key);
+}
+
+char *bufpool_get(size_t size, size_t *cap) {
+    int cls = size_to_class(size);
+    if (cls < 0) return NULL;
+    stats[cls].gets++;
+
+    struct FreeBuf *b = pop(&local_free[cls]);
+    if (b) {
+        stats[cls].local_hits++;
+    } else {
+        pthread_once(&flush_once, make_flush_key);
+        pthread_setspecific(flush_key, (void *)1);
+        pthread_mutex_lock(&global_lock);
+        transfer(&global_free[cls], &local_free[cls], REFILL);
+        pthread_mutex_unlock(&global_lock);
+        b = pop(&local_free[cls]);
+        if (b) {
+            stats[cls].global_hits++;
+        } else {
+            b = (struct FreeBuf *)malloc(class_size[cls]);
+            if (b == NULL) return NULL;
+            stats[cls].mallocs++;
+            stats[cls].allocated++;
+        }
+    }
+
+    long used = ++stats[cls].in_use;
+    long hw = stats[cls].in_use_high_water;
+    while (used > hw && !atomic_compare_exchange_weak(&stats[cls].in_use_high_water, &hw, used))
+        ;
+    *cap = class_size[cls];
+    return (char *)b;
+}
+
+void bufpool_put(char *buf, size_t cap) {
+    if (buf == NULL) return;
+    int cls = size_to_class(cap);
+    stats[cls].in_use--;
+    push(&local_free[cls], (struct FreeBuf *)buf);
+    if (local_free[cls].count > LOCAL_MAX) {
+        release_to_global(cls, &local_free[cls], LOCAL_MAX / 2);
+    }
+}
+
+void bufpool_stats(int cls, BufPoolStats *out) {
+    out->buf_size = class_size[cls];
+    out->gets = stats[cls].gets;
+    out->local_hits = stats[cls].local_hits;
+    out->global_hits = stats[cls].global_hits;
+    out->mallocs = stats[cls].mallocs;
+    out->in_use = stats[cls].in_use;
+    out->in_use_high_water = stats[cls].in_use_high_water;
+    out->allocated = stats[cls].allocated;
+}
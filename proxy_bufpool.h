@@ -0,0 +1,54 @@
+/*
+ * proxy_bufpool.h -- recycled fixed-size I/O buffers.
+ *
+ * Buffers come in three size classes. Each thread keeps a small free list
+ * per class that it can use without locking; when a thread's list runs dry
+ * it refills from a mutex-protected global list, and when it grows past its
+ * limit it hands half back. Only when both are empty is a new buffer
+ * malloc'd, so in steady state request, tunnel and origin buffers are all
+ * reused.
+ */
+
+#include <stddef.h>
+
+#ifndef PROXY_BUFPOOL
+#define PROXY_BUFPOOL
+
+enum {
+     BUF_CLASS_16K,
+     BUF_CLASS_64K,
+     BUF_CLASS_256K,
+     BUF_CLASS_COUNT
+};
+
+#define BUF_SIZE_SMALL  (16 * 1024)
+#define BUF_SIZE_MEDIUM (64 * 1024)
+#define BUF_SIZE_LARGE  (256 * 1024)
+
+typedef struct BufPoolStats {
+     size_t buf_size;
+     unsigned long gets;
+     unsigned long local_hits;   /* served from the thread-local list */
+     unsigned long global_hits;  /* served by refilling from the global list */
+     unsigned long mallocs;      /* pool was empty */
+     long in_use;
+     long in_use_high_water;
+     long allocated;             /* buffers owned by the pool, free or in use */
+} BufPoolStats;
+
+/* Set how many free buffers per class the global list may keep before
+ * returning memory to the system. Call once before any other function. */
+void bufpool_init(int global_max_per_class);
+
+/* Get a buffer of at least `size` bytes (at most BUF_SIZE_LARGE). The actual
+ * capacity is stored in *cap. Returns NULL if size is too large or malloc
+ * fails. */
+char *bufpool_get(size_t size, size_t *cap);
+
+/* Return a buffer obtained from bufpool_get() together with its capacity. */
+void bufpool_put(char *buf, size_t cap);
+
+/* Snapshot of the counters for one size class. */
+void bufpool_stats(int cls, BufPoolStats *out);
+
+#endif
@@ -0,0 +1,381 @@
+/*
+ * proxy_cache.c -- LRU object cache; see proxy_cache.h for the layout.
+ */
+#include "proxy_cache.h"
+#include "proxy_cachemem.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_LOG(c, ...) do { if ((c)->log) (c)->log(__VA_ARGS__); } while (0)
+#define SHARED_SLOT_BYTES 1024      /* one node slot per this much shared capacity */
+#define SHARED_MIN_SLOTS (1u << 14)
+#define SHARED_MAX_SLOTS (1u << 24)
+
+static uint64_t cache_hash(const char *key, size_t len) { /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) { h ^= (unsigned char)key[i]; h *= 1099511628211ULL; }
+    return h;
+}
+#define HASH_TAG(h) ((uint32_t)((h) >> 48))
+static inline CacheNode* slot(LRUCache *c, uint32_t i) {
+    return &c->pages[i >> CACHE_SLOT_PAGE_SHIFT][i & (CACHE_SLOT_PAGE - 1)];
+}
+
+/* Object memory: proxy_cachemem for a private cache, the segment's heap (under the lock) for a shared one. */
+static char* blob_alloc(LRUCache *c, size_t n) {
+    return c->shm ? (char*)cacheshm_alloc(c->shm, n) : (char*)cachemem_alloc(n);
+}
+static void blob_free(LRUCache *c, char *blob, size_t n) {
+    if (c->shm) cacheshm_free(c->shm, blob); else cachemem_free(blob, n); /* may be a huge-page region */
+}
+
+static void detach_node(LRUCache *c, uint32_t i) {
+    CacheState *s = c->state;
+    CacheNode *node = slot(c, i);
+    if (node->prev != CACHE_NIL) slot(c, node->prev)->next = node->next; else s->head = node->next;
+    if (node->next != CACHE_NIL) slot(c, node->next)->prev = node->prev; else s->tail = node->prev;
+}
+static void attach_to_front(LRUCache *c, uint32_t i) {
+    CacheState *s = c->state;
+    CacheNode *node = slot(c, i);
+    node->next = s->head; node->prev = CACHE_NIL;
+    if (s->head != CACHE_NIL) slot(c, s->head)->prev = i;
+    s->head = i; if (s->tail == CACHE_NIL) s->tail = i;
+}
+static uint32_t alloc_slot(LRUCache *c) {
+    CacheState *s = c->state;
+    if (s->free_slot != CACHE_NIL) {
+        uint32_t i = s->free_slot;
+        s->free_slot = slot(c, i)->h_next;
+        return i;
+    }
+    if (s->slots_used == CACHE_NIL) return CACHE_NIL;
+    if (c->shm) return s->slots_used < cacheshm_slot_count(c->shm) ? s->slots_used++ : CACHE_NIL;
+    if ((s->slots_used & (CACHE_SLOT_PAGE - 1)) == 0) {
+        CacheNode **pages = (CacheNode**)realloc(c->pages, sizeof(CacheNode*) * (c->page_count + 1));
+        if (!pages) return CACHE_NIL;
+        c->pages = pages;
+        c->pages[c->page_count] = (CacheNode*)cachemem_alloc(sizeof(CacheNode) * CACHE_SLOT_PAGE);
+        if (!c->pages[c->page_count]) return CACHE_NIL;
+        c->page_count++;
+    }
+    return s->slots_used++;
+}
+static void free_slot(LRUCache *c, uint32_t i) {
+    CacheNode *node = slot(c, i);
+    node->in_use = 0; /* first, so recovery never keeps a node whose blob was freed */
+    blob_free(c, cache_node_blob(node), CACHE_VALUE_OFFSET(node->key_len) + node->data_size);
+    node->blob = 0;
+    node->h_next = c->state->free_slot;
+    c->state->free_slot = i;
+}
+/* Double the bucket array; slot indices are stable so nodes just move chains. */
+static void grow_table(LRUCache *c) {
+    uint32_t new_size = c->state->table_size * 2;
+    uint32_t *t = (uint32_t*)malloc(sizeof(uint32_t) * new_size);
+    if (!t) return;
+    memset(t, 0xFF, sizeof(uint32_t) * new_size);
+    for (uint32_t b = 0; b < c->state->table_size; b++) {
+        uint32_t i = c->table[b];
+        while (i != CACHE_NIL) {
+            CacheNode *node = slot(c, i);
+            uint32_t next = node->h_next;
+            uint32_t nb = cache_hash(cache_node_blob(node), node->key_len) & (new_size - 1);
+            node->h_next = t[nb]; t[nb] = i;
+            i = next;
+        }
+    }
+    free(c->table);
+    c->table = t; c->state->table_size = new_size;
+}
+static void init_state(CacheState *s, size_t capacity, size_t max_element_size, uint32_t table_size) {
+    s->capacity = capacity; s->size = 0; s->max_element_size = max_element_size;
+    s->table_size = table_size; s->count = 0; s->slots_used = 0;
+    s->head = s->tail = s->free_slot = CACHE_NIL;
+    s->next_id = (uint64_t)time(NULL) << 32; /* ids stay unique across restarts */
+}
+LRUCache* create_cache(size_t capacity, size_t max_element_size, int table_size) {
+    LRUCache *c = (LRUCache*)calloc(1, sizeof(LRUCache));
+    c->state = (CacheState*)calloc(1, sizeof(CacheState));
+    uint32_t size = 1; while (size < (uint32_t)table_size) size <<= 1;
+    init_state(c->state, capacity, max_element_size, size);
+    c->table = (uint32_t*)malloc(sizeof(uint32_t) * size);
+    memset(c->table, 0xFF, sizeof(uint32_t) * size);
+    pthread_mutex_init(&c->state->lock, NULL); return c;
+}
+
+/* --- Shared cache --- */
+/* Take back count pins held on slot i by a process that is gone. The caller holds the lock. */
+static void drop_pin(void *ctx, uint32_t i, uint32_t count) {
+    LRUCache *c = (LRUCache*)ctx;
+    if (i >= c->state->slots_used) return;
+    CacheNode *node = slot(c, i);
+    if (!node->in_use) return;
+    node->refcount = node->refcount > count ? node->refcount - count : 0;
+    if (node->refcount == 0 && node->evicted) free_slot(c, i);
+}
+static void count_pin(void *ctx, uint32_t i, uint32_t count) {
+    LRUCache *c = (LRUCache*)ctx;
+    if (i < c->state->slots_used) slot(c, i)->refcount += count;
+}
+/*
+ * A process died holding the lock, so the lists, the table and the heap's
+ * free lists may be half-updated. Rebuild them from what can be trusted:
+ * the slots (a slot is only marked in use once its fields are set) and the
+ * blocks they point at. The LRU order is lost; everything else survives.
+ */
+static void recover_shared(LRUCache *c) {
+    CacheState *s = c->state;
+    uint32_t slots = cacheshm_slot_count(c->shm), kept = 0, dropped = 0;
+    cacheshm_reap(c->shm, NULL, NULL, 1);
+    if (s->slots_used > slots) s->slots_used = slots;
+    for (uint32_t i = 0; i < s->slots_used; i++) slot(c, i)->refcount = 0;
+    cacheshm_for_each_pin(c->shm, count_pin, c);
+
+    cacheshm_heap_begin_mark(c->shm);
+    memset(c->table, 0xFF, sizeof(uint32_t) * s->table_size);
+    s->head = s->tail = s->free_slot = CACHE_NIL;
+    s->size = 0; s->count = 0;
+    for (uint32_t i = s->slots_used; i-- > 0; ) {
+        CacheNode *node = slot(c, i);
+        if (node->in_use) {
+            size_t n = CACHE_VALUE_OFFSET(node->key_len) + node->data_size;
+            if (node->data_size > s->max_element_size || cacheshm_mark(c->shm, cache_node_blob(node), n) < 0 ||
+                (node->evicted && node->refcount == 0)) {
+                node->in_use = 0; dropped++;
+            }
+        }
+        if (!node->in_use) {
+            node->blob = 0; node->refcount = 0;
+            node->h_next = s->free_slot; s->free_slot = i;
+            continue;
+        }
+        if (node->evicted) continue; /* still pinned; its last reader frees it */
+        char *blob = cache_node_blob(node);
+        uint64_t h = cache_hash(blob, node->key_len);
+        uint32_t b = h & (s->table_size - 1);
+        node->hash_tag = HASH_TAG(h);
+        node->h_next = c->table[b]; c->table[b] = i;
+        attach_to_front(c, i);
+        s->size += node->data_size; s->count++; kept++;
+    }
+    cacheshm_heap_rebuild(c->shm);
+    CACHE_LOG(c, "WARN", "Shared cache recovered after a process died holding its lock: %u objects kept, %u dropped",
+              kept, dropped);
+}
+/* Room for n bytes in the shared heap, evicting if it is full. The caller holds the lock. */
+static char* shared_alloc(LRUCache *c, size_t n) {
+    char *blob = blob_alloc(c, n);
+    if (blob) return blob;
+    cacheshm_coalesce(c->shm);
+    while (!(blob = blob_alloc(c, n)) && c->state->tail != CACHE_NIL) {
+        /* Merging walks the whole heap, so evict a good slice (1/64 of the cache, or twice the request) per walk. */
+        size_t step = c->state->capacity / 64 > 2 * n ? c->state->capacity / 64 : 2 * n;
+        size_t target = c->state->size > step ? c->state->size - step : 0;
+        while (c->state->size > target && c->state->tail != CACHE_NIL) evict_lru(c);
+        cacheshm_coalesce(c->shm);
+    }
+    if (!blob && cacheshm_reap(c->shm, drop_pin, c, 0) > 0) { /* pins of exited processes held the rest */
+        cacheshm_coalesce(c->shm);
+        blob = blob_alloc(c, n);
+    }
+    return blob;
+}
+LRUCache* create_shared_cache(const char *name, size_t capacity, size_t max_element_size, CacheLogFn log,
+                              char *err, size_t err_len) {
+    uint64_t want = capacity / SHARED_SLOT_BYTES;
+    uint32_t slots = want < SHARED_MIN_SLOTS ? SHARED_MIN_SLOTS : want > SHARED_MAX_SLOTS ? SHARED_MAX_SLOTS : (uint32_t)want;
+    slots = (slots + CACHE_SLOT_PAGE - 1) & ~(CACHE_SLOT_PAGE - 1);
+    uint32_t table_size = 1; while (table_size < slots) table_size <<= 1;
+    int created;
+    CacheShm *shm = cacheshm_open(name, capacity, sizeof(CacheState), sizeof(CacheNode), slots, table_size,
+                                  &created, err, err_len);
+    if (!shm) return NULL;
+    LRUCache *c = (LRUCache*)calloc(1, sizeof(LRUCache));
+    c->shm = shm; c->log = log;
+    c->state = (CacheState*)cacheshm_state(shm);
+    c->table = cacheshm_table(shm);
+    c->page_count = slots >> CACHE_SLOT_PAGE_SHIFT;
+    c->pages = (CacheNode**)malloc(sizeof(CacheNode*) * c->page_count);
+    for (uint32_t p = 0; p < c->page_count; p++) {
+        c->pages[p] = (CacheNode*)cacheshm_slots(shm) + ((size_t)p << CACHE_SLOT_PAGE_SHIFT);
+    }
+    if (created) {
+        init_state(c->state, capacity, max_element_size, table_size);
+        memset(c->table, 0xFF, sizeof(uint32_t) * table_size);
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&c->state->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        cacheshm_publish(shm);
+    } else {
+        cache_lock(c);
+        cacheshm_reap(shm, drop_pin, c, 0); /* processes that exited without detaching */
+        cache_unlock(c);
+    }
+    if (c->state->max_element_size != max_element_size) {
+        CACHE_LOG(c, "WARN", "Shared cache was created with a %zu byte element limit; using it", c->state->max_element_size);
+    }
+    CACHE_LOG(c, "INFO", "%s shared cache %s: %zuMB, %u slots", created ? "Created" : "Attached to", name,
+              cacheshm_capacity(shm) >> 20, slots);
+    return c;
+}
+void close_shared_cache(LRUCache *c) {
+    cache_lock(c);
+    cacheshm_leave(c->shm, drop_pin, c);
+    cache_unlock(c);
+    cacheshm_close(c->shm);
+    free(c->pages);
+    free(c);
+}
+void cache_lock(LRUCache *c) {
+    if (pthread_mutex_lock(&c->state->lock) == EOWNERDEAD) {
+        recover_shared(c);
+        pthread_mutex_consistent(&c->state->lock);
+    }
+}
+void cache_unlock(LRUCache *c) {
+    pthread_mutex_unlock(&c->state->lock);
+}
+uint64_t cache_unique_id(LRUCache *c) {
+    return ++c->state->next_id;
+}
+
+CacheNode* get_from_cache(LRUCache *c, const char *key, size_t key_len, uint32_t *slot_out) {
+    uint64_t h = cache_hash(key, key_len);
+    cache_lock(c);
+    uint32_t i = c->table[h & (c->state->table_size - 1)];
+    while (i != CACHE_NIL) {
+        CacheNode *node = slot(c, i);
+        if (node->hash_tag == HASH_TAG(h) && node->key_len == key_len && memcmp(cache_node_blob(node), key, key_len) == 0) {
+            if (c->shm && cacheshm_pin(c->shm, i) < 0) break; /* too many pins held; serve it as a miss */
+            detach_node(c, i); attach_to_front(c, i);
+            node->refcount++;
+            *slot_out = i;
+            cache_unlock(c);
+            CACHE_LOG(c, "INFO", "Cache HIT for request key.");
+            return node;
+        }
+        i = node->h_next;
+    }
+    cache_unlock(c);
+    CACHE_LOG(c, "INFO", "Cache MISS for request key.");
+    return NULL;
+}
+/* Unlink node i from the LRU list and its hash chain and drop it. */
+static void remove_node(LRUCache *c, uint32_t i) {
+    CacheNode *node = slot(c, i);
+    detach_node(c, i);
+    uint32_t *pp = &c->table[cache_hash(cache_node_blob(node), node->key_len) & (c->state->table_size - 1)];
+    while (*pp != CACHE_NIL && *pp != i) pp = &slot(c, *pp)->h_next;
+    if (*pp == i) *pp = node->h_next;
+    c->state->size -= node->data_size;
+    c->state->count--;
+    if (node->refcount > 0) { node->evicted = 1; return; } /* last reader frees it */
+    free_slot(c, i);
+}
+void evict_lru(LRUCache *c) {
+    uint32_t lru = c->state->tail; if (lru == CACHE_NIL) return;
+    remove_node(c, lru);
+    CACHE_LOG(c, "INFO", "Evicting item. Cache size: %zu bytes", c->state->size);
+}
+/* Drop the reference taken by get_from_cache(). */
+void release_cache_node(LRUCache *c, uint32_t i) {
+    cache_lock(c);
+    CacheNode *node = slot(c, i);
+    if (c->shm) cacheshm_unpin(c->shm, i);
+    if (node->refcount > 0 && --node->refcount == 0 && node->evicted) free_slot(c, i); /* 0 only after a recovery */
+    cache_unlock(c);
+}
+void invalidate_cache_node(LRUCache *c, uint32_t i) {
+    cache_lock(c);
+    if (!slot(c, i)->evicted) remove_node(c, i);
+    cache_unlock(c);
+}
+void put_in_cache(LRUCache *c, const char *key, size_t key_len, const char *data, size_t data_size) {
+    put_in_cache_prefixed(c, key, key_len, NULL, 0, data, data_size);
+}
+void put_in_cache_prefixed(LRUCache *c, const char *key, size_t key_len, const char *prefix, size_t prefix_len,
+                           const char *data, size_t size) {
+    CacheState *s = c->state;
+    size_t data_size = prefix_len + size;
+    if (data_size > s->max_element_size || data_size > UINT32_MAX) {
+        CACHE_LOG(c, "WARN", "Item too large to cache (%zu bytes)", data_size); return;
+    }
+    if (key_len > CACHE_MAX_KEY_LEN) {
+        CACHE_LOG(c, "WARN", "Key too long to cache (%zu bytes)", key_len); return;
+    }
+    size_t value_off = CACHE_VALUE_OFFSET(key_len);
+    char *blob;
+    if (c->shm) {
+        /* The heap is only touched under the lock, but the copy needn't be: reserve the block meanwhile. */
+        cache_lock(c);
+        blob = shared_alloc(c, value_off + data_size);
+        if (blob && cacheshm_reserve(c->shm, blob) < 0) { blob_free(c, blob, 0); blob = NULL; }
+        cache_unlock(c);
+    } else {
+        blob = blob_alloc(c, value_off + data_size);
+    }
+    if (!blob) { CACHE_LOG(c, "ERROR", "Allocation for cache object failed"); return; }
+    memcpy(blob, key, key_len);
+    if (prefix_len) memcpy(blob + value_off, prefix, prefix_len);
+    memcpy(blob + value_off + prefix_len, data, size);
+    uint64_t h = cache_hash(key, key_len);
+
+    cache_lock(c);
+    if (c->shm) cacheshm_unreserve(c->shm, blob);
+    for (uint32_t old = c->table[h & (s->table_size - 1)]; old != CACHE_NIL; old = slot(c, old)->h_next) {
+        CacheNode *node = slot(c, old);
+        if (node->hash_tag == HASH_TAG(h) && node->key_len == key_len && memcmp(cache_node_blob(node), key, key_len) == 0) {
+            remove_node(c, old); /* replaced, e.g. a stale copy being refreshed */
+            break;
+        }
+    }
+    while (s->size + data_size > s->capacity && s->tail != CACHE_NIL) { evict_lru(c); }
+    uint32_t i = alloc_slot(c);
+    if (i == CACHE_NIL && c->shm && s->tail != CACHE_NIL) { /* a shared cache has a fixed number of slots */
+        evict_lru(c);
+        i = alloc_slot(c);
+    }
+    if (i == CACHE_NIL) {
+        if (c->shm) blob_free(c, blob, 0);
+        cache_unlock(c);
+        if (!c->shm) blob_free(c, blob, value_off + data_size);
+        CACHE_LOG(c, "ERROR", "No cache slot available");
+        return;
+    }
+    CacheNode *new_node = slot(c, i);
+    new_node->blob = blob - (char*)new_node;
+    new_node->data_size = (uint32_t)data_size;
+    new_node->key_len = key_len;
+    new_node->hash_tag = HASH_TAG(h);
+    new_node->refcount = 0; new_node->evicted = 0; new_node->in_use = 1;
+    attach_to_front(c, i);
+    s->size += data_size;
+    s->count++;
+    if (!c->shm && s->count > s->table_size) grow_table(c);
+    uint32_t b = h & (s->table_size - 1);
+    new_node->h_next = c->table[b];
+    c->table[b] = i;
+    CACHE_LOG(c, "INFO", "Stored new item. Cache size: %zu bytes", s->size);
+    cache_unlock(c);
+}
+void cache_set_capacity(LRUCache *c, size_t capacity) {
+    cache_lock(c);
+    if (c->shm && capacity > cacheshm_capacity(c->shm)) capacity = cacheshm_capacity(c->shm);
+    c->state->capacity = capacity;
+    while (c->state->size > c->state->capacity && c->state->tail != CACHE_NIL) { evict_lru(c); }
+    cache_unlock(c);
+}
+size_t cache_metadata_bytes(LRUCache *c) {
+    cache_lock(c);
+    size_t meta = (size_t)c->page_count * CACHE_SLOT_PAGE * sizeof(CacheNode)
+                + (size_t)c->state->table_size * sizeof(uint32_t)
+                + (size_t)c->page_count * sizeof(CacheNode*);
+    cache_unlock(c);
+    return meta;
+}
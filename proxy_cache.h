@@ -0,0 +1,118 @@
+/*
+ * proxy_cache.h -- the proxy's LRU object cache.
+ *
+ * Compact layout for large numbers of small objects. Nodes are fixed 32-byte
+ * slots in pages that never move, and link to each other (LRU list, hash
+ * chains, free list) with 32-bit slot indices instead of pointers. Each
+ * object's key and value share a single allocation ("blob"; the value
+ * starts 8-byte aligned after the key), and the key length, a 16-bit hash
+ * tag and the node flags are packed into one word. The tag lets chain walks
+ * skip most non-matching keys without touching their blobs. The hash table
+ * holds 32-bit slot indices and doubles once the average chain passes one
+ * entry.
+ *
+ * Object memory comes from proxy_cachemem, so cachemem_init() must be
+ * called before the first put. The engine does no I/O of its own; set
+ * `log` to receive its INFO/WARN/ERROR messages.
+ *
+ * create_shared_cache() instead places the state, the table, the slots and
+ * the objects in a shared-memory segment (proxy_cacheshm) that several
+ * processes attach to. Nothing shared holds an address: a node finds its
+ * blob by an offset from itself. The lock is process-shared and robust;
+ * if a process dies holding it, the next process to take it rebuilds the
+ * index and the heap from the slots, dropping whatever was half-updated.
+ * A shared cache has a fixed number of slots and table buckets.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "proxy_cacheshm.h"
+
+#ifndef PROXY_CACHE
+#define PROXY_CACHE
+
+#define CACHE_NIL UINT32_MAX
+#define CACHE_SLOT_PAGE_SHIFT 12
+#define CACHE_SLOT_PAGE (1u << CACHE_SLOT_PAGE_SHIFT)
+#define CACHE_MAX_KEY_LEN 0x3FFF
+#define CACHE_VALUE_OFFSET(key_len) (((size_t)(key_len) + 7) & ~(size_t)7)
+
+typedef struct CacheNode {
+    int64_t blob;               /* offset from the node to key_len key bytes, padding, then data_size value bytes */
+    uint32_t prev, next;        /* LRU list */
+    uint32_t h_next;            /* hash chain, or free list while unused */
+    uint32_t data_size;
+    uint32_t refcount;          /* readers pin a node so eviction can't free it mid-send */
+    uint32_t hash_tag : 16, key_len : 14, evicted : 1, in_use : 1;
+} CacheNode;
+
+typedef void (*CacheLogFn)(const char *level, const char *format, ...);
+
+/* Everything that lives in the segment when the cache is shared. */
+typedef struct {
+    size_t capacity; size_t size; size_t max_element_size;
+    uint32_t table_size; uint32_t count;
+    uint32_t slots_used; uint32_t free_slot;
+    uint32_t head, tail;
+    _Atomic uint64_t next_id;
+    pthread_mutex_t lock;
+} CacheState;
+
+typedef struct {
+    CacheState *state;
+    uint32_t *table;
+    CacheNode **pages; uint32_t page_count;
+    CacheShm *shm;              /* NULL for a private cache */
+    CacheLogFn log;
+} LRUCache;
+
+LRUCache* create_cache(size_t capacity, size_t max_element_size, int table_size);
+
+/*
+ * Attach to the shared cache `name` (e.g. "/proxy_cache"), creating it if
+ * no process has. Processes that share it must pass the same capacity and
+ * max_element_size. Returns NULL with err set if the segment can't be used.
+ */
+LRUCache* create_shared_cache(const char *name, size_t capacity, size_t max_element_size, CacheLogFn log,
+                              char *err, size_t err_len);
+
+/* Detach this process from a shared cache, dropping its pins; the cache stays for the others. */
+void close_shared_cache(LRUCache *c);
+
+/* Lock the cache state, recovering it first if its last holder died. */
+void cache_lock(LRUCache *c);
+void cache_unlock(LRUCache *c);
+
+/* An id no other object stored in this cache, by any process, has been given. */
+uint64_t cache_unique_id(LRUCache *c);
+
+/* Look up key; on a hit the node is pinned until release_cache_node() is
+ * called with the slot index stored in *slot. */
+CacheNode* get_from_cache(LRUCache *c, const char *key, size_t key_len, uint32_t *slot);
+void release_cache_node(LRUCache *c, uint32_t slot);
+
+/* Remove a pinned node from the cache; it is freed when its last reader releases it. */
+void invalidate_cache_node(LRUCache *c, uint32_t slot);
+
+/* Copy data in under key, replacing any object already stored under it and
+ * evicting least recently used objects to make room. */
+void put_in_cache(LRUCache *c, const char *key, size_t key_len, const char *data, size_t data_size);
+
+/* Same, storing prefix followed by data as one value (e.g. metadata ahead of a body). */
+void put_in_cache_prefixed(LRUCache *c, const char *key, size_t key_len, const char *prefix, size_t prefix_len,
+                           const char *data, size_t size);
+
+/* Drop the least recently used object. The caller holds the cache lock. */
+void evict_lru(LRUCache *c);
+
+/* Change the capacity, evicting down to it if it shrank. A shared cache can't grow past its creation capacity. */
+void cache_set_capacity(LRUCache *c, size_t capacity);
+
+/* Bytes of bookkeeping (node slots, bucket array, page table). Takes the cache lock. */
+size_t cache_metadata_bytes(LRUCache *c);
+
+static inline char* cache_node_blob(CacheNode *n) { return (char*)n + n->blob; }
+static inline char* cache_node_data(CacheNode *n) { return cache_node_blob(n) + CACHE_VALUE_OFFSET(n->key_len); }
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * proxy_cachemem.c -- huge-page-backed memory for cached objects.
+ */
+#include "proxy_cachemem.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MIN_BLOCK 32
+#define SUBCLASSES 4    // size classes per power of two: at most 25% slack
+#define MAX_CLASSES 128
+
+struct FreeBlock {
+    struct FreeBlock *next;
+};
+
+static CacheMemMode mode = CACHEMEM_HEAP;
+static char *region;
+static size_t region_size, region_used, live_bytes;
+static unsigned long heap_fallbacks;
+static struct FreeBlock *free_lists[MAX_CLASSES];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Map n to a size class and the block size of that class
+static int size_class(size_t n, size_t *block) {
+    if (n < MIN_BLOCK) n = MIN_BLOCK;
+    int log2 = 63 - __builtin_clzll((unsigned long long)n);
+    size_t base = (size_t)1 << log2;
+    size_t step = base / SUBCLASSES;
+    size_t sub = (n - base + step - 1) / step;  // 0..SUBCLASSES
+    *block = base + sub * step;
+    return (log2 - 5) * SUBCLASSES + (int)sub;
+}
+
+static int in_region(void *p) {
+    return region && (char *)p >= region && (char *)p < region + region_size;
+}
+
+CacheMemMode cachemem_init(size_t bytes, int use_huge_pages) {
+    if (!use_huge_pages) return mode = CACHEMEM_HEAP;
+    // Leave room for size-class rounding, then round to whole huge pages
+    size_t want = bytes + bytes / 4;
+    want = (want + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+
+    void *p = mmap(NULL, want, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        mode = CACHEMEM_HUGETLB;
+    } else {
+        // Over-map so the region can start on a 2 MB boundary, which THP needs
+        p = mmap(NULL, want + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return mode = CACHEMEM_HEAP;
+        uintptr_t start = ((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+        size_t head = start - (uintptr_t)p;
+        if (head) munmap(p, head);
+        munmap((char *)start + want, HUGE_PAGE_SIZE - head);
+        p = (void *)start;
+#ifdef MADV_HUGEPAGE
+        madvise(p, want, MADV_HUGEPAGE);
+#endif
+        mode = CACHEMEM_THP;
+    }
+    region = (char *)p;
+    region_size = want;
+    return mode;
+}
+
+void *cachemem_alloc(size_t n) {
+    if (mode == CACHEMEM_HEAP) return malloc(n);
+    size_t block;
+    int cls = size_class(n, &block);
+    void *p = NULL;
+    pthread_mutex_lock(&lock);
+    if (cls < MAX_CLASSES && free_lists[cls]) {
+        p = free_lists[cls];
+        free_lists[cls] = free_lists[cls]->next;
+    } else if (cls < MAX_CLASSES && region_used + block <= region_size) {
+        p = region + region_used;
+        region_used += block;
+    }
+    if (p) live_bytes += block;
+    else heap_fallbacks++;
+    pthread_mutex_unlock(&lock);
+    return p ? p : malloc(n);
+}
+
+void cachemem_free(void *p, size_t n) {
+    if (p == NULL) return;
+    if (!in_region(p)) {
+        free(p);
+        return;
+    }
+    size_t block;
+    int cls = size_class(n, &block);
+    pthread_mutex_lock(&lock);
+    ((struct FreeBlock *)p)->next = free_lists[cls];
+    free_lists[cls] = (struct FreeBlock *)p;
+    live_bytes -= block;
+    pthread_mutex_unlock(&lock);
+}
+
+void cachemem_trim(void) {
+    if (mode == CACHEMEM_HEAP) return;
+    // hugetlb mappings can only be released in whole huge pages
+    size_t page = (mode == CACHEMEM_HUGETLB) ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    pthread_mutex_lock(&lock);
+    for (int cls = 0; cls < MAX_CLASSES; cls++) {
+        size_t block = ((size_t)1 << (cls / SUBCLASSES + 5)) / SUBCLASSES * (SUBCLASSES + cls % SUBCLASSES);
+        if (block < 2 * page) continue;
+        for (struct FreeBlock *b = free_lists[cls]; b; b = b->next) {
+            // Keep the page holding the free-list link
+            uintptr_t start = ((uintptr_t)b + sizeof(*b) + page - 1) & ~(uintptr_t)(page - 1);
+            uintptr_t end = ((uintptr_t)b + block) & ~(uintptr_t)(page - 1);
+            if (end > start) madvise((void *)start, end - start, MADV_DONTNEED);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+const char *cachemem_mode_name(CacheMemMode m) {
+    switch (m) {
+    case CACHEMEM_HUGETLB: return "hugetlb";
+    case CACHEMEM_THP: return "thp";
+    default: return "heap";
+    }
+}
+
+void cachemem_stats(CacheMemStats *out) {
+    pthread_mutex_lock(&lock);
+    out->mode = mode;
+    out->region_size = region_size;
+    out->region_used = region_used;
+    out->live_bytes = live_bytes;
+    out->heap_fallbacks = heap_fallbacks;
+    pthread_mutex_unlock(&lock);
+}
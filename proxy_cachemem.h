@@ -0,0 +1,50 @@
+/*
+ * proxy_cachemem.h -- backing memory for cached objects.
+ *
+ * When enabled, cache keys, nodes and bodies are carved from one large
+ * mapping backed by 2 MB pages, so hits walk far fewer TLB entries than with
+ * objects scattered across the malloc heap. The mapping is requested with
+ * MAP_HUGETLB first (explicit huge pages, needs vm.nr_hugepages); if that
+ * fails, a normal mapping is advised with MADV_HUGEPAGE so transparent huge
+ * pages can back it. Inside the region, blocks are served from segregated
+ * size-class free lists and a bump pointer. If the region is disabled or
+ * exhausted, allocations fall back to malloc.
+ */
+
+#include <stddef.h>
+
+#ifndef PROXY_CACHEMEM
+#define PROXY_CACHEMEM
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+typedef enum {
+     CACHEMEM_HEAP,     /* plain malloc */
+     CACHEMEM_HUGETLB,  /* explicit huge pages */
+     CACHEMEM_THP       /* transparent huge pages via madvise */
+} CacheMemMode;
+
+typedef struct CacheMemStats {
+     CacheMemMode mode;
+     size_t region_size;
+     size_t region_used;     /* bytes handed out by the bump pointer */
+     size_t live_bytes;      /* bytes currently allocated, rounded to class size */
+     unsigned long heap_fallbacks;
+} CacheMemStats;
+
+/* Reserve a region of at least `bytes` if use_huge_pages is set; otherwise
+ * (or if mapping fails) stay in heap mode. Returns the mode in effect. */
+CacheMemMode cachemem_init(size_t bytes, int use_huge_pages);
+
+/* Allocate / free a block of n bytes. The same n must be passed to free. */
+void *cachemem_alloc(size_t n);
+void cachemem_free(void *p, size_t n);
+
+/* Return the pages under free blocks in the region to the kernel, e.g.
+ * after the cache was shrunk. */
+void cachemem_trim(void);
+
+const char *cachemem_mode_name(CacheMemMode mode);
+void cachemem_stats(CacheMemStats *out);
+
+#endif
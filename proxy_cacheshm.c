@@ -0,0 +1,483 @@
+/*
+ * proxy_cacheshm.c -- shared-memory segment for a cache; see proxy_cacheshm.h.
+ */
+#include "proxy_cacheshm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_MAGIC 0x43505843u       /* "CXPC" */
+#define SHM_VERSION 1
+#define SHM_ATTACH_WAIT_MS 5000     /* how long to wait for another process to finish creating it */
+#define BLOCK_MAGIC 0xB10C5EEDu
+#define BLOCK_FREE 0x1
+#define BLOCK_MARK 0x2
+#define BLOCK_ALIGN 16
+#define MIN_BLOCK 64
+#define SUBCLASSES 4                /* free lists per power of two */
+#define MAX_CLASSES 160
+#define NO_BLOCK UINT64_MAX
+
+typedef struct {
+    uint64_t size;                  /* whole block, header included */
+    uint32_t magic;
+    uint32_t flags;                 /* BLOCK_*; a free block's payload starts with the next free offset */
+} ShmBlock;
+
+typedef struct {
+    uint32_t slot_plus1;            /* 0: empty */
+    uint32_t count;
+} ShmPin;
+
+typedef struct {
+    _Atomic int32_t pid;            /* 0: unused */
+    uint64_t start_time;            /* from /proc/<pid>/stat, so a reused pid isn't taken for alive */
+    uint32_t pins_used;
+    uint32_t reserved_count;
+    uint64_t reserved[CACHESHM_MAX_RESERVED];  /* heap offsets of blocks being filled */
+    ShmPin pins[CACHESHM_PIN_SLOTS];           /* open addressing by slot index */
+} ShmProc;
+
+struct ShmHeader {
+    _Atomic uint32_t magic;         /* stored last, once the segment is initialized */
+    uint32_t version;
+    _Atomic int32_t creator;        /* pid initializing the segment */
+    uint32_t slot_count, table_size;
+    uint64_t size, capacity, state_size, slot_size;
+    uint64_t procs_off, state_off, table_off, slots_off, heap_off, heap_size;
+    uint64_t heap_used;             /* heap bytes carved into blocks so far */
+    uint64_t free_lists[MAX_CLASSES];
+};
+
+/* --- Layout --- */
+static size_t align_up(size_t n, size_t a) { return (n + a - 1) & ~(a - 1); }
+
+static void layout(struct ShmHeader *h, size_t capacity, size_t state_size, size_t slot_size,
+                   uint32_t slot_count, uint32_t table_size) {
+    size_t off = align_up(sizeof(struct ShmHeader), 64);
+    h->procs_off = off;
+    off = align_up(off + CACHESHM_MAX_PROCS * sizeof(ShmProc), 64);
+    h->state_off = off;
+    off = align_up(off + state_size, 64);
+    h->table_off = off;
+    off = align_up(off + (size_t)table_size * sizeof(uint32_t), 64);
+    h->slots_off = off;
+    off = align_up(off + (size_t)slot_count * slot_size, 4096);
+    h->heap_off = off;
+    h->heap_size = align_up(capacity + capacity / 4, 4096); /* room for block headers and fragmentation */
+    h->size = h->heap_off + h->heap_size;
+    h->capacity = capacity; h->state_size = state_size; h->slot_size = slot_size;
+    h->slot_count = slot_count; h->table_size = table_size;
+    h->version = SHM_VERSION;
+}
+
+static ShmProc* proc_at(CacheShm *shm, int i) {
+    return (ShmProc*)(shm->base + shm->hdr->procs_off) + i;
+}
+static char* heap(CacheShm *shm) { return shm->base + shm->hdr->heap_off; }
+static ShmBlock* block_at(CacheShm *shm, uint64_t off) { return (ShmBlock*)(heap(shm) + off); }
+static uint64_t block_off(CacheShm *shm, void *payload) {
+    return (uint64_t)((char*)payload - sizeof(ShmBlock) - heap(shm));
+}
+
+void* cacheshm_state(CacheShm *shm) { return shm->base + shm->hdr->state_off; }
+uint32_t* cacheshm_table(CacheShm *shm) { return (uint32_t*)(shm->base + shm->hdr->table_off); }
+void* cacheshm_slots(CacheShm *shm) { return shm->base + shm->hdr->slots_off; }
+uint32_t cacheshm_slot_count(CacheShm *shm) { return shm->hdr->slot_count; }
+uint32_t cacheshm_table_size(CacheShm *shm) { return shm->hdr->table_size; }
+size_t cacheshm_capacity(CacheShm *shm) { return shm->hdr->capacity; }
+
+/* --- Processes --- */
+/* Start time of a process in clock ticks since boot (field 22 of /proc/<pid>/stat), or 0. */
+static uint64_t process_start_time(pid_t pid) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+    char *p = strrchr(buf, ')'); /* the command name may contain spaces */
+    for (int field = 2; p && field < 22; field++) p = strchr(p + 1, ' ');
+    return p ? strtoull(p + 1, NULL, 10) : 0;
+}
+
+static int process_alive(const ShmProc *p) {
+    pid_t pid = atomic_load(&p->pid);
+    if (pid <= 0) return 0;
+    if (kill(pid, 0) < 0 && errno == ESRCH) return 0;
+    uint64_t start = process_start_time(pid);
+    return start == 0 || p->start_time == 0 || start == p->start_time;
+}
+
+static int any_process_alive(CacheShm *shm) {
+    for (int i = 0; i < CACHESHM_MAX_PROCS; i++) {
+        if (process_alive(proc_at(shm, i))) return 1;
+    }
+    return 0;
+}
+
+static int register_process(CacheShm *shm) {
+    pid_t self = getpid();
+    for (int i = 0; i < CACHESHM_MAX_PROCS; i++) {
+        ShmProc *p = proc_at(shm, i);
+        int32_t expected = 0;
+        if (atomic_compare_exchange_strong(&p->pid, &expected, self)) {
+            p->start_time = process_start_time(self);
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Empty a process entry and free it for reuse. */
+static void clear_process(ShmProc *p) {
+    memset(p->pins, 0, sizeof(p->pins));
+    p->pins_used = 0;
+    p->reserved_count = 0;
+    p->start_time = 0;
+    atomic_store(&p->pid, 0);
+}
+
+/* --- Open / close --- */
+static void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+CacheShm* cacheshm_open(const char *name, size_t capacity, size_t state_size, size_t slot_size,
+                        uint32_t slot_count, uint32_t table_size, int *created, char *err, size_t err_len) {
+    struct ShmHeader want;
+    memset(&want, 0, sizeof(want));
+    layout(&want, capacity, state_size, slot_size, slot_count, table_size);
+    CacheShm *shm = (CacheShm*)calloc(1, sizeof(CacheShm));
+    if (!shm) { snprintf(err, err_len, "out of memory"); return NULL; }
+    *created = 0;
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            if (ftruncate(fd, (off_t)want.size) < 0) {
+                snprintf(err, err_len, "cannot size %s to %zu bytes: %s", name, (size_t)want.size, strerror(errno));
+                close(fd); shm_unlink(name); free(shm);
+                return NULL;
+            }
+            void *base = mmap(NULL, want.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (base == MAP_FAILED) {
+                snprintf(err, err_len, "cannot map %s: %s", name, strerror(errno));
+                shm_unlink(name); free(shm);
+                return NULL;
+            }
+            shm->base = (char*)base; shm->size = want.size; shm->hdr = (struct ShmHeader*)base;
+            atomic_store(&shm->hdr->creator, getpid());
+            layout(shm->hdr, capacity, state_size, slot_size, slot_count, table_size);
+            shm->hdr->heap_used = 0;
+            for (int i = 0; i < MAX_CLASSES; i++) shm->hdr->free_lists[i] = NO_BLOCK;
+            shm->proc = register_process(shm);
+            *created = 1;
+            return shm;
+        }
+        if (errno != EEXIST) {
+            snprintf(err, err_len, "cannot create %s: %s", name, strerror(errno));
+            free(shm);
+            return NULL;
+        }
+
+        fd = shm_open(name, O_RDWR, 0);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            if (fd >= 0) close(fd);
+            sleep_ms(10); /* removed in between; try creating it again */
+            continue;
+        }
+        int waited = 0;
+        while ((size_t)st.st_size < sizeof(struct ShmHeader) && waited < SHM_ATTACH_WAIT_MS) { /* not sized yet */
+            sleep_ms(10); waited += 10;
+            fstat(fd, &st);
+        }
+        void *base = (size_t)st.st_size >= sizeof(struct ShmHeader) ?
+                     mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (base == MAP_FAILED) {
+            snprintf(err, err_len, "cannot map %s", name);
+            free(shm);
+            return NULL;
+        }
+        shm->base = (char*)base; shm->size = st.st_size; shm->hdr = (struct ShmHeader*)base;
+        while (atomic_load(&shm->hdr->magic) != SHM_MAGIC && waited < SHM_ATTACH_WAIT_MS) {
+            int32_t creator = atomic_load(&shm->hdr->creator);
+            if (creator > 0 && kill(creator, 0) < 0 && errno == ESRCH) break; /* it died half-way */
+            sleep_ms(10); waited += 10;
+        }
+        int ready = atomic_load(&shm->hdr->magic) == SHM_MAGIC;
+        int same = ready && shm->size == want.size && shm->hdr->version == want.version &&
+                   shm->hdr->capacity == want.capacity && shm->hdr->state_size == want.state_size &&
+                   shm->hdr->slot_size == want.slot_size && shm->hdr->slot_count == want.slot_count &&
+                   shm->hdr->table_size == want.table_size;
+        if (same) {
+            shm->proc = register_process(shm);
+            if (shm->proc < 0) {
+                snprintf(err, err_len, "%s already has %d processes attached", name, CACHESHM_MAX_PROCS);
+                munmap(shm->base, shm->size); free(shm);
+                return NULL;
+            }
+            return shm;
+        }
+        int busy = ready && any_process_alive(shm);
+        munmap(shm->base, shm->size);
+        if (busy) {
+            snprintf(err, err_len, "%s is in use with a different size or layout", name);
+            free(shm);
+            return NULL;
+        }
+        shm_unlink(name); /* left over from an earlier run, or its creator died: start over */
+    }
+    snprintf(err, err_len, "cannot open %s", name);
+    free(shm);
+    return NULL;
+}
+
+void cacheshm_publish(CacheShm *shm) {
+    atomic_store(&shm->hdr->magic, SHM_MAGIC);
+}
+
+void cacheshm_leave(CacheShm *shm, void (*drop_pin)(void *ctx, uint32_t slot, uint32_t count), void *ctx) {
+    ShmProc *p = proc_at(shm, shm->proc);
+    for (int i = 0; drop_pin && i < CACHESHM_PIN_SLOTS; i++) {
+        if (p->pins[i].slot_plus1) drop_pin(ctx, p->pins[i].slot_plus1 - 1, p->pins[i].count);
+    }
+    for (uint32_t i = 0; i < p->reserved_count; i++) cacheshm_free(shm, heap(shm) + p->reserved[i] + sizeof(ShmBlock));
+    clear_process(p);
+}
+
+void cacheshm_close(CacheShm *shm) {
+    munmap(shm->base, shm->size);
+    free(shm);
+}
+
+/* --- Heap --- */
+/*
+ * Blocks are cut to the size asked for, not rounded up to a class. A free
+ * block goes on the list of the largest class not above its size, so every
+ * block on a higher list fits a request; the request's own list is
+ * searched first-fit for a few entries, which finds same-sized blocks when
+ * objects are of similar size.
+ */
+#define FLOOR_LIST_TRIES 8
+
+static int floor_class(uint64_t size) {
+    int log2 = 63 - __builtin_clzll(size);
+    uint64_t base = (uint64_t)1 << log2, step = base / SUBCLASSES;
+    int cls = (log2 - 6) * SUBCLASSES + (int)((size - base) / step);
+    return cls < MAX_CLASSES ? cls : MAX_CLASSES - 1;
+}
+
+static uint64_t* next_free(CacheShm *shm, uint64_t off) { return (uint64_t*)(block_at(shm, off) + 1); }
+
+static void push_free(CacheShm *shm, uint64_t off) {
+    ShmBlock *b = block_at(shm, off);
+    b->flags = BLOCK_FREE;
+    int cls = floor_class(b->size);
+    *next_free(shm, off) = shm->hdr->free_lists[cls];
+    shm->hdr->free_lists[cls] = off;
+}
+
+/* Unlink the first block of at least want bytes, or return NO_BLOCK. */
+static uint64_t take_free(CacheShm *shm, uint64_t want) {
+    struct ShmHeader *h = shm->hdr;
+    int cls = floor_class(want);
+    uint64_t *pp = &h->free_lists[cls];
+    for (int tries = 0; *pp != NO_BLOCK && tries < FLOOR_LIST_TRIES; tries++) {
+        uint64_t off = *pp;
+        if (block_at(shm, off)->size >= want) { *pp = *next_free(shm, off); return off; }
+        pp = next_free(shm, off);
+    }
+    for (int c = cls + 1; c < MAX_CLASSES; c++) {
+        uint64_t off = h->free_lists[c];
+        if (off != NO_BLOCK) { h->free_lists[c] = *next_free(shm, off); return off; }
+    }
+    return NO_BLOCK;
+}
+
+void* cacheshm_alloc(CacheShm *shm, size_t n) {
+    struct ShmHeader *h = shm->hdr;
+    uint64_t want = align_up(n + sizeof(ShmBlock), BLOCK_ALIGN);
+    if (want < MIN_BLOCK) want = MIN_BLOCK;
+    if (want > h->heap_size) return NULL;
+    uint64_t off = take_free(shm, want);
+    if (off != NO_BLOCK) {
+        ShmBlock *b = block_at(shm, off);
+        if (b->size - want >= MIN_BLOCK) {
+            /* Write the remainder's header before shrinking this block, so a walk never sees a gap. */
+            ShmBlock *rest = block_at(shm, off + want);
+            rest->size = b->size - want; rest->magic = BLOCK_MAGIC;
+            b->size = want;
+            push_free(shm, off + want);
+        }
+        b->flags = 0;
+        return b + 1;
+    }
+    if (h->heap_used + want > h->heap_size) return NULL;
+    ShmBlock *b = block_at(shm, h->heap_used);
+    b->size = want; b->magic = BLOCK_MAGIC; b->flags = 0;
+    h->heap_used += want;
+    return b + 1;
+}
+
+void cacheshm_free(CacheShm *shm, void *p) {
+    push_free(shm, block_off(shm, p));
+}
+
+/*
+ * Visit every block in heap order. A header that doesn't check out (the
+ * heap was being extended when a process died) ends the heap there.
+ */
+#define FOR_EACH_BLOCK(shm, off, b) \
+    for (uint64_t off = 0; off < (shm)->hdr->heap_used; off += (b)->size) \
+        if (((b) = block_at((shm), off))->magic != BLOCK_MAGIC || (b)->size < MIN_BLOCK || \
+            (b)->size % BLOCK_ALIGN || (b)->size > (shm)->hdr->heap_used - off) { \
+            (shm)->hdr->heap_used = off; break; \
+        } else
+
+void cacheshm_coalesce(CacheShm *shm) {
+    struct ShmHeader *h = shm->hdr;
+    for (int i = 0; i < MAX_CLASSES; i++) h->free_lists[i] = NO_BLOCK;
+    ShmBlock *b;
+    uint64_t last_free = NO_BLOCK;
+    FOR_EACH_BLOCK(shm, off, b) {
+        if (!(b->flags & BLOCK_FREE)) { last_free = NO_BLOCK; continue; }
+        if (last_free != NO_BLOCK) {
+            block_at(shm, last_free)->size += b->size; /* one store: the walk stays consistent */
+        } else {
+            last_free = off;
+        }
+    }
+    if (last_free != NO_BLOCK) h->heap_used = last_free; /* a free tail goes back to the bump pointer */
+    FOR_EACH_BLOCK(shm, off, b) {
+        if (b->flags & BLOCK_FREE) push_free(shm, off);
+    }
+}
+
+int cacheshm_reserve(CacheShm *shm, void *p) {
+    ShmProc *me = proc_at(shm, shm->proc);
+    if (me->reserved_count == CACHESHM_MAX_RESERVED) return -1;
+    me->reserved[me->reserved_count++] = block_off(shm, p);
+    return 0;
+}
+
+void cacheshm_unreserve(CacheShm *shm, void *p) {
+    ShmProc *me = proc_at(shm, shm->proc);
+    uint64_t off = block_off(shm, p);
+    for (uint32_t i = 0; i < me->reserved_count; i++) {
+        if (me->reserved[i] == off) {
+            me->reserved[i] = me->reserved[--me->reserved_count];
+            return;
+        }
+    }
+}
+
+void cacheshm_heap_begin_mark(CacheShm *shm) {
+    ShmBlock *b;
+    FOR_EACH_BLOCK(shm, off, b) b->flags &= ~BLOCK_MARK;
+    for (int i = 0; i < CACHESHM_MAX_PROCS; i++) {
+        ShmProc *p = proc_at(shm, i);
+        if (atomic_load(&p->pid) == 0) continue;
+        for (uint32_t r = 0; r < p->reserved_count; r++) {
+            if (p->reserved[r] < shm->hdr->heap_used) block_at(shm, p->reserved[r])->flags |= BLOCK_MARK;
+        }
+    }
+}
+
+int cacheshm_mark(CacheShm *shm, void *p, size_t n) {
+    if ((char*)p < heap(shm) + sizeof(ShmBlock)) return -1;
+    uint64_t off = block_off(shm, p);
+    if (off % BLOCK_ALIGN || off >= shm->hdr->heap_used) return -1;
+    ShmBlock *b = block_at(shm, off);
+    if (b->magic != BLOCK_MAGIC || b->size < n + sizeof(ShmBlock) || b->size > shm->hdr->heap_used - off ||
+        (b->flags & (BLOCK_MARK | BLOCK_FREE))) return -1;
+    b->flags |= BLOCK_MARK;
+    return 0;
+}
+
+void cacheshm_heap_rebuild(CacheShm *shm) {
+    ShmBlock *b;
+    FOR_EACH_BLOCK(shm, off, b) b->flags = (b->flags & BLOCK_MARK) ? 0 : BLOCK_FREE;
+    cacheshm_coalesce(shm);
+}
+
+/* --- Pins --- */
+static uint32_t pin_home(uint32_t slot) {
+    return (slot * 2654435761u) & (CACHESHM_PIN_SLOTS - 1);
+}
+
+int cacheshm_pin(CacheShm *shm, uint32_t slot) {
+    ShmProc *me = proc_at(shm, shm->proc);
+    for (uint32_t i = pin_home(slot); ; i = (i + 1) & (CACHESHM_PIN_SLOTS - 1)) {
+        ShmPin *e = &me->pins[i];
+        if (e->slot_plus1 == slot + 1) { e->count++; return 0; }
+        if (e->slot_plus1 == 0) {
+            if (me->pins_used >= CACHESHM_PIN_SLOTS * 3 / 4) return -1;
+            e->slot_plus1 = slot + 1; e->count = 1;
+            me->pins_used++;
+            return 0;
+        }
+    }
+}
+
+void cacheshm_unpin(CacheShm *shm, uint32_t slot) {
+    ShmProc *me = proc_at(shm, shm->proc);
+    uint32_t mask = CACHESHM_PIN_SLOTS - 1, i = pin_home(slot);
+    while (me->pins[i].slot_plus1 != slot + 1) {
+        if (me->pins[i].slot_plus1 == 0) return;
+        i = (i + 1) & mask;
+    }
+    if (--me->pins[i].count > 0) return;
+    /* Backward-shift deletion keeps every probe sequence unbroken without tombstones. */
+    for (uint32_t j = (i + 1) & mask; me->pins[j].slot_plus1 != 0; j = (j + 1) & mask) {
+        uint32_t home = pin_home(me->pins[j].slot_plus1 - 1);
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            me->pins[i] = me->pins[j];
+            i = j;
+        }
+    }
+    me->pins[i].slot_plus1 = 0; me->pins[i].count = 0;
+    me->pins_used--;
+}
+
+void cacheshm_for_each_pin(CacheShm *shm, void (*fn)(void *ctx, uint32_t slot, uint32_t count), void *ctx) {
+    for (int i = 0; i < CACHESHM_MAX_PROCS; i++) {
+        ShmProc *p = proc_at(shm, i);
+        if (atomic_load(&p->pid) == 0) continue;
+        for (int k = 0; k < CACHESHM_PIN_SLOTS; k++) {
+            if (p->pins[k].slot_plus1) fn(ctx, p->pins[k].slot_plus1 - 1, p->pins[k].count);
+        }
+    }
+}
+
+int cacheshm_reap(CacheShm *shm, void (*drop_pin)(void *ctx, uint32_t slot, uint32_t count), void *ctx,
+                  int keep_blocks) {
+    int reaped = 0;
+    for (int i = 0; i < CACHESHM_MAX_PROCS; i++) {
+        ShmProc *p = proc_at(shm, i);
+        if (i == shm->proc || atomic_load(&p->pid) == 0 || process_alive(p)) continue;
+        for (int k = 0; drop_pin && k < CACHESHM_PIN_SLOTS; k++) {
+            if (p->pins[k].slot_plus1) drop_pin(ctx, p->pins[k].slot_plus1 - 1, p->pins[k].count);
+        }
+        for (uint32_t r = 0; !keep_blocks && r < p->reserved_count; r++) {
+            if (p->reserved[r] < shm->hdr->heap_used) push_free(shm, p->reserved[r]);
+        }
+        clear_process(p);
+        reaped++;
+    }
+    return reaped;
+}
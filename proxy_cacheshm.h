@@ -0,0 +1,116 @@
+/*
+ * proxy_cacheshm.h -- a POSIX shared-memory segment that holds a whole cache,
+ * so several proxy processes on one host can share one copy of it.
+ *
+ * Layout, fixed when the segment is created:
+ *
+ *   [header][process table][cache state][hash table][node slots][heap]
+ *
+ * Nothing in the segment holds an address; it is mapped at a different
+ * address in each process. The header and the process table use offsets
+ * from the segment base, the cache engine (proxy_cache.c) links its nodes
+ * with slot indices and points a node at its blob with an offset from the
+ * node itself.
+ *
+ * The heap is a sequence of blocks, each with a small header giving its
+ * size. Free blocks sit on size-class lists and are split and coalesced as
+ * needed. Because the sequence can always be walked from the start, the
+ * free lists can be rebuilt from nothing: the engine marks the blocks it
+ * still references and cacheshm_heap_rebuild() frees the rest. That is how
+ * the cache recovers when a process dies while holding its lock.
+ *
+ * Every process registers in the process table. Pins on nodes, and blocks
+ * allocated but not yet linked into the cache, are recorded in the
+ * process's own entry, so a process that dies can be cleaned up after:
+ * cacheshm_reap() drops the entries of processes that no longer exist. All
+ * processes must share a PID namespace for that check to work.
+ *
+ * None of these functions lock anything. The caller serializes every call
+ * except cacheshm_open(), cacheshm_publish() and cacheshm_close() with the
+ * cache's own process-shared lock.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef PROXY_CACHESHM
+#define PROXY_CACHESHM
+
+#define CACHESHM_MAX_PROCS 64
+#define CACHESHM_PIN_SLOTS 4096     /* distinct nodes one process can pin at once (power of two) */
+#define CACHESHM_MAX_RESERVED 256   /* blocks one process can be filling at once */
+
+typedef struct CacheShm {
+    char *base;                 /* where the segment is mapped in this process */
+    size_t size;
+    struct ShmHeader *hdr;
+    int proc;                   /* this process's entry in the process table */
+} CacheShm;
+
+/*
+ * Open or create the segment `name` (e.g. "/proxy_cache"). The geometry is
+ * derived from capacity, state_size (bytes reserved for the engine's shared
+ * state), slot_size and table_size. A segment with another geometry is
+ * replaced if no live process uses it. *created is set if this call created
+ * the segment, in which case the caller initializes the state, table and
+ * slots and then calls cacheshm_publish(). Returns NULL with err set on
+ * failure.
+ */
+CacheShm* cacheshm_open(const char *name, size_t capacity, size_t state_size, size_t slot_size,
+                        uint32_t slot_count, uint32_t table_size, int *created, char *err, size_t err_len);
+
+/* Let processes waiting in cacheshm_open() attach to a freshly created segment. */
+void cacheshm_publish(CacheShm *shm);
+
+/* Unregister this process, calling drop_pin for each pin it still holds. */
+void cacheshm_leave(CacheShm *shm, void (*drop_pin)(void *ctx, uint32_t slot, uint32_t count), void *ctx);
+
+/* Unmap the segment, after cacheshm_leave(). The segment itself stays for other processes. */
+void cacheshm_close(CacheShm *shm);
+
+void* cacheshm_state(CacheShm *shm);
+uint32_t* cacheshm_table(CacheShm *shm);
+void* cacheshm_slots(CacheShm *shm);
+uint32_t cacheshm_slot_count(CacheShm *shm);
+uint32_t cacheshm_table_size(CacheShm *shm);
+size_t cacheshm_capacity(CacheShm *shm);    /* the capacity it was created for */
+
+/* Heap blocks. Returns NULL if no block is big enough (see cacheshm_coalesce()). */
+void* cacheshm_alloc(CacheShm *shm, size_t n);
+void cacheshm_free(CacheShm *shm, void *p);
+
+/* Merge runs of adjacent free blocks; worth a retry after an allocation failed. */
+void cacheshm_coalesce(CacheShm *shm);
+
+/* Record that this process holds a block it is filling, so a crash frees it. */
+int cacheshm_reserve(CacheShm *shm, void *p);
+void cacheshm_unreserve(CacheShm *shm, void *p);
+
+/* Count a pin by this process on node slot `slot`. -1 if the pin table is full. */
+int cacheshm_pin(CacheShm *shm, uint32_t slot);
+void cacheshm_unpin(CacheShm *shm, uint32_t slot);
+
+/* Call fn for every pin held by a registered process. */
+void cacheshm_for_each_pin(CacheShm *shm, void (*fn)(void *ctx, uint32_t slot, uint32_t count), void *ctx);
+
+/*
+ * Remove the entries of processes that have exited. For each of their pins
+ * drop_pin (if not NULL) is called; their reserved blocks are freed, unless
+ * keep_blocks is set because the heap is about to be rebuilt anyway.
+ * Returns the number of processes removed.
+ */
+int cacheshm_reap(CacheShm *shm, void (*drop_pin)(void *ctx, uint32_t slot, uint32_t count), void *ctx,
+                  int keep_blocks);
+
+/*
+ * Recovery: cacheshm_heap_begin_mark() clears all marks except on blocks
+ * reserved by live processes, cacheshm_mark() claims the block under a blob
+ * the engine keeps (failing if p isn't an allocated block of at least n bytes
+ * or is claimed already), and cacheshm_heap_rebuild() frees every
+ * block left unmarked.
+ */
+void cacheshm_heap_begin_mark(CacheShm *shm);
+int cacheshm_mark(CacheShm *shm, void *p, size_t n);
+void cacheshm_heap_rebuild(CacheShm *shm);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * proxy_intern.c -- concurrent hostname intern table.
+ */
+#include "proxy_intern.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SHARDS 64
+#define INITIAL_BUCKETS 64
+#define NAME_PAGE_SHIFT 12
+#define NAME_PAGE (1u << NAME_PAGE_SHIFT)
+
+struct InternEntry {
+    struct InternEntry *next;
+    uint32_t hash;
+    uint32_t id;
+    size_t len;
+    char name[];
+};
+
+struct Shard {
+    pthread_rwlock_t lock;
+    struct InternEntry **buckets;
+    uint32_t nbuckets;
+    uint32_t count;
+};
+
+static struct Shard shards[SHARDS];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static _Atomic uint32_t next_id = 1;
+
+// id -> entry, in pages that are published once and never move
+static _Atomic(struct InternEntry **) name_pages[INTERN_MAX_IDS / NAME_PAGE];
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void init_shards(void) {
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_rwlock_init(&shards[i].lock, NULL);
+        shards[i].buckets = (struct InternEntry **)calloc(INITIAL_BUCKETS, sizeof(struct InternEntry *));
+        shards[i].nbuckets = shards[i].buckets ? INITIAL_BUCKETS : 0;
+    }
+}
+
+// FNV-1a over the lowercased name
+static uint32_t hash_name(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)tolower((unsigned char)name[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct InternEntry *find(struct Shard *s, uint32_t h, const char *name, size_t len) {
+    if (s->nbuckets == 0) return NULL;
+    struct InternEntry *e = s->buckets[(h / SHARDS) % s->nbuckets];
+    while (e) {
+        if (e->hash == h && e->len == len && strncasecmp(e->name, name, len) == 0) return e;
+        e = e->next;
+    }
+    return NULL;
+}
+
+static void grow(struct Shard *s) {
+    uint32_t n = s->nbuckets * 2;
+    struct InternEntry **b = (struct InternEntry **)calloc(n, sizeof(struct InternEntry *));
+    if (b == NULL) return;
+    for (uint32_t i = 0; i < s->nbuckets; i++) {
+        struct InternEntry *e = s->buckets[i];
+        while (e) {
+            struct InternEntry *next = e->next;
+            uint32_t j = (e->hash / SHARDS) % n;
+            e->next = b[j];
+            b[j] = e;
+            e = next;
+        }
+    }
+    free(s->buckets);
+    s->buckets = b;
+    s->nbuckets = n;
+}
+
+static int publish_name(uint32_t id, struct InternEntry *e) {
+    uint32_t p = id >> NAME_PAGE_SHIFT;
+    struct InternEntry **page = atomic_load(&name_pages[p]);
+    if (page == NULL) {
+        pthread_mutex_lock(&page_lock);
+        page = atomic_load(&name_pages[p]);
+        if (page == NULL) {
+            page = (struct InternEntry **)calloc(NAME_PAGE, sizeof(struct InternEntry *));
+            if (page) atomic_store(&name_pages[p], page);
+        }
+        pthread_mutex_unlock(&page_lock);
+        if (page == NULL) return -1;
+    }
+    page[id & (NAME_PAGE - 1)] = e;
+    return 0;
+}
+
+uint32_t intern_find(const char *name, size_t len) {
+    if (name == NULL) return INTERN_NONE;
+    pthread_once(&init_once, init_shards);
+    uint32_t h = hash_name(name, len);
+    struct Shard *s = &shards[h % SHARDS];
+    pthread_rwlock_rdlock(&s->lock);
+    struct InternEntry *e = find(s, h, name, len);
+    uint32_t id = e ? e->id : INTERN_NONE;
+    pthread_rwlock_unlock(&s->lock);
+    return id;
+}
+
+uint32_t intern_host(const char *name, size_t len) {
+    uint32_t id = intern_find(name, len);
+    if (id != INTERN_NONE || name == NULL) return id;
+    uint32_t h = hash_name(name, len);
+    struct Shard *s = &shards[h % SHARDS];
+
+    pthread_rwlock_wrlock(&s->lock);
+    struct InternEntry *e = find(s, h, name, len);  // someone may have added it meanwhile
+    if (e == NULL && s->nbuckets > 0 && atomic_load(&next_id) < INTERN_MAX_IDS) {
+        e = (struct InternEntry *)malloc(sizeof(struct InternEntry) + len + 1);
+        if (e) {
+            for (size_t i = 0; i < len; i++) e->name[i] = (char)tolower((unsigned char)name[i]);
+            e->name[len] = '\0';
+            e->len = len;
+            e->hash = h;
+            e->id = atomic_fetch_add(&next_id, 1);
+            if (e->id >= INTERN_MAX_IDS || publish_name(e->id, e) < 0) {
+                free(e);
+                e = NULL;
+            } else {
+                uint32_t b = (h / SHARDS) % s->nbuckets;
+                e->next = s->buckets[b];
+                s->buckets[b] = e;
+                if (++s->count > s->nbuckets * 2) grow(s);
+            }
+        }
+    }
+    id = e ? e->id : INTERN_NONE;
+    pthread_rwlock_unlock(&s->lock);
+    return id;
+}
+
+const char *intern_name(uint32_t id) {
+    if (id == INTERN_NONE || id >= INTERN_MAX_IDS) return NULL;
+    struct InternEntry **page = atomic_load(&name_pages[id >> NAME_PAGE_SHIFT]);
+    struct InternEntry *e = page ? page[id & (NAME_PAGE - 1)] : NULL;
+    return e ? e->name : NULL;
+}
+
+uint32_t intern_count(void) {
+    uint32_t n = atomic_load(&next_id);
+    return (n > INTERN_MAX_IDS ? INTERN_MAX_IDS : n) - 1;
+}
@@ -0,0 +1,36 @@
+/*
+ * proxy_intern.h -- a concurrent intern table for hostnames.
+ *
+ * Every distinct hostname (compared case-insensitively) is stored once and
+ * given a small integer id. Cache keys, rate limiters and other per-host
+ * tables store the id, so host comparisons become integer compares and the
+ * name is not copied into each entry. Lookups of known hosts only take a shared read
+ * lock on one of several shards; ids are never reused, and intern_name()
+ * resolves an id back to its name without locking.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef PROXY_INTERN
+#define PROXY_INTERN
+
+/* Returned when the table is full or out of memory. Callers must then fall
+ * back to using the name itself. Valid ids start at 1. */
+#define INTERN_NONE 0
+
+#define INTERN_MAX_IDS (1u << 20)
+
+/* Return the id for the hostname `name` of length len, adding it if needed. */
+uint32_t intern_host(const char *name, size_t len);
+
+/* The id of an already interned hostname, or INTERN_NONE; never adds one. */
+uint32_t intern_find(const char *name, size_t len);
+
+/* The canonical (lowercase, NUL-terminated) name for an id, or NULL. */
+const char *intern_name(uint32_t id);
+
+/* Number of distinct hostnames interned so far. */
+uint32_t intern_count(void);
+
+#endif
@@ -18,6 +18,19 @@ void debug(const char * format, ...) {
      }
 }
 
+// Allocation helpers: use the request's arena when it has one
+static char *pr_strdup(struct ParsedRequest *pr, const char *s) {
+    return pr->arena ? arena_strdup(pr->arena, s) : strdup(s);
+}
+
+static void *pr_alloc(struct ParsedRequest *pr, size_t n) {
+    return pr->arena ? arena_alloc(pr->arena, n) : malloc(n);
+}
+
+static void pr_free(struct ParsedRequest *pr, void *p) {
+    if (pr->arena == NULL) free(p);
+}
+
 struct ParsedRequest* ParsedRequest_create() {
     struct ParsedRequest *pr = (struct ParsedRequest *)malloc(sizeof(struct ParsedRequest));
     if (pr != NULL) {
@@ -26,8 +39,17 @@ struct ParsedRequest* ParsedRequest_create() {
     return pr;
 }
 
+struct ParsedRequest* ParsedRequest_create_in(Arena *arena) {
+    struct ParsedRequest *pr = (struct ParsedRequest *)arena_alloc(arena, sizeof(struct ParsedRequest));
+    if (pr != NULL) {
+        memset(pr, 0, sizeof(struct ParsedRequest));
+        pr->arena = arena;
+    }
+    return pr;
+}
+
 void ParsedRequest_destroy(struct ParsedRequest *pr) {
-    if (pr == NULL) return;
+    if (pr == NULL || pr->arena != NULL) return;
     free(pr->method);
     free(pr->protocol);
     free(pr->host);
@@ -41,17 +63,17 @@ void ParsedRequest_destroy(struct ParsedRequest *pr) {
 int ParsedRequest_parse(struct ParsedRequest *parse, const char *buf, int buflen) {
     if (parse == NULL || buf == NULL || buflen < 4) return -1;
 
-    char *temp_buf = (char *)malloc(buflen + 1);
+    char *temp_buf = (char *)pr_alloc(parse, buflen + 1);
     if (temp_buf == NULL) return -1;
     memcpy(temp_buf, buf, buflen);
     temp_buf[buflen] = '\0';
 
     char *request_line = strtok(temp_buf, "\r\n");
     if (request_line == NULL) {
-        free(temp_buf);
+        pr_free(parse, temp_buf);
         return -1;
     }
-    parse->buf = strdup(request_line);
+    parse->buf = pr_strdup(parse, request_line);
 
     char *method, *uri, *version;
     method = strtok(request_line, " ");
@@ -59,28 +81,28 @@ int ParsedRequest_parse(struct ParsedRequest *parse, const char *buf, int buflen
     version = strtok(NULL, "");
 
     if (method == NULL || uri == NULL || version == NULL) {
-        free(temp_buf);
+        pr_free(parse, temp_buf);
         return -1;
     }
 
-    parse->method = strdup(method);
-    parse->version = strdup(version);
+    parse->method = pr_strdup(parse, method);
+    parse->version = pr_strdup(parse, version);
 
     if (strcmp(parse->method, "CONNECT") == 0) {
         char *host = strtok(uri, ":");
         char *port = strtok(NULL, "");
-        if (host) parse->host = strdup(host);
-        if (port) parse->port = strdup(port);
-        free(temp_buf);
+        if (host) parse->host = pr_strdup(parse, host);
+        if (port) parse->port = pr_strdup(parse, port);
+        pr_free(parse, temp_buf);
         return 0;
     }
 
-    if (strcmp(parse->method, "GET") != 0) {
-        free(temp_buf);
+    if (strcmp(parse->method, "GET") != 0 && strcmp(parse->method, "HEAD") != 0) {
+        pr_free(parse, temp_buf);
         return -1;
     }
 
-    char *uri_copy = strdup(uri);
+    char *uri_copy = pr_strdup(parse, uri);
     char *uri_ptr = uri_copy;
 
     if (strstr(uri_ptr, "://") != NULL) {
@@ -89,23 +111,23 @@ int ParsedRequest_parse(struct ParsedRequest *parse, const char *buf, int buflen
 
     char *path_ptr = strchr(uri_ptr, '/');
     if (path_ptr == NULL) {
-        parse->host = strdup(uri_ptr);
-        parse->path = strdup("/");
+        parse->host = pr_strdup(parse, uri_ptr);
+        parse->path = pr_strdup(parse, "/");
     } else {
         *path_ptr = '\0';
-        parse->host = strdup(uri_ptr);
+        parse->host = pr_strdup(parse, uri_ptr);
         *path_ptr = '/'; // Restore for path
-        parse->path = strdup(path_ptr);
+        parse->path = pr_strdup(parse, path_ptr);
     }
 
     char *port_ptr = strchr(parse->host, ':');
     if (port_ptr != NULL) {
         *port_ptr = '\0';
-        parse->port = strdup(port_ptr + 1);
+        parse->port = pr_strdup(parse, port_ptr + 1);
     }
     
-    free(uri_copy);
-    free(temp_buf);
+    pr_free(parse, uri_copy);
+    pr_free(parse, temp_buf);
     
     if (strlen(parse->host) == 0) {
         debug("Parse error: could not extract host\n");
@@ -14,6 +14,8 @@
 
 #include <ctype.h>
 
+#include "proxy_arena.h"
+
 #ifndef PROXY_PARSE
 #define PROXY_PARSE
 
@@ -28,7 +30,8 @@
    key-value pair.
 
    The buf and buflen fields are used internally to maintain the parsed request
-   line.
+   line. If arena is set, the object and all of its strings live in that
+   arena and are released by arena_reset() instead of ParsedRequest_destroy().
  */
 struct ParsedRequest {
      char *method; 
@@ -42,6 +45,7 @@ struct ParsedRequest {
      struct ParsedHeader *headers;
      size_t headersused;
      size_t headerslen;
+     Arena *arena;
 };
 
 /* 
@@ -61,6 +65,10 @@ struct ParsedHeader {
  * request buffer */
 struct ParsedRequest* ParsedRequest_create();
 
+/* Same as ParsedRequest_create(), but every allocation made for this object
+ * (including during parsing) comes from the given arena */
+struct ParsedRequest* ParsedRequest_create_in(Arena *arena);
+
 /* Parse the request buffer in buf given that buf is of length buflen */
 int ParsedRequest_parse(struct ParsedRequest * parse, const char *buf,
 			int buflen);
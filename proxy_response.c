@@ -0,0 +1,245 @@
+/*
+ * proxy_response.c -- parse responses into their stored form; see proxy_response.h.
+ */
+#define _GNU_SOURCE /* strptime, timegm */
+#include "proxy_response.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static int name_is(const char *name, size_t len, const char *want) {
+    return strlen(want) == len && strncasecmp(name, want, len) == 0;
+}
+
+/* Heuristically cacheable status codes (RFC 9111, section 4.2.2). */
+static int status_cacheable(int status) {
+    switch (status) {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Hop-by-hop headers, plus Age, which each hit regenerates. */
+static int header_dropped(const char *name, size_t len) {
+    return name_is(name, len, "Connection") || name_is(name, len, "Keep-Alive") ||
+           name_is(name, len, "Proxy-Connection") || name_is(name, len, "Proxy-Authenticate") ||
+           name_is(name, len, "TE") || name_is(name, len, "Trailer") ||
+           name_is(name, len, "Upgrade") || name_is(name, len, "Age");
+}
+
+/* Delta-seconds value of a Cache-Control directive such as max-age=N, or -1. */
+static long directive_seconds(const char *value, size_t len, const char *directive) {
+    size_t dlen = strlen(directive);
+    for (size_t i = 0; i + dlen < len; i++) {
+        if ((i == 0 || value[i - 1] == ',' || value[i - 1] == ' ') &&
+            strncasecmp(value + i, directive, dlen) == 0 && value[i + dlen] == '=') {
+            return strtol(value + i + dlen + 1, NULL, 10);
+        }
+    }
+    return -1;
+}
+
+static int has_directive(const char *value, size_t len, const char *directive) {
+    size_t dlen = strlen(directive);
+    for (size_t i = 0; i + dlen <= len; i++) {
+        if ((i == 0 || value[i - 1] == ',' || value[i - 1] == ' ') && strncasecmp(value + i, directive, dlen) == 0 &&
+            (i + dlen == len || value[i + dlen] == ',' || value[i + dlen] == ' ' || value[i + dlen] == '=')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT") to unix time, or -1. */
+static int64_t parse_http_date(const char *value, size_t len) {
+    char buf[64];
+    if (len >= sizeof(buf)) return -1;
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (!strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm)) return -1;
+    return (int64_t)timegm(&tm);
+}
+
+size_t response_header_end(const char *raw, size_t len) {
+    size_t limit = len < RESPONSE_MAX_HEADER_BYTES ? len : RESPONSE_MAX_HEADER_BYTES;
+    for (size_t i = 3; i < limit; i++) {
+        if (raw[i] == '\n' && raw[i - 1] == '\r' && raw[i - 2] == '\n' && raw[i - 3] == '\r') return i + 1;
+    }
+    return 0;
+}
+
+/*
+ * Parse the header block raw[0, head) into a stored prefix with body_len 0.
+ * Sets *chunked if the body uses chunked transfer coding. Returns NULL if
+ * the response must not be cached regardless of its body.
+ */
+static char* prepare_headers(const char *raw, size_t head, time_t now, size_t *prefix_len, int *chunked) {
+    if (head < 12 || strncmp(raw, "HTTP/", 5) != 0) return NULL;
+    const char *status_end = memchr(raw, '\n', head);
+    const char *sp = memchr(raw, ' ', status_end - raw);
+    if (!sp) return NULL;
+    int status = atoi(sp + 1);
+    if (!status_cacheable(status)) return NULL;
+
+    uint32_t count = 0;
+    for (const char *p = status_end + 1; p < raw + head - 2; p = (const char*)memchr(p, '\n', raw + head - p) + 1) count++;
+
+    size_t index_off = sizeof(CachedResponse);
+    size_t block_off = index_off + count * sizeof(CachedHeader);
+    char *out = (char*)malloc(block_off + head);
+    if (!out) return NULL;
+    CachedResponse *meta = (CachedResponse*)out;
+    CachedHeader *headers = (CachedHeader*)(out + index_off);
+    char *block = out + block_off;
+    memset(meta, 0, sizeof(*meta));
+    meta->status = (uint32_t)status;
+    meta->etag = meta->last_modified = RESPONSE_NO_HEADER;
+    meta->content_length = -1;
+    meta->stored_at = now;
+
+    size_t line_len = status_end - raw;
+    if (line_len > 0 && raw[line_len - 1] == '\r') line_len--;
+    memcpy(block, raw, line_len);
+    size_t used = line_len;
+    block[used++] = '\r'; block[used++] = '\n';
+
+    long max_age = -1, s_maxage = -1, age = 0;
+    int64_t expires = 0;
+    int has_expires = 0, uncacheable = 0;
+    *chunked = 0;
+    for (const char *p = status_end + 1; p < raw + head - 2; ) {
+        const char *eol = memchr(p, '\n', raw + head - p);
+        const char *next = eol + 1;
+        if (eol > p && eol[-1] == '\r') eol--;
+        const char *colon = memchr(p, ':', eol - p);
+        if (!colon || colon == p) { p = next; continue; }
+        size_t name_len = colon - p;
+        const char *value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t')) value++;
+        const char *value_end = eol;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+        size_t value_len = value_end - value;
+
+        if (name_is(p, name_len, "Cache-Control")) {
+            if (has_directive(value, value_len, "no-store") || has_directive(value, value_len, "no-cache") ||
+                has_directive(value, value_len, "private")) uncacheable = 1;
+            max_age = directive_seconds(value, value_len, "max-age");
+            s_maxage = directive_seconds(value, value_len, "s-maxage");
+        } else if (name_is(p, name_len, "Expires")) {
+            has_expires = 1;
+            expires = parse_http_date(value, value_len);
+        } else if (name_is(p, name_len, "Age")) {
+            age = strtol(value, NULL, 10);
+        } else if (name_is(p, name_len, "Content-Length")) {
+            meta->content_length = strtoll(value, NULL, 10);
+        } else if (name_is(p, name_len, "Accept-Ranges")) {
+            if (has_directive(value, value_len, "bytes")) meta->flags |= RESPONSE_ACCEPT_RANGES;
+        } else if (name_is(p, name_len, "Transfer-Encoding")) {
+            *chunked = value_len >= 7 && strncasecmp(value_end - 7, "chunked", 7) == 0;
+        }
+        if (!header_dropped(p, name_len)) {
+            CachedHeader *h = &headers[meta->header_count];
+            if (name_is(p, name_len, "ETag")) meta->etag = meta->header_count;
+            else if (name_is(p, name_len, "Last-Modified")) meta->last_modified = meta->header_count;
+            meta->header_count++;
+            h->name_off = (uint32_t)used; h->name_len = (uint32_t)name_len;
+            h->value_off = (uint32_t)(used + (value - p)); h->value_len = (uint32_t)value_len;
+            memcpy(block + used, p, value_end - p);
+            used += value_end - p;
+            block[used++] = '\r'; block[used++] = '\n';
+        }
+        p = next;
+    }
+
+    meta->origin_age = age > 0 ? (uint32_t)age : 0;
+    if (s_maxage >= 0) meta->expires_at = now + s_maxage - age;
+    else if (max_age >= 0) meta->expires_at = now + max_age - age;
+    else if (has_expires) meta->expires_at = expires; /* an invalid date means already expired */
+    if (uncacheable || (meta->expires_at != 0 && meta->expires_at <= now)) {
+        free(out);
+        return NULL;
+    }
+
+    /* The index shrank if headers were dropped; close the gap before the block. */
+    size_t final_block_off = index_off + meta->header_count * sizeof(CachedHeader);
+    memmove(out + final_block_off, block, used);
+    meta->header_block_len = (uint32_t)used;
+    *prefix_len = final_block_off + used;
+    return out;
+}
+
+int response_prepare(const char *raw, size_t len, time_t now,
+                     char **prefix, size_t *prefix_len, const char **body, size_t *body_len) {
+    size_t head = response_header_end(raw, len);
+    int chunked;
+    char *out = head ? prepare_headers(raw, head, now, prefix_len, &chunked) : NULL;
+    if (!out) return -1;
+    CachedResponse *meta = (CachedResponse*)out;
+    *body = raw + head;
+    *body_len = len - head;
+    if ((meta->content_length >= 0 && !chunked && (uint64_t)meta->content_length > *body_len) ||
+        (chunked && (*body_len < 5 || memcmp(raw + len - 4, "\r\n\r\n", 4) != 0))) { /* truncated */
+        free(out);
+        return -1;
+    }
+    meta->body_len = *body_len;
+    *prefix = out;
+    return 0;
+}
+
+int response_prepare_chunked(const char *raw, size_t head, time_t now, uint32_t chunk_size, uint64_t object_id,
+                             char **prefix, size_t *prefix_len) {
+    int chunked;
+    char *out = prepare_headers(raw, head, now, prefix_len, &chunked);
+    if (!out) return -1;
+    CachedResponse *meta = (CachedResponse*)out;
+    if (chunked || meta->status != 200 || meta->content_length <= 0) {
+        free(out);
+        return -1;
+    }
+    meta->flags |= RESPONSE_CHUNKED;
+    meta->chunk_size = chunk_size;
+    meta->object_id = object_id;
+    meta->body_len = (uint64_t)meta->content_length;
+    *prefix = out;
+    return 0;
+}
+
+int response_cacheable(const char *raw, size_t head, time_t now) {
+    size_t prefix_len;
+    int chunked;
+    char *out = prepare_headers(raw, head, now, &prefix_len, &chunked);
+    free(out);
+    return out != NULL;
+}
+
+const char* response_find_header(const char *head, size_t len, const char *name, size_t *value_len) {
+    size_t name_len = strlen(name);
+    const char *end = head + len;
+    const char *p = memchr(head, '\n', len); /* skip the request or status line */
+    while (p && ++p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        if ((size_t)(eol - p) > name_len && p[name_len] == ':' && strncasecmp(p, name, name_len) == 0) {
+            const char *v = p + name_len + 1, *v_end = eol;
+            while (v < v_end && (*v == ' ' || *v == '\t')) v++;
+            while (v_end > v && (v_end[-1] == '\r' || v_end[-1] == ' ' || v_end[-1] == '\t')) v_end--;
+            *value_len = v_end - v;
+            return v;
+        }
+        p = eol < end ? eol : NULL;
+    }
+    return NULL;
+}
+
+const char* response_header_value(const char *stored, uint32_t i, size_t *len) {
+    if (i == RESPONSE_NO_HEADER || i >= response_meta(stored)->header_count) return NULL;
+    const CachedHeader *h = &response_headers(stored)[i];
+    *len = h->value_len;
+    return response_header_block(stored) + h->value_off;
+}
@@ -0,0 +1,132 @@
+/*
+ * proxy_response.h -- stored form of a cached HTTP response.
+ *
+ * A response is parsed once, when it is cached, and stored ahead of its
+ * body as
+ *
+ *   [CachedResponse][CachedHeader x header_count][header block][body]
+ *
+ * The header block is the status line plus the end-to-end headers, each
+ * ending in CRLF, without the blank line. A hit sends it, appends its own
+ * per-response headers (Age, X-Cache, Connection) and the blank line, then
+ * the body, without parsing anything. Hop-by-hop headers and Age are
+ * dropped at fill time. The header index points into the header block, so
+ * individual headers (validators, for instance) can be read without a scan.
+ *
+ * Objects too large for one cache entry are stored chunked: the entry
+ * under the object's key holds no body (RESPONSE_CHUNKED, body_len is the
+ * full length), and each chunk_size piece of the body is a cache object of
+ * its own under response_chunk_key(), valued [CachedChunk][bytes]. Chunks
+ * are filled, hit and evicted independently, so an object can be cached in
+ * part; a missing chunk is refetched from the origin with a Range request.
+ * Each chunk carries the object_id of the entry it belongs to, so chunks
+ * left behind by an earlier copy of the object are never served with a
+ * newer one.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef PROXY_RESPONSE
+#define PROXY_RESPONSE
+
+#define RESPONSE_NO_HEADER UINT32_MAX
+#define RESPONSE_MAX_HEADER_BYTES (64 * 1024)
+#define RESPONSE_CHUNK_KEY_EXTRA 5  /* bytes response_chunk_key() adds to the object key */
+
+/* CachedResponse flags */
+#define RESPONSE_CHUNKED 0x1        /* body stored as separate chunk objects */
+#define RESPONSE_ACCEPT_RANGES 0x2  /* origin sent Accept-Ranges: bytes */
+#define RESPONSE_PREFETCHED 0x4     /* stored by the prefetcher, not yet hit by a client */
+#define RESPONSE_PREDICTED 0x8      /* with RESPONSE_PREFETCHED: the access-sequence model asked for it */
+
+typedef struct {
+    uint32_t name_off, name_len;    /* offsets into the header block */
+    uint32_t value_off, value_len;
+} CachedHeader;
+
+typedef struct {
+    uint32_t status;
+    uint32_t header_count;
+    uint32_t header_block_len;
+    uint32_t etag;                  /* index into the header list, or RESPONSE_NO_HEADER */
+    uint32_t last_modified;         /* likewise */
+    uint32_t origin_age;            /* Age the origin reported, added to each hit's Age */
+    uint32_t flags;                 /* RESPONSE_* */
+    uint32_t chunk_size;            /* body bytes per chunk if RESPONSE_CHUNKED */
+    int64_t content_length;         /* Content-Length, or -1 if absent */
+    uint64_t body_len;              /* bytes stored after the header block */
+    int64_t stored_at;              /* unix time the response was cached */
+    int64_t expires_at;             /* unix time it goes stale; 0 = no explicit lifetime */
+    uint64_t object_id;             /* tag its chunks must carry if RESPONSE_CHUNKED */
+} CachedResponse;
+
+typedef struct {
+    uint64_t object_id;
+} CachedChunk;
+
+/*
+ * Parse a complete raw response received at `now`. On success returns 0,
+ * sets *prefix (malloc'd, free it) to everything that precedes the body in
+ * the stored form, and points *body into raw. Returns -1 if the response
+ * must not be cached: unparseable, truncated, an uncacheable status, or
+ * Cache-Control no-store/no-cache/private or an expiry already passed.
+ */
+int response_prepare(const char *raw, size_t len, time_t now,
+                     char **prefix, size_t *prefix_len, const char **body, size_t *body_len);
+
+/*
+ * Parse the header block raw[0, head) of a 200 response with a
+ * Content-Length into the stored form of a chunked object, whatever of
+ * the body has arrived. Same return and *prefix conventions as
+ * response_prepare(); the Content-Length must be known.
+ */
+int response_prepare_chunked(const char *raw, size_t head, time_t now, uint32_t chunk_size, uint64_t object_id,
+                             char **prefix, size_t *prefix_len);
+
+/* Whether response_prepare() would keep a response with the header block raw[0, head), body permitting. */
+int response_cacheable(const char *raw, size_t head, time_t now);
+
+/* Length of the header block (through the blank line) of a raw response, or 0. */
+size_t response_header_end(const char *raw, size_t len);
+
+static inline const CachedResponse* response_meta(const char *stored) {
+    return (const CachedResponse*)stored;
+}
+static inline const CachedHeader* response_headers(const char *stored) {
+    return (const CachedHeader*)(stored + sizeof(CachedResponse));
+}
+static inline const char* response_header_block(const char *stored) {
+    return stored + sizeof(CachedResponse) + response_meta(stored)->header_count * sizeof(CachedHeader);
+}
+static inline const char* response_body(const char *stored) {
+    return response_header_block(stored) + response_meta(stored)->header_block_len;
+}
+
+/* Value of header i (an index such as meta->etag), or NULL if it is RESPONSE_NO_HEADER. */
+const char* response_header_value(const char *stored, uint32_t i, size_t *len);
+
+/*
+ * Find a header in the raw head of a request or response (the first line is
+ * skipped). Returns its value, trimmed, or NULL.
+ */
+const char* response_find_header(const char *head, size_t len, const char *name, size_t *value_len);
+
+/*
+ * Turn key, the object's key_len byte key followed by RESPONSE_CHUNK_KEY_EXTRA
+ * spare bytes, into the key of chunk `index`; returns its length. Paths
+ * never contain a NUL, so no object key can collide with a chunk key.
+ */
+static inline size_t response_chunk_key(char *key, size_t key_len, uint32_t index) {
+    key[key_len] = '\0';
+    memcpy(key + key_len + 1, &index, sizeof(index));
+    return key_len + RESPONSE_CHUNK_KEY_EXTRA;
+}
+
+static inline int response_is_fresh(const CachedResponse *r, time_t now) {
+    return r->expires_at == 0 || now < r->expires_at;
+}
+
+#endif
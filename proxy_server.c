@@ -1,36 +1,113 @@
 #include "proxy_parse.h"
+#include "proxy_arena.h"
+#include "proxy_bufpool.h"
+#include "proxy_cache.h"
+#include "proxy_cachemem.h"
+#include "proxy_intern.h"
+#include "proxy_response.h"
+#include <linux/errqueue.h>
+#include <linux/perf_event.h>
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
-#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 /* --- Default Configuration --- */
 #define DEFAULT_PORT 8080
 #define DEFAULT_THREADS 8
+#define DEFAULT_MISS_THREADS 16
 #define DEFAULT_CACHE_SIZE (200 * 1024 * 1024)
 #define DEFAULT_ELEMENT_SIZE (10 * 1024 * 1024)
+#define DEFAULT_CLIENT_MAX_CONCURRENT 4
+#define DEFAULT_CLIENT_MAX_QUEUED 32
+#define DEFAULT_FAIR_QUANTUM 1
+#define DEFAULT_RATE_CLIENT_PREFIX 24
+#define DEFAULT_RATE_BURST_MS 1000
+#define DEFAULT_BUFPOOL_GLOBAL_MAX 64
+#define DEFAULT_CACHE_AUTO_PERCENT 50
+#define DEFAULT_CHUNK_SIZE (1024 * 1024)
+#define DEFAULT_PREFETCH_THREADS 4
+#define DEFAULT_PREFETCH_MAX_LINKS 32
+#define DEFAULT_PREFETCH_MAX_SIZE (512 * 1024)
+#define DEFAULT_MARKOV_ENTRIES 4096
+#define DEFAULT_MARKOV_CONFIDENCE 50
+#define DEFAULT_PEER_CHECK_MS 1000
+#define DEFAULT_PEER_TIMEOUT_MS 500
 
 #define MAX_CLIENTS 100
 #define MAX_REQUEST_LEN 8192
 #define MAX_BLACKLIST_DOMAINS 100
+#define MAX_PEERS 32
 #define CACHE_HASHTABLE_SIZE 1024
+#define CLIENT_TABLE_SIZE 256
+#define REQUEST_ARENA_SIZE (16 * 1024)
+#define TASK_FREELIST_MAX (2 * MAX_CLIENTS)
+#define MEMORY_MONITOR_INTERVAL_MS 1000
+#define MEMORY_REGROW_QUIET_POLLS 30
+#define RATE_SHARDS 4096
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
 
 /* --- Global Configuration Variables --- */
 int g_port = DEFAULT_PORT;
 int g_thread_pool_size = DEFAULT_THREADS;
+int g_miss_pool_size = DEFAULT_MISS_THREADS;
 size_t g_max_cache_size = DEFAULT_CACHE_SIZE;
 size_t g_max_element_size = DEFAULT_ELEMENT_SIZE;
+int g_client_max_concurrent = DEFAULT_CLIENT_MAX_CONCURRENT;
+int g_client_max_queued = DEFAULT_CLIENT_MAX_QUEUED;
+int g_fair_quantum = DEFAULT_FAIR_QUANTUM;
+int g_rate_client_prefix = DEFAULT_RATE_CLIENT_PREFIX;
+int g_rate_burst_ms = DEFAULT_RATE_BURST_MS;
+int g_bufpool_global_max = DEFAULT_BUFPOOL_GLOBAL_MAX;
+int g_cache_huge_pages = 0;
+char g_cache_shared[128] = ""; /* shared-memory segment name; empty: a private cache */
+int g_cache_auto = 0;
+int g_cache_auto_percent = DEFAULT_CACHE_AUTO_PERCENT;
+int g_cache_pressure_monitor = -1; /* -1: on only when the cache is auto-sized */
+uint64_t g_rate_client_rps = 0, g_rate_host_rps = 0; /* 0 = unlimited */
+uint64_t g_rate_client_kbytes = 0, g_rate_host_kbytes = 0, g_rate_global_kbytes = 0;
+char g_access_log_path[128] = ""; /* empty: no access log */
+size_t g_hit_zerocopy_bytes = 0; /* hits with bodies this large use MSG_ZEROCOPY; 0 = never */
+int g_cache_large_objects = 1;
+size_t g_cache_chunk_bytes = DEFAULT_CHUNK_SIZE;
+int g_origin_range_streams = 0; /* parallel Range requests per large miss; 0 = off */
+int g_prefetch_html = 0;
+int g_prefetch_threads = DEFAULT_PREFETCH_THREADS;
+int g_prefetch_max_links = DEFAULT_PREFETCH_MAX_LINKS;
+size_t g_prefetch_max_bytes = DEFAULT_PREFETCH_MAX_SIZE;
+int g_prefetch_markov = 0;
+int g_prefetch_markov_entries = DEFAULT_MARKOV_ENTRIES;
+int g_prefetch_markov_confidence = DEFAULT_MARKOV_CONFIDENCE; /* percent of a key's transitions */
+char g_peers[MAX_PEERS][128]; /* one `peer = host:port` line each, this proxy included */
+int g_peer_count = 0;
+char g_peer_self[128] = ""; /* empty: the peer whose port is ours */
+char g_peer_secret[128] = ""; /* when set, peers prove themselves with it */
+int g_peer_check_ms = DEFAULT_PEER_CHECK_MS;
+int g_peer_timeout_ms = DEFAULT_PEER_TIMEOUT_MS;
 
 /* --- Global Variables --- */
 FILE *log_file;
@@ -39,11 +116,21 @@ char *blacklist[MAX_BLACKLIST_DOMAINS];
 int blacklist_count = 0;
 volatile sig_atomic_t server_running = 1;
 
+/* What a handler sent back to the client, for the access log. */
+typedef struct {
+    int status;     /* 0 if no response was sent */
+    size_t bytes;   /* body bytes sent to the client (all bytes relayed, for tunnels) */
+    int peer;       /* relayed from the peer that owns the key */
+} ResponseInfo;
+
 /* --- Forward Declarations --- */
-void handle_request(int client_socket);
+struct RateContext;
+struct Task;
+int handle_request(struct Task *task);
 void* worker_thread(void *arg);
-void handle_http_request(int client_socket, struct ParsedRequest *req, const char* original_request, int request_len);
-void handle_connect_request(int client_socket, struct ParsedRequest *req);
+void* miss_worker_thread(void *arg);
+void handle_http_request(int client_socket, struct ParsedRequest *req, const char *cache_key, size_t key_len, int peer, const struct RateContext *rate, ResponseInfo *info);
+void handle_connect_request(int client_socket, struct ParsedRequest *req, const struct RateContext *rate, ResponseInfo *info);
 
 /* --- Robust Logging --- */
 void log_message(const char* level, const char* format, ...) {
@@ -61,6 +148,48 @@ void log_message(const char* level, const char* format, ...) {
     pthread_mutex_unlock(&log_mutex);
 }
 
+/* --- Access Log --- */
+/*
+ * Optional (access_log in proxy.conf), one line per request, for traffic
+ * analysis and trace replay (test_client -R):
+ *
+ *   <unix time.ms> <client ip> <method> <host>:<port><path> <status> <bytes> <result> <duration us>
+ *
+ * result is HIT, MISS, TUNNEL, DENIED, LIMITED or BUSY, PARTIAL for a
+ * chunked large object that was only partly cached, or PEER for a miss
+ * relayed from the peer that owns the key. status is 0 when no response
+ * reached the client; bytes excludes response headers. Lines are buffered,
+ * so the file is complete only after shutdown.
+ */
+FILE *access_log_file;
+pthread_mutex_t access_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void log_access(uint32_t client_ip, const struct timespec *start, struct ParsedRequest *req,
+                const ResponseInfo *info, const char *result) {
+    if (!access_log_file) return;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long duration_us = (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+    struct in_addr addr = { .s_addr = htonl(client_ip) };
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    pthread_mutex_lock(&access_log_mutex);
+    fprintf(access_log_file, "%lld.%03ld %s %s %s:%s%s %d %zu %s %lld\n",
+            (long long)start->tv_sec, start->tv_nsec / 1000000, ip,
+            req->method ? req->method : "-", req->host ? req->host : "-",
+            req->port ? req->port : (req->method && strcmp(req->method, "CONNECT") == 0 ? "443" : "80"),
+            req->path ? req->path : "", info->status, info->bytes, result,
+            duration_us < 0 ? 0 : duration_us);
+    pthread_mutex_unlock(&access_log_mutex);
+}
+
+/* Status code of a raw HTTP response, or 0 if it doesn't start with a status line. */
+static int response_status(const char *data, size_t len) {
+    if (len < 12 || strncmp(data, "HTTP/", 5) != 0) return 0;
+    const char *sp = memchr(data, ' ', len < 16 ? len : 16);
+    return sp && (size_t)(sp - data) + 4 <= len ? atoi(sp + 1) : 0;
+}
+
 /* --- Configuration and Blacklist Loading --- */
 void load_configuration(const char *filename) {
     FILE *file = fopen(filename, "r");
@@ -74,11 +203,64 @@ void load_configuration(const char *filename) {
         if (sscanf(line, "%63s = %127s", key, value) == 2) {
             if (strcmp(key, "port") == 0) g_port = atoi(value);
             else if (strcmp(key, "threads") == 0) g_thread_pool_size = atoi(value);
-            else if (strcmp(key, "cache_size_mb") == 0) g_max_cache_size = (size_t)atoi(value) * 1024 * 1024;
+            else if (strcmp(key, "miss_threads") == 0) g_miss_pool_size = atoi(value);
+            else if (strcmp(key, "cache_size_mb") == 0) {
+                g_cache_auto = (strcmp(value, "auto") == 0);
+                if (!g_cache_auto) g_max_cache_size = (size_t)atoi(value) * 1024 * 1024;
+            }
+            else if (strcmp(key, "cache_auto_percent") == 0) g_cache_auto_percent = atoi(value);
+            else if (strcmp(key, "cache_pressure_monitor") == 0) g_cache_pressure_monitor = atoi(value);
             else if (strcmp(key, "element_size_mb") == 0) g_max_element_size = (size_t)atoi(value) * 1024 * 1024;
+            else if (strcmp(key, "client_max_concurrent") == 0) g_client_max_concurrent = atoi(value);
+            else if (strcmp(key, "client_max_queued") == 0) g_client_max_queued = atoi(value);
+            else if (strcmp(key, "fair_quantum") == 0) g_fair_quantum = atoi(value);
+            else if (strcmp(key, "rate_client_prefix") == 0) g_rate_client_prefix = atoi(value);
+            else if (strcmp(key, "rate_burst_ms") == 0) g_rate_burst_ms = atoi(value);
+            else if (strcmp(key, "bufpool_global_max") == 0) g_bufpool_global_max = atoi(value);
+            else if (strcmp(key, "cache_huge_pages") == 0) g_cache_huge_pages = atoi(value);
+            else if (strcmp(key, "cache_shared") == 0) snprintf(g_cache_shared, sizeof(g_cache_shared), "%s", value);
+            else if (strcmp(key, "rate_client_rps") == 0) g_rate_client_rps = strtoull(value, NULL, 10);
+            else if (strcmp(key, "rate_host_rps") == 0) g_rate_host_rps = strtoull(value, NULL, 10);
+            else if (strcmp(key, "rate_client_kbytes_per_sec") == 0) g_rate_client_kbytes = strtoull(value, NULL, 10);
+            else if (strcmp(key, "rate_host_kbytes_per_sec") == 0) g_rate_host_kbytes = strtoull(value, NULL, 10);
+            else if (strcmp(key, "rate_global_kbytes_per_sec") == 0) g_rate_global_kbytes = strtoull(value, NULL, 10);
+            else if (strcmp(key, "hit_zerocopy_kb") == 0) g_hit_zerocopy_bytes = (size_t)atoi(value) * 1024;
+            else if (strcmp(key, "cache_large_objects") == 0) g_cache_large_objects = atoi(value);
+            else if (strcmp(key, "cache_chunk_kb") == 0) g_cache_chunk_bytes = (size_t)atoi(value) * 1024;
+            else if (strcmp(key, "origin_range_streams") == 0) g_origin_range_streams = atoi(value);
+            else if (strcmp(key, "prefetch_html") == 0) g_prefetch_html = atoi(value);
+            else if (strcmp(key, "prefetch_threads") == 0) g_prefetch_threads = atoi(value);
+            else if (strcmp(key, "prefetch_max_links") == 0) g_prefetch_max_links = atoi(value);
+            else if (strcmp(key, "prefetch_max_kb") == 0) g_prefetch_max_bytes = (size_t)atoi(value) * 1024;
+            else if (strcmp(key, "prefetch_markov") == 0) g_prefetch_markov = atoi(value);
+            else if (strcmp(key, "prefetch_markov_entries") == 0) g_prefetch_markov_entries = atoi(value);
+            else if (strcmp(key, "prefetch_markov_confidence") == 0) g_prefetch_markov_confidence = atoi(value);
+            else if (strcmp(key, "access_log") == 0) snprintf(g_access_log_path, sizeof(g_access_log_path), "%s", value);
+            else if (strcmp(key, "peer") == 0 && g_peer_count < MAX_PEERS) {
+                snprintf(g_peers[g_peer_count++], sizeof(g_peers[0]), "%s", value);
+            }
+            else if (strcmp(key, "peer_self") == 0) snprintf(g_peer_self, sizeof(g_peer_self), "%s", value);
+            else if (strcmp(key, "peer_secret") == 0) snprintf(g_peer_secret, sizeof(g_peer_secret), "%s", value);
+            else if (strcmp(key, "peer_check_ms") == 0) g_peer_check_ms = atoi(value);
+            else if (strcmp(key, "peer_timeout_ms") == 0) g_peer_timeout_ms = atoi(value);
         }
     }
     fclose(file);
+    if (g_thread_pool_size < 1) g_thread_pool_size = 1;
+    if (g_miss_pool_size < 1) g_miss_pool_size = 1;
+    if (g_client_max_concurrent < 1) g_client_max_concurrent = 1;
+    if (g_client_max_queued < 1) g_client_max_queued = 1;
+    if (g_fair_quantum < 1) g_fair_quantum = 1;
+    if (g_rate_client_prefix < 0 || g_rate_client_prefix > 32) g_rate_client_prefix = DEFAULT_RATE_CLIENT_PREFIX;
+    if (g_rate_burst_ms < 1) g_rate_burst_ms = 1;
+    if (g_cache_auto_percent < 1 || g_cache_auto_percent > 90) g_cache_auto_percent = DEFAULT_CACHE_AUTO_PERCENT;
+    if (g_cache_pressure_monitor < 0) g_cache_pressure_monitor = g_cache_auto;
+    if (g_prefetch_threads < 1) g_prefetch_threads = 1;
+    if (g_prefetch_max_links < 0) g_prefetch_max_links = 0;
+    if (g_prefetch_markov_entries < 1) g_prefetch_markov_entries = DEFAULT_MARKOV_ENTRIES;
+    if (g_prefetch_markov_confidence < 1 || g_prefetch_markov_confidence > 100) g_prefetch_markov_confidence = DEFAULT_MARKOV_CONFIDENCE;
+    if (g_peer_check_ms < 100) g_peer_check_ms = 100;
+    if (g_peer_timeout_ms < 10) g_peer_timeout_ms = 10;
     printf("INFO: Configuration loaded from '%s'.\n", filename);
 }
 
@@ -112,123 +294,2032 @@ int is_blacklisted(const char *host) {
 }
 
 /* --- HIGH-PERFORMANCE LRU CACHE --- */
-typedef struct CacheNode {
-    char *key; char *data; size_t data_size;
-    struct CacheNode *prev, *next; struct CacheNode *h_next;
-} CacheNode;
-
-typedef struct {
-    size_t capacity; size_t size; int table_size;
-    CacheNode **table; CacheNode *head, *tail; pthread_mutex_t lock;
-} LRUCache;
-
+/* The engine lives in proxy_cache.c; the server owns the single instance. */
 LRUCache *cache;
-static unsigned long hash(const char *str) {
+static unsigned long hash(const char *str) { /* case-insensitive, as host names are */
     unsigned long hash = 5381; int c;
-    while ((c = *str++)) hash = ((hash << 5) + hash) + c;
+    while ((c = *str++)) hash = ((hash << 5) + hash) + tolower(c);
     return hash;
 }
-void detach_node(LRUCache *c, CacheNode *node) {
-    if (node->prev) node->prev->next = node->next; else c->head = node->next;
-    if (node->next) node->next->prev = node->prev; else c->tail = node->prev;
-}
-void attach_to_front(LRUCache *c, CacheNode *node) {
-    node->next = c->head; node->prev = NULL;
-    if (c->head) c->head->prev = node;
-    c->head = node; if (c->tail == NULL) c->tail = node;
-}
-LRUCache* create_cache(size_t capacity, int table_size) {
-    LRUCache *c = (LRUCache*)malloc(sizeof(LRUCache));
-    c->capacity = capacity; c->size = 0; c->table_size = table_size;
-    c->head = c->tail = NULL;
-    c->table = (CacheNode**)calloc(table_size, sizeof(CacheNode*));
-    pthread_mutex_init(&c->lock, NULL); return c;
-}
-CacheNode* get_from_cache(const char *key) {
-    pthread_mutex_lock(&cache->lock);
-    unsigned long h = hash(key) % cache->table_size;
-    CacheNode *node = cache->table[h];
-    while (node) {
-        if (strcmp(node->key, key) == 0) {
-            detach_node(cache, node); attach_to_front(cache, node);
-            pthread_mutex_unlock(&cache->lock);
-            log_message("INFO", "Cache HIT for request key.");
-            return node;
-        }
-        node = node->h_next;
-    }
-    pthread_mutex_unlock(&cache->lock);
-    log_message("INFO", "Cache MISS for request key.");
-    return NULL;
+/* Bookkeeping bytes per cached object: node slots, bucket array and page table. */
+void log_cache_stats(void) {
+    size_t meta = cache_metadata_bytes(cache);
+    cache_lock(cache);
+    uint32_t count = cache->state->count;
+    size_t size = cache->state->size;
+    cache_unlock(cache);
+    log_message("INFO", "Cache stats: objects=%u bytes=%zu metadata=%zu bytes (%.1f per object, node=%zu)",
+                count, size, meta, count ? (double)meta / count : 0.0, sizeof(CacheNode));
+}
+
+/* --- CACHE HIT DELIVERY --- */
+/*
+ * A hit is sent straight from the cache: the stored header block, the
+ * per-response headers (Age, X-Cache, Connection) and blank line, then the
+ * body, in one writev() with no copy of the cached bytes. Bodies of at least
+ * hit_zerocopy_kb go out with MSG_ZEROCOPY instead, after the headers are
+ * copied out with MSG_MORE; the per-response headers live on the stack, so
+ * only the pinned body may be sent zero-copy. The kernel reads the body
+ * from the cache pages after sendmsg() returns, so the node stays pinned
+ * until the socket's error queue reports every send complete.
+ */
+#define ZEROCOPY_WAIT_MS 30000
+
+_Atomic unsigned long stat_zerocopy_hits = 0, stat_zerocopy_copied = 0, stat_zerocopy_stuck = 0;
+
+/* Send every iovec on a socket with the given flags, resuming after short writes. */
+static int sendmsg_all(int fd, struct iovec *iov, int iovcnt, int flags) {
+    while (iovcnt > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t n = sendmsg(fd, &msg, flags);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) { n -= iov->iov_len; iov++; iovcnt--; }
+        if (iovcnt > 0) { iov->iov_base = (char*)iov->iov_base + n; iov->iov_len -= n; }
+    }
+    return 0;
+}
+
+/* Write every iovec, resuming after short writes. */
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    return sendmsg_all(fd, iov, iovcnt, 0);
+}
+
+/*
+ * Wait until the kernel has released the buffers of the first `sends`
+ * zero-copy sends on fd. Completions arrive on the error queue as ranges of
+ * send ids, which are numbered from 0 per socket.
+ */
+static int wait_zerocopy(int fd, uint32_t sends) {
+    uint32_t done = 0;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (done < sends) {
+        char control[128];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long waited_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (waited_ms >= ZEROCOPY_WAIT_MS) return -1;
+            struct pollfd pfd = { .fd = fd, .events = 0 }; /* POLLERR is always reported */
+            poll(&pfd, 1, (int)(ZEROCOPY_WAIT_MS - waited_ms));
+            continue;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+            struct sock_extended_err *ee = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            uint32_t completed = ee->ee_data - ee->ee_info + 1; /* ids ee_info..ee_data */
+            done += completed;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) stat_zerocopy_copied += completed;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Send the iovecs with MSG_ZEROCOPY. Returns 0, or -1 on a send error; either
+ * way *sends is the number of zero-copy sends made, which the caller must
+ * wait for even when a later send failed.
+ */
+static int sendmsg_zerocopy(int fd, struct iovec *iov, int iovcnt, uint32_t *sends) {
+    *sends = 0;
+    while (iovcnt > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t n = sendmsg(fd, &msg, MSG_ZEROCOPY);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != ENOBUFS) return -1;
+            n = writev(fd, iov, iovcnt); /* out of pinned-page budget: copy this piece */
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+        } else {
+            (*sends)++;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) { n -= iov->iov_len; iov++; iovcnt--; }
+        if (iovcnt > 0) { iov->iov_base = (char*)iov->iov_base + n; iov->iov_len -= n; }
+    }
+    return 0;
+}
+
+/*
+ * Send a cached response to the client. Returns 0 when the node may be
+ * released, or -1 if the kernel may still be reading its pages and the
+ * caller must keep it pinned.
+ */
+static int send_cached_response(int fd, CacheNode *node, int head_only, ResponseInfo *info) {
+    const char *stored = cache_node_data(node);
+    const CachedResponse *meta = response_meta(stored);
+    long long age = (long long)(time(NULL) - meta->stored_at) + meta->origin_age;
+    char extra[96];
+    int extra_len = snprintf(extra, sizeof(extra), "Age: %lld\r\nX-Cache: HIT\r\nConnection: close\r\n\r\n", age < 0 ? 0 : age);
+    struct iovec iov[3] = {
+        { (void*)response_header_block(stored), meta->header_block_len },
+        { extra, (size_t)extra_len },
+        { (void*)response_body(stored), meta->body_len },
+    };
+    int iovcnt = head_only ? 2 : 3;
+    size_t body = head_only ? 0 : meta->body_len;
+    info->status = (int)meta->status;
+
+    if (g_hit_zerocopy_bytes == 0 || body < g_hit_zerocopy_bytes) {
+        if (writev_all(fd, iov, iovcnt) == 0) info->bytes = body;
+        return 0;
+    }
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        if (writev_all(fd, iov, iovcnt) == 0) info->bytes = body;
+        return 0;
+    }
+    if (sendmsg_all(fd, iov, 2, MSG_MORE) < 0) return 0;
+    uint32_t sends;
+    if (sendmsg_zerocopy(fd, &iov[2], 1, &sends) == 0) info->bytes = body;
+    if (sends == 0) return 0;
+    stat_zerocopy_hits++;
+    if (wait_zerocopy(fd, sends) == 0) return 0;
+    /* Unconfirmed: leaking the pin is safer than letting the pages be reused mid-send */
+    stat_zerocopy_stuck++;
+    log_message("WARN", "Zero-copy completions missing after %d ms; keeping the cached object pinned", ZEROCOPY_WAIT_MS);
+    return -1;
+}
+
+/* --- RATE LIMITING --- */
+/*
+ * Hierarchical token buckets, implemented as GCRA: each bucket is a single
+ * atomic "theoretical arrival time" (TAT) in nanoseconds, so acquiring
+ * tokens is one CAS and never takes a lock. A request must pass its client
+ * subnet bucket and its destination host bucket; forwarded bytes are
+ * charged to the client, host and global bandwidth buckets. Per-key buckets
+ * live in a fixed array of cache-line-sized shards indexed by key hash, so
+ * keys that collide simply share a budget.
+ */
+typedef struct {
+    _Atomic uint64_t tat;
+    char pad[64 - sizeof(uint64_t)];
+} RateBucket;
+
+typedef struct {
+    uint64_t rate;      /* units per second; 0 disables the limiter */
+    uint64_t burst_ns;  /* how far TAT may run ahead of now */
+    RateBucket *shards; int nshards;
+} RateLimiter;
+
+typedef struct RateContext {
+    RateBucket *client_bw, *host_bw;
+} RateContext;
+
+RateLimiter rl_client_req, rl_host_req, rl_client_bw, rl_host_bw, rl_global_bw;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+static void init_rate_limiter(RateLimiter *rl, uint64_t rate, int nshards) {
+    rl->rate = rate; rl->nshards = nshards; rl->shards = NULL;
+    if (rate == 0) return;
+    rl->burst_ns = (uint64_t)g_rate_burst_ms * 1000000ULL;
+    if (rl->burst_ns < 1000000000ULL / rate) rl->burst_ns = 1000000000ULL / rate; /* allow at least one unit */
+    rl->shards = (RateBucket*)aligned_alloc(64, sizeof(RateBucket) * nshards);
+    if (!rl->shards) { rl->rate = 0; return; }
+    for (int i = 0; i < nshards; i++) atomic_init(&rl->shards[i].tat, 0);
+}
+void init_rate_limits(void) {
+    init_rate_limiter(&rl_client_req, g_rate_client_rps, RATE_SHARDS);
+    init_rate_limiter(&rl_host_req, g_rate_host_rps, RATE_SHARDS);
+    init_rate_limiter(&rl_client_bw, g_rate_client_kbytes * 1024, RATE_SHARDS);
+    init_rate_limiter(&rl_host_bw, g_rate_host_kbytes * 1024, RATE_SHARDS);
+    init_rate_limiter(&rl_global_bw, g_rate_global_kbytes * 1024, 1);
+}
+static RateBucket* rate_bucket(RateLimiter *rl, unsigned long key) {
+    if (rl->rate == 0) return NULL;
+    key ^= key >> 17; key *= 0x9E3779B97F4A7C15ULL; /* spread subnets and host hashes over the shards */
+    return &rl->shards[(key >> 32) % rl->nshards];
+}
+static unsigned long client_subnet_key(uint32_t client_ip) {
+    return g_rate_client_prefix >= 32 ? client_ip : client_ip & ~(0xFFFFFFFFu >> g_rate_client_prefix);
+}
+
+/* Take `units` tokens if they are available right now; returns 1 on success. */
+static int rate_try_acquire(RateLimiter *rl, RateBucket *b, uint64_t units, uint64_t now) {
+    if (!b) return 1;
+    uint64_t cost = units * 1000000000ULL / rl->rate;
+    uint64_t tat = atomic_load_explicit(&b->tat, memory_order_relaxed);
+    uint64_t new_tat;
+    do {
+        new_tat = (tat > now ? tat : now) + cost;
+        if (new_tat - now > rl->burst_ns) return 0;
+    } while (!atomic_compare_exchange_weak_explicit(&b->tat, &tat, new_tat, memory_order_relaxed, memory_order_relaxed));
+    return 1;
+}
+static void rate_refund(RateLimiter *rl, RateBucket *b, uint64_t units) {
+    if (b) atomic_fetch_sub_explicit(&b->tat, units * 1000000000ULL / rl->rate, memory_order_relaxed);
+}
+/* Unconditionally take `units` tokens; returns how long the caller must wait to stay within the rate. */
+static uint64_t rate_reserve(RateLimiter *rl, RateBucket *b, uint64_t units, uint64_t now) {
+    if (!b) return 0;
+    uint64_t cost = units * 1000000000ULL / rl->rate;
+    uint64_t tat = atomic_load_explicit(&b->tat, memory_order_relaxed);
+    uint64_t new_tat;
+    do {
+        new_tat = (tat > now ? tat : now) + cost;
+    } while (!atomic_compare_exchange_weak_explicit(&b->tat, &tat, new_tat, memory_order_relaxed, memory_order_relaxed));
+    return (new_tat - now > rl->burst_ns) ? new_tat - now - rl->burst_ns : 0;
+}
+
+/* Request admission: returns 1 if the client subnet and the host both have budget. */
+int rate_admit(uint32_t client_ip, const char *host, RateContext *ctx) {
+    /* By host id once the host is interned; a refused request never interns it */
+    uint32_t host_id = host ? intern_find(host, strlen(host)) : INTERN_NONE;
+    unsigned long host_key = host_id != INTERN_NONE ? host_id : hash(host ? host : "");
+    ctx->client_bw = rate_bucket(&rl_client_bw, client_subnet_key(client_ip));
+    ctx->host_bw = rate_bucket(&rl_host_bw, host_key);
+    uint64_t now = monotonic_ns();
+    RateBucket *cb = rate_bucket(&rl_client_req, client_subnet_key(client_ip));
+    if (!rate_try_acquire(&rl_client_req, cb, 1, now)) return 0;
+    RateBucket *hb = rate_bucket(&rl_host_req, host_key);
+    if (!rate_try_acquire(&rl_host_req, hb, 1, now)) {
+        rate_refund(&rl_client_req, cb, 1);
+        return 0;
+    }
+    return 1;
+}
+
+/* Charge forwarded bytes to every bandwidth level and sleep off any debt. */
+void rate_throttle(const RateContext *ctx, size_t bytes) {
+    if (!ctx->client_bw && !ctx->host_bw && rl_global_bw.rate == 0) return;
+    uint64_t now = monotonic_ns();
+    uint64_t wait = rate_reserve(&rl_client_bw, ctx->client_bw, bytes, now);
+    uint64_t w = rate_reserve(&rl_host_bw, ctx->host_bw, bytes, now);
+    if (w > wait) wait = w;
+    w = rate_reserve(&rl_global_bw, rate_bucket(&rl_global_bw, 0), bytes, now);
+    if (w > wait) wait = w;
+    if (wait > 0) {
+        struct timespec ts = { .tv_sec = wait / 1000000000ULL, .tv_nsec = wait % 1000000000ULL };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* --- MEMORY PRESSURE AND AUTO SIZING --- */
+/*
+ * With cache_size_mb = auto the cache gets cache_auto_percent of the
+ * container's memory limit (cgroup v2 memory.max, or the v1
+ * memory.limit_in_bytes, or physical RAM if neither sets a limit). A monitor
+ * thread then shrinks the cache when the kernel reports pressure: a PSI
+ * trigger on memory.pressure, new "high"/"max" events in memory.events, or
+ * memory.current approaching the limit. Inactive page cache (log writes,
+ * for one) is reclaimed before the limit bites, so it does not count as
+ * usage. Quiet periods let the cache grow back toward its target a step at
+ * a time.
+ */
+static char cgroup_dir[512];
+static size_t cache_target_capacity;
+
+static int read_file_line(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char *ok = fgets(buf, len, f);
+    fclose(f);
+    if (!ok) return -1;
+    buf[strcspn(buf, "\n")] = 0;
+    return 0;
 }
-void evict_lru() {
-    CacheNode *lru_node = cache->tail; if (!lru_node) return;
-    detach_node(cache, lru_node);
-    unsigned long h = hash(lru_node->key) % cache->table_size;
-    CacheNode *curr = cache->table[h], *prev = NULL;
-    while (curr) {
-        if (curr == lru_node) {
-            if (prev) prev->h_next = curr->h_next; else cache->table[h] = curr->h_next;
+
+/* Locate our cgroup v2 directory (empty if there is none); returns 0 on success. */
+int find_cgroup_dir(void) {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f) return -1;
+    char line[512], rel[400] = "";
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            snprintf(rel, sizeof(rel), "%s", line + 3);
+            rel[strcspn(rel, "\n")] = 0;
             break;
         }
-        prev = curr; curr = curr->h_next;
     }
-    cache->size -= lru_node->data_size;
-    log_message("INFO", "Evicting item. Cache size: %zu bytes", cache->size);
-    free(lru_node->key); free(lru_node->data); free(lru_node);
+    fclose(f);
+    const char *roots[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+    for (int i = 0; i < 2; i++) {
+        char probe[600];
+        snprintf(probe, sizeof(probe), "%s%s/memory.max", roots[i], strcmp(rel, "/") == 0 ? "" : rel);
+        if (access(probe, R_OK) == 0) {
+            snprintf(cgroup_dir, sizeof(cgroup_dir), "%s%s", roots[i], strcmp(rel, "/") == 0 ? "" : rel);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static size_t cgroup_read_size(const char *name) {
+    char path[600], buf[64];
+    snprintf(path, sizeof(path), "%s/%s", cgroup_dir, name);
+    if (read_file_line(path, buf, sizeof(buf)) < 0 || strcmp(buf, "max") == 0) return 0;
+    return (size_t)strtoull(buf, NULL, 10);
+}
+
+/* A field of the cgroup's memory.stat, in bytes; 0 if missing. */
+static size_t cgroup_memory_stat(const char *field) {
+    char path[600], line[128];
+    snprintf(path, sizeof(path), "%s/memory.stat", cgroup_dir);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    size_t value = 0, len = strlen(field);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, field, len) == 0 && line[len] == ' ') { value = (size_t)strtoull(line + len + 1, NULL, 10); break; }
+    }
+    fclose(f);
+    return value;
+}
+
+/* Memory limit that applies to this process, in bytes. */
+static size_t detect_memory_limit(const char **source) {
+    size_t limit = 0;
+    if (cgroup_dir[0] && (limit = cgroup_read_size("memory.max")) > 0) {
+        *source = "cgroup v2 memory.max";
+        return limit;
+    }
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f) { /* cgroup v1 fallback */
+        char line[512];
+        while (fgets(line, sizeof(line), f)) {
+            char *p = strstr(line, ":memory:");
+            if (!p) continue;
+            char path[600], buf[64];
+            p += strlen(":memory:");
+            p[strcspn(p, "\n")] = 0;
+            snprintf(path, sizeof(path), "/sys/fs/cgroup/memory%s/memory.limit_in_bytes", p);
+            if (read_file_line(path, buf, sizeof(buf)) == 0) limit = (size_t)strtoull(buf, NULL, 10);
+        }
+        fclose(f);
+    }
+    size_t phys = (size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE);
+    if (limit > 0 && limit < phys) { *source = "cgroup v1 memory.limit_in_bytes"; return limit; }
+    *source = "physical memory";
+    return phys;
+}
+
+void configure_auto_cache_size(void) {
+    const char *source = "";
+    size_t limit = detect_memory_limit(&source);
+    g_max_cache_size = limit / 100 * g_cache_auto_percent;
+    if (g_max_cache_size < g_max_element_size) g_max_cache_size = g_max_element_size;
+    log_message("INFO", "Auto cache size: %zuMB (%d%% of %zuMB from %s)", g_max_cache_size >> 20,
+                g_cache_auto_percent, limit >> 20, source);
 }
-void put_in_cache(const char *key, const char *data, size_t data_size) {
-    if (data_size > g_max_element_size) {
-        log_message("WARN", "Item too large to cache (%zu bytes)", data_size); return;
+
+void resize_cache(size_t new_capacity) {
+    cache_set_capacity(cache, new_capacity);
+    cachemem_trim();
+    malloc_trim(0);
+}
+
+static void shrink_cache(const char *reason, int divisor) {
+    size_t floor_cap = cache_target_capacity / 8;
+    size_t cap = cache->state->capacity - cache->state->capacity / divisor;
+    if (cap < floor_cap) cap = floor_cap;
+    if (cap >= cache->state->capacity) return;
+    log_message("WARN", "Memory pressure (%s): shrinking cache from %zuMB to %zuMB", reason,
+                cache->state->capacity >> 20, cap >> 20);
+    resize_cache(cap);
+}
+
+static unsigned long long read_memory_events(int fd) {
+    char buf[512];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return 0;
+    buf[n] = 0;
+    unsigned long long high = 0, max = 0;
+    char *p;
+    if ((p = strstr(buf, "high "))) high = strtoull(p + 5, NULL, 10);
+    if ((p = strstr(buf, "max "))) max = strtoull(p + 4, NULL, 10);
+    return high + max;
+}
+
+void* memory_monitor_thread(void *arg) {
+    char path[600];
+    struct pollfd fds[2];
+    int nfds = 0, psi_idx = -1, events_idx = -1;
+
+    /* PSI trigger: wake when tasks stall on memory for 100ms within any 1s window */
+    snprintf(path, sizeof(path), "%s/memory.pressure", cgroup_dir);
+    int psi_fd = cgroup_dir[0] ? open(path, O_RDWR | O_NONBLOCK) : -1;
+    if (psi_fd < 0) psi_fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK);
+    const char *trigger = "some 100000 1000000";
+    if (psi_fd >= 0 && write(psi_fd, trigger, strlen(trigger) + 1) > 0) {
+        psi_idx = nfds; fds[nfds].fd = psi_fd; fds[nfds++].events = POLLPRI;
+    } else if (psi_fd >= 0) { close(psi_fd); psi_fd = -1; }
+
+    /* memory.events changes are signalled as POLLPRI on the cgroup file */
+    snprintf(path, sizeof(path), "%s/memory.events", cgroup_dir);
+    int events_fd = cgroup_dir[0] ? open(path, O_RDONLY) : -1;
+    unsigned long long last_events = 0;
+    if (events_fd >= 0) {
+        last_events = read_memory_events(events_fd);
+        events_idx = nfds; fds[nfds].fd = events_fd; fds[nfds++].events = POLLPRI;
     }
-    pthread_mutex_lock(&cache->lock);
-    while (cache->size + data_size > cache->capacity) { evict_lru(); }
-    CacheNode *new_node = (CacheNode*)malloc(sizeof(CacheNode));
-    new_node->key = strdup(key);
-    new_node->data = (char*)malloc(data_size);
-    memcpy(new_node->data, data, data_size);
-    new_node->data_size = data_size;
-    attach_to_front(cache, new_node);
-    cache->size += data_size;
-    unsigned long h = hash(key) % cache->table_size;
-    new_node->h_next = cache->table[h];
-    cache->table[h] = new_node;
-    log_message("INFO", "Stored new item. Cache size: %zu bytes", cache->size);
-    pthread_mutex_unlock(&cache->lock);
+    log_message("INFO", "Memory monitor: PSI trigger %s, memory.events %s",
+                psi_idx >= 0 ? "on" : "unavailable", events_idx >= 0 ? "on" : "unavailable");
+
+    size_t limit = cgroup_dir[0] ? cgroup_read_size("memory.max") : 0;
+    int quiet_polls = 0;
+    while (server_running) {
+        int n = poll(fds, nfds, MEMORY_MONITOR_INTERVAL_MS);
+        if (n < 0 && errno != EINTR) break;
+        int pressured = 0;
+        if (n > 0 && psi_idx >= 0 && (fds[psi_idx].revents & POLLPRI)) {
+            shrink_cache("PSI stall", 4);
+            pressured = 1;
+        }
+        if (n > 0 && events_idx >= 0 && (fds[events_idx].revents & (POLLPRI | POLLERR))) {
+            unsigned long long ev = read_memory_events(events_fd);
+            if (ev > last_events) { shrink_cache("memory.events high/max", 2); pressured = 1; }
+            last_events = ev;
+        }
+        if (limit > 0) {
+            size_t current = cgroup_read_size("memory.current");
+            size_t reclaimable = cgroup_memory_stat("inactive_file");
+            current = current > reclaimable ? current - reclaimable : 0;
+            if (current > limit / 100 * 90) { shrink_cache("usage above 90% of memory.max", 4); pressured = 1; }
+        }
+        if (pressured) { quiet_polls = 0; continue; }
+        /* After a quiet stretch, grow back by 1/8 of the target per interval */
+        if (n == 0 && ++quiet_polls >= MEMORY_REGROW_QUIET_POLLS && cache->state->capacity < cache_target_capacity) {
+            size_t cap = cache->state->capacity + cache_target_capacity / 8;
+            if (cap > cache_target_capacity) cap = cache_target_capacity;
+            resize_cache(cap);
+            log_message("INFO", "Memory pressure subsided: cache capacity back to %zuMB", cap >> 20);
+        }
+    }
+    if (psi_fd >= 0) close(psi_fd);
+    if (events_fd >= 0) close(events_fd);
+    return NULL;
 }
 
 /* --- THREAD POOL IMPLEMENTATION --- */
+/*
+ * The task queue is fair across clients: each client IP gets its own bucket
+ * with a FIFO of pending sockets, and buckets with work are kept on a ring
+ * that workers service with deficit round robin. Every request costs one
+ * unit, so a bucket may dispatch up to g_fair_quantum requests per round.
+ * A bucket that already has g_client_max_concurrent requests in flight is
+ * skipped until one of them completes, so one heavy client can never occupy
+ * the whole pool.
+ */
+typedef struct ClientBucket {
+    uint32_t ip;
+    struct Task *q_head, *q_tail;
+    int queued; int active; int miss_active; int deficit; int in_ring;
+    unsigned long served; unsigned long rejected;
+    struct ClientBucket *h_next;
+    struct ClientBucket *ring_next, *ring_prev;
+} ClientBucket;
+
+/*
+ * A Task is one accepted connection. Its receive buffer comes from the I/O
+ * buffer pool; everything else the request needs while it is being served
+ * -- the ParsedRequest and its strings, the cache key, the miss-pool job --
+ * is carved from its arena, which is reset in one step when the task
+ * finishes. Finished tasks are kept on a free list with their arena block,
+ * so the request path does no malloc/free in the steady state.
+ */
+typedef struct Task {
+    int socket;
+    int in_miss_pool;
+    int from_peer;            /* sent by a verified peer proxy: not held to per-client limits */
+    ClientBucket *bucket;
+    Arena arena;
+    char *buffer; size_t buffer_cap;
+    struct timespec started;  /* wall clock when the request arrived, for the access log */
+    struct Task *next;
+} Task;
+
 typedef struct {
-    int *sockets; int capacity; int size; int head; int tail;
+    int capacity; int size;
+    ClientBucket **table; int table_size;
+    ClientBucket *ring;  /* bucket whose turn it is; NULL when idle */
+    Task *free_tasks; int free_count;
     pthread_mutex_t lock; pthread_cond_t not_empty; pthread_cond_t not_full;
 } TaskQueue;
 TaskQueue task_queue;
+size_t stat_arena_high_water = 0; /* most of an arena block any request used; under task_queue.lock */
+
 void init_task_queue(int capacity) {
-    task_queue.sockets = (int*)malloc(sizeof(int) * capacity);
-    task_queue.capacity = capacity; task_queue.size = 0; task_queue.head = 0; task_queue.tail = 0;
+    task_queue.capacity = capacity; task_queue.size = 0;
+    task_queue.table_size = CLIENT_TABLE_SIZE;
+    task_queue.table = (ClientBucket**)calloc(CLIENT_TABLE_SIZE, sizeof(ClientBucket*));
+    task_queue.ring = NULL;
+    task_queue.free_tasks = NULL; task_queue.free_count = 0;
     pthread_mutex_init(&task_queue.lock, NULL);
     pthread_cond_init(&task_queue.not_empty, NULL);
     pthread_cond_init(&task_queue.not_full, NULL);
 }
-void enqueue_task(int client_socket) {
+
+static ClientBucket* find_bucket(uint32_t ip, int create) {
+    unsigned long h = ip % task_queue.table_size;
+    ClientBucket *b = task_queue.table[h];
+    while (b && b->ip != ip) b = b->h_next;
+    if (!b && create) {
+        b = (ClientBucket*)calloc(1, sizeof(ClientBucket));
+        if (!b) return NULL;
+        b->ip = ip;
+        b->h_next = task_queue.table[h];
+        task_queue.table[h] = b;
+    }
+    return b;
+}
+static void release_bucket_if_idle(ClientBucket *b) {
+    if (b->active > 0 || b->queued > 0 || b->miss_active > 0) return;
+    unsigned long h = b->ip % task_queue.table_size;
+    ClientBucket **pp = &task_queue.table[h];
+    while (*pp && *pp != b) pp = &(*pp)->h_next;
+    if (*pp) *pp = b->h_next;
+    free(b);
+}
+static void ring_insert(ClientBucket *b) {
+    if (task_queue.ring == NULL) {
+        b->ring_next = b->ring_prev = b; task_queue.ring = b;
+    } else { /* insert just behind the current turn, i.e. at the end of the round */
+        ClientBucket *head = task_queue.ring;
+        b->ring_next = head; b->ring_prev = head->ring_prev;
+        head->ring_prev->ring_next = b; head->ring_prev = b;
+    }
+    b->in_ring = 1; b->deficit = 0;
+}
+static void ring_remove(ClientBucket *b) {
+    if (b->ring_next == b) task_queue.ring = NULL;
+    else {
+        b->ring_prev->ring_next = b->ring_next; b->ring_next->ring_prev = b->ring_prev;
+        if (task_queue.ring == b) task_queue.ring = b->ring_next;
+    }
+    b->in_ring = 0; b->deficit = 0;
+}
+
+/* Task recycling; caller holds the lock. */
+static Task* alloc_task(void) {
+    Task *t = task_queue.free_tasks;
+    if (t) {
+        task_queue.free_tasks = t->next; task_queue.free_count--;
+        return t;
+    }
+    t = (Task*)malloc(sizeof(Task));
+    if (t && arena_init(&t->arena, REQUEST_ARENA_SIZE) < 0) { free(t); t = NULL; }
+    return t;
+}
+static void recycle_task(Task *t) {
+    if (t->arena.high_water > stat_arena_high_water) stat_arena_high_water = t->arena.high_water;
+    arena_reset(&t->arena);
+    if (task_queue.free_count >= TASK_FREELIST_MAX) {
+        arena_destroy(&t->arena); free(t);
+        return;
+    }
+    t->next = task_queue.free_tasks;
+    task_queue.free_tasks = t; task_queue.free_count++;
+}
+
+/* Returns 0 on success, -1 if the client already has too many queued requests. */
+int enqueue_task(int client_socket, uint32_t client_ip) {
     pthread_mutex_lock(&task_queue.lock);
-    while (task_queue.size == task_queue.capacity) { pthread_cond_wait(&task_queue.not_full, &task_queue.lock); }
-    task_queue.sockets[task_queue.tail] = client_socket;
-    task_queue.tail = (task_queue.tail + 1) % task_queue.capacity;
+    while (task_queue.size == task_queue.capacity && server_running) { pthread_cond_wait(&task_queue.not_full, &task_queue.lock); }
+    ClientBucket *b = find_bucket(client_ip, 1);
+    Task *t = (b && b->queued < g_client_max_queued) ? alloc_task() : NULL;
+    if (!t) {
+        if (b) { b->rejected++; release_bucket_if_idle(b); }
+        pthread_mutex_unlock(&task_queue.lock);
+        return -1;
+    }
+    t->socket = client_socket; t->in_miss_pool = 0; t->from_peer = 0; t->bucket = b; t->next = NULL;
+    t->buffer = NULL; t->buffer_cap = 0;
+    if (b->q_tail) b->q_tail->next = t; else b->q_head = t;
+    b->q_tail = t;
+    b->queued++;
+    if (!b->in_ring) ring_insert(b);
     task_queue.size++;
     pthread_cond_signal(&task_queue.not_empty);
     pthread_mutex_unlock(&task_queue.lock);
+    return 0;
 }
-int dequeue_task() {
+
+/* Deficit round robin over the ring; returns NULL if every bucket is at its cap. */
+static ClientBucket* drr_pick_bucket(void) {
+    ClientBucket *b = task_queue.ring;
+    if (!b) return NULL;
+    ClientBucket *start = b;
+    do {
+        ClientBucket *next = b->ring_next;
+        if (b->active < g_client_max_concurrent) {
+            if (b->deficit <= 0) b->deficit += g_fair_quantum;
+            b->deficit--;
+            task_queue.ring = (b->deficit > 0) ? b : next;
+            return b;
+        }
+        b->deficit = 0; /* a capped bucket forfeits the rest of its round */
+        b = next;
+    } while (b != start);
+    task_queue.ring = start;
+    return NULL;
+}
+
+Task* dequeue_task() {
     pthread_mutex_lock(&task_queue.lock);
-    while (task_queue.size == 0 && server_running) { pthread_cond_wait(&task_queue.not_empty, &task_queue.lock); }
-    if (!server_running && task_queue.size == 0) { pthread_mutex_unlock(&task_queue.lock); return -1; }
-    int client_socket = task_queue.sockets[task_queue.head];
-    task_queue.head = (task_queue.head + 1) % task_queue.capacity;
+    ClientBucket *b = NULL;
+    while (server_running && (b = drr_pick_bucket()) == NULL) { pthread_cond_wait(&task_queue.not_empty, &task_queue.lock); }
+    if (!b && (b = drr_pick_bucket()) == NULL) { pthread_mutex_unlock(&task_queue.lock); return NULL; }
+    Task *t = b->q_head;
+    b->q_head = t->next; if (!b->q_head) b->q_tail = NULL;
+    b->queued--; b->active++; b->served++;
+    if (b->queued == 0) ring_remove(b);
     task_queue.size--;
     pthread_cond_signal(&task_queue.not_full);
     pthread_mutex_unlock(&task_queue.lock);
-    return client_socket;
+    return t;
+}
+
+/* Frees one of the bucket's front-stage slots; caller holds the lock. */
+static void release_front_slot(ClientBucket *b) {
+    int was_capped = (b->active >= g_client_max_concurrent && b->queued > 0);
+    b->active--;
+    if (was_capped) pthread_cond_signal(&task_queue.not_empty);
+}
+
+/*
+ * Moves a task from the front workers to the miss pool. The client's
+ * front-stage slot is released so its cache hits keep flowing; requests
+ * waiting on origins are bounded separately by g_client_max_queued.
+ * Returns -1 if the client already has that many misses outstanding.
+ */
+int handoff_task(Task *t) {
+    pthread_mutex_lock(&task_queue.lock);
+    ClientBucket *b = t->bucket;
+    if (!t->from_peer && b->miss_active >= g_client_max_queued) { pthread_mutex_unlock(&task_queue.lock); return -1; }
+    release_front_slot(b);
+    b->miss_active++;
+    t->in_miss_pool = 1;
+    pthread_mutex_unlock(&task_queue.lock);
+    return 0;
+}
+
+/* Called by a worker once it has finished with a task's socket. */
+void finish_task(Task *t) {
+    bufpool_put(t->buffer, t->buffer_cap);
+    t->buffer = NULL;
+    pthread_mutex_lock(&task_queue.lock);
+    ClientBucket *b = t->bucket;
+    if (t->in_miss_pool) b->miss_active--; else release_front_slot(b);
+    release_bucket_if_idle(b);
+    recycle_task(t);
+    pthread_mutex_unlock(&task_queue.lock);
+}
+
+/* --- MISS POOL --- */
+/*
+ * Front workers (the thread pool above) only parse requests and serve cache
+ * hits. Anything that has to talk to an origin -- cache misses and CONNECT
+ * tunnels -- is handed to this separate pool, so a slow origin ties up miss
+ * workers but never delays hits queued behind it. The Task travels with the
+ * job and is finished by the miss worker.
+ */
+typedef struct MissJob {
+    Task *task;
+    char *buffer;
+    struct ParsedRequest *req;
+    RateContext rate;
+    char *cache_key;  /* NULL for CONNECT */
+    size_t key_len;
+    CacheNode *large; /* pinned entry of a chunked object being served, else NULL */
+    uint32_t large_slot;
+    int peer;         /* peer that owns the key and serves the miss, or -1 */
+    struct MissJob *next;
+} MissJob;
+
+typedef struct {
+    MissJob *head, *tail; int size;
+    pthread_mutex_t lock; pthread_cond_t not_empty;
+} MissQueue;
+MissQueue miss_queue;
+_Atomic unsigned long stat_fast_hits = 0, stat_misses_dispatched = 0;
+
+void init_miss_queue(void) {
+    miss_queue.head = miss_queue.tail = NULL; miss_queue.size = 0;
+    pthread_mutex_init(&miss_queue.lock, NULL);
+    pthread_cond_init(&miss_queue.not_empty, NULL);
+}
+void enqueue_miss(MissJob *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&miss_queue.lock);
+    if (miss_queue.tail) miss_queue.tail->next = job; else miss_queue.head = job;
+    miss_queue.tail = job;
+    miss_queue.size++;
+    pthread_cond_signal(&miss_queue.not_empty);
+    pthread_mutex_unlock(&miss_queue.lock);
+}
+MissJob* dequeue_miss() {
+    pthread_mutex_lock(&miss_queue.lock);
+    while (miss_queue.size == 0 && server_running) { pthread_cond_wait(&miss_queue.not_empty, &miss_queue.lock); }
+    MissJob *job = miss_queue.head;
+    if (job) {
+        miss_queue.head = job->next; if (!miss_queue.head) miss_queue.tail = NULL;
+        miss_queue.size--;
+    }
+    pthread_mutex_unlock(&miss_queue.lock);
+    return job;
+}
+
+/* --- LARGE OBJECTS --- */
+/*
+ * A response too big for one cache element is cached in chunks (see
+ * proxy_response.h) if it is a 200 with a Content-Length and a validator
+ * from an origin that accepts byte ranges, and it is at most a quarter of
+ * the cache. The miss that fetches it stores each chunk as the body streams
+ * past; if the transfer stops early, the chunks it got stay cached. A hit
+ * is handed to the miss pool: it sends the chunks it finds and refetches
+ * each run of missing ones with a Range request, storing them again, so the
+ * cached copy fills back in as it is used. Clients may ask for a single
+ * byte range. Responses that don't qualify are relayed uncached once they
+ * outgrow the largest element.
+ */
+_Atomic unsigned long stat_large_fills = 0, stat_chunks_stored = 0, stat_chunk_hits = 0, stat_chunks_refetched = 0;
+
+/* Connect to an HTTP origin; port NULL means 80. Returns the socket, or -1 (logged). */
+static int connect_host(const char *hostname, const char *port) {
+    struct hostent *host = gethostbyname(hostname);
+    if (!host) {
+        log_message("ERROR", "Cannot resolve hostname for HTTP: %s", hostname);
+        return -1;
+    }
+    int remote_socket = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in remote_addr;
+    remote_addr.sin_family = AF_INET;
+    remote_addr.sin_port = htons(port ? atoi(port) : 80);
+    bcopy((char*)host->h_addr, (char*)&remote_addr.sin_addr.s_addr, host->h_length);
+    if (connect(remote_socket, (struct sockaddr*)&remote_addr, sizeof(remote_addr)) < 0) {
+        log_message("ERROR", "Failed to connect to remote host for HTTP: %s", hostname);
+        close(remote_socket);
+        return -1;
+    }
+    return remote_socket;
+}
+
+static int connect_origin(struct ParsedRequest *req) {
+    return connect_host(req->host, req->port);
+}
+
+/*
+ * Stores a stream of body bytes as chunks. Bytes are fed in order starting
+ * at a chunk boundary; each chunk is put in the cache once it is complete.
+ * Bytes in [send_from, send_to) are also sent to `client` unless it is -1.
+ */
+typedef struct {
+    char *key;                  /* chunk key; the object key is its first key_len bytes */
+    size_t key_len;
+    uint64_t object_id;
+    uint32_t chunk_size;
+    uint64_t length;            /* body length of the object */
+    uint64_t pos;               /* body offset of the next byte fed in */
+    char *chunk;                /* [CachedChunk][bytes] of the chunk being assembled */
+    size_t chunk_used;
+    int client;
+    uint64_t send_from, send_to;
+    uint64_t sent;
+    uint32_t stored;
+} ChunkFill;
+
+static int chunk_fill_init(ChunkFill *f, const char *key, size_t key_len, const CachedResponse *meta, int client) {
+    memset(f, 0, sizeof(*f));
+    f->key = (char*)malloc(key_len + RESPONSE_CHUNK_KEY_EXTRA);
+    f->chunk = (char*)malloc(sizeof(CachedChunk) + meta->chunk_size);
+    if (!f->key || !f->chunk) {
+        free(f->key); free(f->chunk);
+        return -1;
+    }
+    memcpy(f->key, key, key_len);
+    f->key_len = key_len;
+    f->object_id = meta->object_id;
+    f->chunk_size = meta->chunk_size;
+    f->length = meta->body_len;
+    f->client = client;
+    memcpy(f->chunk, &f->object_id, sizeof(f->object_id));
+    return 0;
+}
+
+/* Finish with a fill. The object's entry is moved to the front of the LRU list so it outlives its chunks. */
+static void chunk_fill_free(ChunkFill *f) {
+    uint32_t slot;
+    if (get_from_cache(cache, f->key, f->key_len, &slot)) release_cache_node(cache, slot);
+    free(f->key); free(f->chunk);
+}
+
+static size_t chunk_length(uint64_t length, uint32_t chunk_size, uint32_t index) {
+    uint64_t start = (uint64_t)index * chunk_size;
+    return length - start < chunk_size ? (size_t)(length - start) : chunk_size;
+}
+
+/* Returns -1 if sending to the client failed. */
+static int chunk_fill_feed(ChunkFill *f, const char *data, size_t len) {
+    while (len > 0 && f->pos < f->length) {
+        uint32_t index = (uint32_t)(f->pos / f->chunk_size);
+        size_t want = chunk_length(f->length, f->chunk_size, index);
+        size_t take = want - f->chunk_used < len ? want - f->chunk_used : len;
+        memcpy(f->chunk + sizeof(CachedChunk) + f->chunk_used, data, take);
+        if (f->client >= 0) {
+            uint64_t from = f->pos > f->send_from ? f->pos : f->send_from;
+            uint64_t to = f->pos + take < f->send_to ? f->pos + take : f->send_to;
+            if (from < to) {
+                struct iovec iov = { (void*)(data + (from - f->pos)), to - from };
+                if (writev_all(f->client, &iov, 1) < 0) return -1;
+                f->sent += to - from;
+            }
+        }
+        f->pos += take; f->chunk_used += take;
+        data += take; len -= take;
+        if (f->chunk_used == want) {
+            size_t key_len = response_chunk_key(f->key, f->key_len, index);
+            put_in_cache(cache, f->key, key_len, f->chunk, sizeof(CachedChunk) + want);
+            f->chunk_used = 0;
+            f->stored++;
+            stat_chunks_stored++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Called by a miss once the response headers are in: if the object should
+ * be cached in chunks, stores its entry and sets up f to take the body.
+ */
+static int large_object_start(ChunkFill *f, const char *raw, size_t head_len, const char *key, size_t key_len) {
+    if (!g_cache_large_objects || key_len + RESPONSE_CHUNK_KEY_EXTRA > CACHE_MAX_KEY_LEN) return -1;
+    size_t vlen;
+    const char *v = response_find_header(raw, head_len, "Content-Length", &vlen);
+    unsigned long long length = v ? strtoull(v, NULL, 10) : 0;
+    if (length + head_len <= g_max_element_size || length > cache->state->capacity / 4) return -1;
+    char *prefix; size_t prefix_len;
+    if (response_prepare_chunked(raw, head_len, time(NULL), (uint32_t)g_cache_chunk_bytes, cache_unique_id(cache),
+                                 &prefix, &prefix_len) < 0) return -1;
+    const CachedResponse *meta = response_meta(prefix);
+    int usable = (meta->flags & RESPONSE_ACCEPT_RANGES) &&
+                 (meta->etag != RESPONSE_NO_HEADER || meta->last_modified != RESPONSE_NO_HEADER);
+    if (!usable || chunk_fill_init(f, key, key_len, meta, -1) < 0) {
+        free(prefix);
+        return -1;
+    }
+    put_in_cache(cache, key, key_len, prefix, prefix_len);
+    free(prefix);
+    stat_large_fills++;
+    return 0;
+}
+
+/* Parses a single "bytes=" range; 1 with [*first, *last] set, 0 for none (or several), -1 if unsatisfiable. */
+static int parse_byte_range(const char *v, size_t vlen, uint64_t size, uint64_t *first, uint64_t *last) {
+    if (vlen < 7 || strncmp(v, "bytes=", 6) != 0 || memchr(v, ',', vlen)) return 0;
+    v += 6;
+    char *end;
+    if (*v == '-') { /* the last N bytes */
+        uint64_t n = strtoull(v + 1, &end, 10);
+        if (end == v + 1) return 0;
+        if (n == 0) return -1;
+        *first = n >= size ? 0 : size - n;
+        *last = size - 1;
+        return 1;
+    }
+    *first = strtoull(v, &end, 10);
+    if (end == v || *end != '-') return 0;
+    const char *l = end + 1;
+    *last = (*l >= '0' && *l <= '9') ? strtoull(l, &end, 10) : size - 1;
+    if (*first >= size) return -1;
+    if (*last < *first) return 0;
+    if (*last >= size) *last = size - 1;
+    return 1;
+}
+
+/* The range the client asked for, ignored if an If-Range validator no longer matches. */
+static int requested_range(const char *request, const char *stored, uint64_t *first, uint64_t *last) {
+    size_t request_len = strlen(request), vlen, if_len, validator_len;
+    const char *v = response_find_header(request, request_len, "Range", &vlen);
+    if (!v) return 0;
+    const char *if_range = response_find_header(request, request_len, "If-Range", &if_len);
+    if (if_range) {
+        const char *validator = response_header_value(stored, if_range[0] == '"' || if_range[0] == 'W' ?
+                                                      response_meta(stored)->etag : response_meta(stored)->last_modified,
+                                                      &validator_len);
+        if (!validator || validator_len != if_len || memcmp(validator, if_range, if_len) != 0) return 0;
+    }
+    return parse_byte_range(v, vlen, response_meta(stored)->body_len, first, last);
+}
+
+/* A chunk of the object, pinned, or NULL if it isn't cached (or belongs to another copy). */
+static CacheNode* get_chunk(ChunkFill *f, uint32_t index, uint32_t *slot) {
+    size_t key_len = response_chunk_key(f->key, f->key_len, index);
+    CacheNode *node = get_from_cache(cache, f->key, key_len, slot);
+    if (node && (node->data_size != sizeof(CachedChunk) + chunk_length(f->length, f->chunk_size, index) ||
+                 ((CachedChunk*)cache_node_data(node))->object_id != f->object_id)) {
+        release_cache_node(cache, *slot);
+        node = NULL;
+    }
+    return node;
+}
+
+/*
+ * Ask the origin for bytes [first, last] of an object of `length` bytes,
+ * conditional on the validator (If-Range), and read through the response
+ * headers. Returns the socket, with *used bytes in buffer of which the first
+ * *head_len are the headers; or -1, with *changed set if the origin answered
+ * with anything but exactly that range (the object changed).
+ */
+static int open_range(struct ParsedRequest *req, const char *validator, size_t validator_len,
+                      uint64_t first, uint64_t last, uint64_t length, const RateContext *rate,
+                      char *buffer, size_t cap, size_t *used, size_t *head_len, int *changed) {
+    *changed = 0;
+    int remote_socket = connect_origin(req);
+    if (remote_socket < 0) return -1;
+    char request[MAX_REQUEST_LEN];
+    int len = snprintf(request, sizeof(request),
+                       "GET %s %s\r\nHost: %s\r\nRange: bytes=%llu-%llu\r\nIf-Range: %.*s\r\nConnection: close\r\n\r\n",
+                       req->path, req->version, req->host, (unsigned long long)first, (unsigned long long)last,
+                       (int)validator_len, validator);
+    if (len >= (int)sizeof(request) || send(remote_socket, request, len, 0) < 0) {
+        close(remote_socket);
+        return -1;
+    }
+    *used = *head_len = 0;
+    ssize_t n;
+    while (*head_len == 0 && *used < cap && (n = recv(remote_socket, buffer + *used, cap - *used, 0)) > 0) {
+        rate_throttle(rate, n);
+        *used += n;
+        *head_len = response_header_end(buffer, *used);
+    }
+    size_t vlen;
+    const char *v = *head_len ? response_find_header(buffer, *head_len, "Content-Range", &vlen) : NULL;
+    char expect[80];
+    int elen = snprintf(expect, sizeof(expect), "bytes %llu-%llu/%llu", (unsigned long long)first,
+                        (unsigned long long)last, (unsigned long long)length);
+    if (*head_len == 0 || response_status(buffer, *used) != 206 || !v || vlen != (size_t)elen || memcmp(v, expect, vlen) != 0) {
+        *changed = *head_len > 0;
+        close(remote_socket);
+        return -1;
+    }
+    return remote_socket;
+}
+
+/* Fetch chunks [from, to] from the origin into the cache, sending the client its part of them. */
+static int refetch_chunks(ChunkFill *f, struct ParsedRequest *req, CacheNode *entry, uint32_t entry_slot, uint32_t from, uint32_t to,
+                          const RateContext *rate) {
+    const char *stored = cache_node_data(entry);
+    const CachedResponse *meta = response_meta(stored);
+    uint64_t first = (uint64_t)from * f->chunk_size;
+    uint64_t last = (uint64_t)to * f->chunk_size + chunk_length(f->length, f->chunk_size, to) - 1;
+    size_t validator_len;
+    const char *validator = response_header_value(stored, meta->etag, &validator_len);
+    if (!validator) validator = response_header_value(stored, meta->last_modified, &validator_len);
+    size_t cap;
+    char *buffer = bufpool_get(BUF_SIZE_LARGE, &cap);
+    if (!buffer) return -1;
+    stat_chunks_refetched += to - from + 1;
+    size_t used, head_len;
+    int changed;
+    int remote_socket = open_range(req, validator, validator_len, first, last, f->length, rate,
+                                   buffer, cap, &used, &head_len, &changed);
+    if (remote_socket < 0) {
+        if (changed) {
+            log_message("WARN", "Origin %s no longer matches the cached copy of %s; dropping it", req->host, req->path);
+            invalidate_cache_node(cache, entry_slot);
+        }
+        bufpool_put(buffer, cap);
+        return -1;
+    }
+    f->pos = first; f->chunk_used = 0;
+    int ok = chunk_fill_feed(f, buffer + head_len, used - head_len) == 0;
+    ssize_t n;
+    while (ok && f->pos <= last && (n = recv(remote_socket, buffer, cap, 0)) > 0) {
+        rate_throttle(rate, n);
+        ok = chunk_fill_feed(f, buffer, n) == 0;
+    }
+    bufpool_put(buffer, cap);
+    close(remote_socket);
+    return ok && f->pos == last + 1 ? 0 : -1;
+}
+
+/*
+ * Serve a hit on a chunked object from the miss pool. Returns the number of
+ * chunks that had to be fetched from the origin.
+ */
+static uint32_t serve_large_object(int client, struct ParsedRequest *req, const char *request, CacheNode *entry,
+                                   uint32_t entry_slot, const RateContext *rate, ResponseInfo *info) {
+    const char *stored = cache_node_data(entry);
+    const CachedResponse *meta = response_meta(stored);
+    uint64_t first = 0, last = meta->body_len - 1;
+    int range = requested_range(request, stored, &first, &last);
+    if (range < 0) {
+        char resp[128];
+        int len = snprintf(resp, sizeof(resp), "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%llu\r\n"
+                           "Content-Length: 0\r\nConnection: close\r\n\r\n", (unsigned long long)meta->body_len);
+        send(client, resp, len, 0);
+        info->status = 416;
+        return 0;
+    }
+
+    /* A 206 rewrites the status line and framing; everything else is sent as stored */
+    const char *block = response_header_block(stored);
+    char *head = (char*)malloc(meta->header_block_len + 256);
+    if (!head) return 0;
+    size_t head_len = 0;
+    if (range) {
+        head_len = (size_t)sprintf(head, "HTTP/1.1 206 Partial Content\r\n");
+        const CachedHeader *h = response_headers(stored);
+        for (uint32_t i = 0; i < meta->header_count; i++) {
+            if (h[i].name_len == 14 && strncasecmp(block + h[i].name_off, "Content-Length", 14) == 0) continue;
+            size_t line = h[i].value_off + h[i].value_len - h[i].name_off;
+            memcpy(head + head_len, block + h[i].name_off, line);
+            head_len += line;
+            head[head_len++] = '\r'; head[head_len++] = '\n';
+        }
+        head_len += (size_t)sprintf(head + head_len, "Content-Range: bytes %llu-%llu/%llu\r\nContent-Length: %llu\r\n",
+                                    (unsigned long long)first, (unsigned long long)last,
+                                    (unsigned long long)meta->body_len, (unsigned long long)(last - first + 1));
+    } else {
+        memcpy(head, block, meta->header_block_len);
+        head_len = meta->header_block_len;
+    }
+    long long age = (long long)(time(NULL) - meta->stored_at) + meta->origin_age;
+    head_len += (size_t)sprintf(head + head_len, "Age: %lld\r\nX-Cache: HIT\r\nConnection: close\r\n\r\n", age < 0 ? 0 : age);
+    struct iovec head_iov = { head, head_len };
+    int sent_head = writev_all(client, &head_iov, 1) == 0;
+    free(head);
+    if (!sent_head) return 0;
+    info->status = range ? 206 : (int)meta->status;
+    if (strcmp(req->method, "HEAD") == 0) return 0;
+
+    ChunkFill fill;
+    if (chunk_fill_init(&fill, cache_node_blob(entry), entry->key_len, meta, client) < 0) return 0;
+    fill.send_from = first; fill.send_to = last + 1;
+    uint32_t index = (uint32_t)(first / meta->chunk_size), end = (uint32_t)(last / meta->chunk_size);
+    uint32_t fetched = 0;
+    while (index <= end) {
+        uint32_t chunk_slot;
+        CacheNode *chunk = get_chunk(&fill, index, &chunk_slot);
+        if (chunk) {
+            uint64_t start = (uint64_t)index * meta->chunk_size;
+            uint64_t from = first > start ? first - start : 0;
+            uint64_t to = chunk->data_size - sizeof(CachedChunk);
+            if (start + to > last + 1) to = last + 1 - start;
+            rate_throttle(rate, to - from);
+            struct iovec iov = { cache_node_data(chunk) + sizeof(CachedChunk) + from, to - from };
+            int ok = writev_all(client, &iov, 1) == 0;
+            release_cache_node(cache, chunk_slot);
+            if (!ok) break;
+            fill.sent += to - from;
+            stat_chunk_hits++;
+            index++;
+            continue;
+        }
+        /* Refetch the whole run of missing chunks in one request */
+        uint32_t run_end = index;
+        while (run_end < end && (chunk = get_chunk(&fill, run_end + 1, &chunk_slot)) == NULL) run_end++;
+        if (chunk) release_cache_node(cache, chunk_slot);
+        fetched += run_end - index + 1;
+        if (refetch_chunks(&fill, req, entry, entry_slot, index, run_end, rate) < 0) break;
+        index = run_end + 1;
+    }
+    info->bytes = fill.sent;
+    chunk_fill_free(&fill);
+    return fetched;
+}
+
+/* --- PARALLEL RANGE FETCH --- */
+/*
+ * Origins often cap the throughput of a single connection. With
+ * origin_range_streams set, a miss that is being cached in chunks reads only
+ * its first chunk from the original response while that many helper
+ * threads fetch the rest with Range requests, each claiming the next chunk
+ * in order. The miss worker sends the chunks to the client in order as they
+ * complete and stores them in the cache. Helpers run at most two chunks per
+ * stream ahead of the client, which bounds the memory a miss can hold; a
+ * chunk whose fetch fails is retried once, then the response ends early.
+ */
+#define RANGE_FETCH_RETRIES 1
+#define MAX_RANGE_STREAMS 16
+
+enum { SLOT_EMPTY, SLOT_FETCHING, SLOT_READY, SLOT_FAILED };
+
+typedef struct {
+    char *data;                 /* [CachedChunk][bytes], ready to store */
+    uint32_t index;
+    int state;
+} RangeSlot;
+
+typedef struct {
+    struct ParsedRequest *req;
+    const RateContext *rate;
+    char validator[256];
+    size_t validator_len;
+    uint64_t length;
+    uint32_t chunk_size, chunks;
+    uint32_t next;              /* next chunk for a helper to claim */
+    uint32_t done;              /* chunks below this have been sent; slots are reused modulo window */
+    uint32_t window;
+    int streams, stopping;
+    RangeSlot *slots;
+    pthread_t *threads;
+    pthread_mutex_t lock; pthread_cond_t changed;
+} RangeFetch;
+
+_Atomic unsigned long stat_parallel_fills = 0, stat_range_requests = 0, stat_range_failures = 0;
+
+/* Read bytes [first, first + len) of the object into dst with one ranged request. */
+static int fetch_range(RangeFetch *rf, uint64_t first, size_t len, char *dst) {
+    size_t cap;
+    char *buffer = bufpool_get(BUF_SIZE_SMALL, &cap);
+    if (!buffer) return -1;
+    stat_range_requests++;
+    size_t used, head_len;
+    int changed;
+    int remote_socket = open_range(rf->req, rf->validator, rf->validator_len, first, first + len - 1, rf->length,
+                                   rf->rate, buffer, cap, &used, &head_len, &changed);
+    if (remote_socket < 0) {
+        if (changed) log_message("WARN", "Origin %s changed %s during a parallel fetch", rf->req->host, rf->req->path);
+        bufpool_put(buffer, cap);
+        return -1;
+    }
+    size_t got = used - head_len < len ? used - head_len : len;
+    memcpy(dst, buffer + head_len, got);
+    bufpool_put(buffer, cap);
+    ssize_t n;
+    while (got < len && (n = recv(remote_socket, dst + got, len - got, 0)) > 0) {
+        rate_throttle(rf->rate, n);
+        got += n;
+    }
+    close(remote_socket);
+    return got == len ? 0 : -1;
+}
+
+static void* range_fetch_thread(void *arg) {
+    RangeFetch *rf = (RangeFetch*)arg;
+    pthread_mutex_lock(&rf->lock);
+    while (1) {
+        while (!rf->stopping && rf->next < rf->chunks && rf->next >= rf->done + rf->window) {
+            pthread_cond_wait(&rf->changed, &rf->lock);
+        }
+        if (rf->stopping || rf->next >= rf->chunks) break;
+        uint32_t index = rf->next++;
+        RangeSlot *slot = &rf->slots[index % rf->window];
+        slot->index = index; slot->state = SLOT_FETCHING;
+        pthread_mutex_unlock(&rf->lock);
+        size_t len = chunk_length(rf->length, rf->chunk_size, index);
+        int ok = 0;
+        for (int attempt = 0; !ok && attempt <= RANGE_FETCH_RETRIES; attempt++) {
+            ok = fetch_range(rf, (uint64_t)index * rf->chunk_size, len, slot->data + sizeof(CachedChunk)) == 0;
+        }
+        pthread_mutex_lock(&rf->lock);
+        slot->state = ok ? SLOT_READY : SLOT_FAILED;
+        if (!ok) stat_range_failures++;
+        pthread_cond_broadcast(&rf->changed);
+    }
+    pthread_mutex_unlock(&rf->lock);
+    return NULL;
+}
+
+static void range_fetch_free(RangeFetch *rf) {
+    for (uint32_t i = 0; i < rf->window; i++) free(rf->slots[i].data);
+    free(rf->slots); free(rf->threads);
+    pthread_mutex_destroy(&rf->lock);
+    pthread_cond_destroy(&rf->changed);
+    free(rf);
+}
+
+/*
+ * Start helpers on chunks 1 and up of a fill that large_object_start() just
+ * set up from the response headers raw[0, head_len). Returns NULL if the
+ * option is off or the helpers can't be started; the miss then reads the
+ * whole body from its own connection.
+ */
+static RangeFetch* range_fetch_start(ChunkFill *f, struct ParsedRequest *req, const RateContext *rate,
+                                     const char *raw, size_t head_len) {
+    uint32_t chunks = (uint32_t)((f->length + f->chunk_size - 1) / f->chunk_size);
+    if (g_origin_range_streams <= 0 || chunks < 2) return NULL;
+    size_t validator_len;
+    const char *validator = response_find_header(raw, head_len, "ETag", &validator_len);
+    if (!validator) validator = response_find_header(raw, head_len, "Last-Modified", &validator_len);
+    RangeFetch *rf = (RangeFetch*)calloc(1, sizeof(RangeFetch));
+    if (!validator || validator_len >= sizeof(rf->validator) || !rf) { free(rf); return NULL; }
+    memcpy(rf->validator, validator, validator_len);
+    rf->validator_len = validator_len;
+    rf->req = req; rf->rate = rate;
+    rf->length = f->length; rf->chunk_size = f->chunk_size; rf->chunks = chunks;
+    rf->next = rf->done = 1;
+    int streams = g_origin_range_streams < MAX_RANGE_STREAMS ? g_origin_range_streams : MAX_RANGE_STREAMS;
+    rf->window = 2 * (uint32_t)streams;
+    pthread_mutex_init(&rf->lock, NULL);
+    pthread_cond_init(&rf->changed, NULL);
+    rf->slots = (RangeSlot*)calloc(rf->window, sizeof(RangeSlot));
+    rf->threads = (pthread_t*)calloc(streams, sizeof(pthread_t));
+    for (uint32_t i = 0; rf->slots && i < rf->window; i++) {
+        rf->slots[i].index = UINT32_MAX;
+        rf->slots[i].data = (char*)malloc(sizeof(CachedChunk) + f->chunk_size);
+        if (!rf->slots[i].data) { rf->window = i; break; }
+        memcpy(rf->slots[i].data, &f->object_id, sizeof(f->object_id));
+    }
+    if (!rf->slots || !rf->threads || rf->window < 2 * (uint32_t)streams) {
+        range_fetch_free(rf);
+        return NULL;
+    }
+    for (rf->streams = 0; rf->streams < streams; rf->streams++) {
+        if (pthread_create(&rf->threads[rf->streams], NULL, range_fetch_thread, rf) != 0) break;
+    }
+    if (rf->streams == 0) {
+        range_fetch_free(rf);
+        return NULL;
+    }
+    stat_parallel_fills++;
+    return rf;
+}
+
+/*
+ * Take over from the miss's own connection, which has delivered the body up
+ * to f->pos: send the client the rest in order and cache each chunk. Frees
+ * rf and returns the body bytes sent.
+ */
+static uint64_t range_fetch_finish(RangeFetch *rf, ChunkFill *f, int client) {
+    uint64_t sent = 0;
+    int client_ok = 1;
+    pthread_mutex_lock(&rf->lock);
+    for (uint32_t i = 1; i < rf->chunks; i++) {
+        RangeSlot *slot = &rf->slots[i % rf->window];
+        while (slot->index != i || (slot->state != SLOT_READY && slot->state != SLOT_FAILED)) {
+            pthread_cond_wait(&rf->changed, &rf->lock);
+        }
+        if (slot->state == SLOT_FAILED) break;
+        pthread_mutex_unlock(&rf->lock);
+        uint64_t start = (uint64_t)i * rf->chunk_size;
+        size_t len = chunk_length(rf->length, rf->chunk_size, i);
+        if (start + len > f->pos) { /* the fill neither sent nor stored it */
+            size_t skip = f->pos > start ? (size_t)(f->pos - start) : 0;
+            struct iovec iov = { slot->data + sizeof(CachedChunk) + skip, len - skip };
+            if (client_ok && writev_all(client, &iov, 1) == 0) {
+                sent += len - skip;
+            } else {
+                client_ok = 0; /* keep filling the cache, as a miss does when its client leaves */
+            }
+            size_t key_len = response_chunk_key(f->key, f->key_len, i);
+            put_in_cache(cache, f->key, key_len, slot->data, sizeof(CachedChunk) + len);
+            f->stored++;
+            stat_chunks_stored++;
+        }
+        pthread_mutex_lock(&rf->lock);
+        slot->state = SLOT_EMPTY;
+        rf->done = i + 1;
+        pthread_cond_broadcast(&rf->changed);
+    }
+    rf->stopping = 1;
+    pthread_cond_broadcast(&rf->changed);
+    pthread_mutex_unlock(&rf->lock);
+    for (int i = 0; i < rf->streams; i++) pthread_join(rf->threads[i], NULL);
+    range_fetch_free(rf);
+    return sent;
+}
+
+/* --- HTML PREFETCH --- */
+/*
+ * A browser that loads an HTML page asks for the page's scripts, styles and
+ * images right after it. With prefetch_html on, a miss for a cacheable
+ * text/html page scans the body as it streams past for src attributes and
+ * <link href>, and queues the same-origin http:// targets that aren't cached
+ * yet. prefetch_threads background workers fetch them into the cache, so the
+ * requests that follow are hits. Links in <a href> are navigations, not
+ * subresources, and are left alone. The work is bounded: at most
+ * prefetch_max_links URLs are queued per page and PREFETCH_QUEUE_MAX in
+ * total (more are dropped), each worker runs one fetch at a time, and a
+ * response larger than prefetch_max_kb is abandoned rather than cached.
+ */
+#define PREFETCH_QUEUE_MAX 256
+#define PREFETCH_MAX_URL 2048
+#define PREFETCH_TAG_LOOKBACK 1024  /* how far back from an attribute its tag's '<' is looked for */
+
+enum { PREFETCH_HTML, PREFETCH_MARKOV, PREFETCH_SOURCES }; /* who asked for a prefetch */
+
+typedef struct PrefetchJob {
+    struct PrefetchJob *next;
+    int source;
+    char *key;                  /* the strings live in the same allocation, after the job */
+    size_t key_len;
+    char *host, *port, *path;
+} PrefetchJob;
+
+typedef struct {
+    PrefetchJob *head, *tail; int size;
+    pthread_mutex_t lock; pthread_cond_t not_empty;
+} PrefetchQueue;
+PrefetchQueue prefetch_queue = { NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Per source. `used` objects were hit by a client afterwards; stored bytes never used were wasted. */
+typedef struct {
+    _Atomic unsigned long queued, dropped, present, stored, skipped, failed, used;
+    _Atomic uint64_t fetched_bytes, stored_bytes, used_bytes;
+} PrefetchStats;
+PrefetchStats prefetch_stats[PREFETCH_SOURCES];
+_Atomic unsigned long stat_prefetch_pages = 0;
+
+/* Scan state of one page being filled. */
+typedef struct {
+    const char *origin_key;     /* the page's cache key; its first origin_len bytes name the origin */
+    size_t origin_len;
+    const char *host, *port, *path;
+    size_t scanned;             /* body bytes already scanned */
+    int links;                  /* URLs queued for this page */
+} LinkScan;
+
+static int html_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+/* Count the first client hit on an object the prefetcher stored. */
+static void prefetch_note_hit(CacheNode *node) {
+    CachedResponse *meta = (CachedResponse*)cache_node_data(node);
+    uint32_t flags = __atomic_fetch_and(&meta->flags, ~(uint32_t)(RESPONSE_PREFETCHED | RESPONSE_PREDICTED), __ATOMIC_RELAXED);
+    if (flags & RESPONSE_PREFETCHED) {
+        PrefetchStats *st = &prefetch_stats[flags & RESPONSE_PREDICTED ? PREFETCH_MARKOV : PREFETCH_HTML];
+        st->used++;
+        st->used_bytes += meta->body_len;
+    }
+}
+
+static int cached_and_fresh(const char *key, size_t key_len) {
+    uint32_t slot;
+    CacheNode *node = get_from_cache(cache, key, key_len, &slot);
+    if (!node) return 0;
+    int fresh = response_is_fresh(response_meta(cache_node_data(node)), time(NULL));
+    release_cache_node(cache, slot);
+    return fresh;
+}
+
+/*
+ * Queue a fetch of path from the origin whose key prefix is
+ * origin_key[0, origin_len), unless it is cached and fresh or already
+ * queued. Returns 1 if it was queued.
+ */
+static int prefetch_enqueue(int source, const char *origin_key, size_t origin_len, const char *host, const char *port,
+                            const char *path, size_t path_len) {
+    PrefetchStats *st = &prefetch_stats[source];
+    size_t key_len = origin_len + path_len;
+    size_t host_len = strlen(host) + 1, port_len = port ? strlen(port) + 1 : 0;
+    PrefetchJob *job = (PrefetchJob*)malloc(sizeof(PrefetchJob) + key_len + host_len + port_len + path_len + 1);
+    if (!job) return 0;
+    job->source = source;
+    job->key = (char*)(job + 1);
+    memcpy(job->key, origin_key, origin_len);
+    memcpy(job->key + origin_len, path, path_len);
+    job->key_len = key_len;
+    job->host = job->key + key_len;
+    memcpy(job->host, host, host_len);
+    job->port = port_len ? job->host + host_len : NULL;
+    if (port_len) memcpy(job->port, port, port_len);
+    job->path = job->host + host_len + port_len;
+    memcpy(job->path, path, path_len);
+    job->path[path_len] = '\0';
+    if (cached_and_fresh(job->key, key_len)) {
+        st->present++;
+        free(job);
+        return 0;
+    }
+    pthread_mutex_lock(&prefetch_queue.lock);
+    PrefetchJob *q = prefetch_queue.head;
+    while (q && (q->key_len != key_len || memcmp(q->key, job->key, key_len) != 0)) q = q->next;
+    if (q || prefetch_queue.size >= PREFETCH_QUEUE_MAX) { /* already queued, or full */
+        pthread_mutex_unlock(&prefetch_queue.lock);
+        if (!q) st->dropped++;
+        free(job);
+        return 0;
+    }
+    job->next = NULL;
+    if (prefetch_queue.tail) prefetch_queue.tail->next = job; else prefetch_queue.head = job;
+    prefetch_queue.tail = job;
+    prefetch_queue.size++;
+    pthread_cond_signal(&prefetch_queue.not_empty);
+    pthread_mutex_unlock(&prefetch_queue.lock);
+    st->queued++;
+    return 1;
+}
+
+/* Collapse "." and ".." segments of the path part (before any query) of a URL path. */
+static size_t remove_dot_segments(char *path, size_t len) {
+    char *query = memchr(path, '?', len);
+    char *end = query ? query : path + len;
+    char *w = path;
+    for (const char *r = path; r < end; ) {
+        const char *seg = r + 1;
+        const char *next = memchr(seg, '/', end - seg);
+        if (!next) next = end;
+        size_t seg_len = next - seg;
+        if (seg_len == 1 && seg[0] == '.') {
+            if (next == end) *w++ = '/';
+        } else if (seg_len == 2 && seg[0] == '.' && seg[1] == '.') {
+            while (w > path && *--w != '/') {}
+            if (next == end) *w++ = '/';
+        } else {
+            memmove(w, r, next - r);
+            w += next - r;
+        }
+        r = next;
+    }
+    if (w == path) *w++ = '/';
+    memmove(w, end, path + len - end);
+    return (w - path) + (path + len - end);
+}
+
+/*
+ * Resolve an attribute value against the page. Writes the path of a
+ * same-origin http URL to out (PREFETCH_MAX_URL bytes) and returns its
+ * length, or returns 0 for anything else: other hosts, ports or schemes,
+ * fragments only, or characters that can't go into a request line.
+ */
+static size_t resolve_link(const LinkScan *s, const char *v, size_t len, char *out) {
+    char url[PREFETCH_MAX_URL];
+    size_t n = 0;
+    while (len > 0 && html_space(*v)) { v++; len--; }
+    while (len > 0 && html_space(v[len - 1])) len--;
+    for (size_t i = 0; i < len && v[i] != '#'; i++) { /* decode &amp;, the only entity URLs commonly carry */
+        if ((unsigned char)v[i] <= ' ' || v[i] == 0x7f || n + 1 >= sizeof(url)) return 0;
+        url[n++] = v[i];
+        if (v[i] == '&' && len - i >= 5 && strncmp(v + i, "&amp;", 5) == 0) i += 4;
+    }
+    url[n] = '\0';
+    if (n == 0) return 0;
+
+    const char *rest = NULL;
+    if (strncasecmp(url, "http://", 7) == 0) rest = url + 7;
+    else if (strncmp(url, "//", 2) == 0) rest = url + 2;
+    size_t out_len = 0;
+    if (rest) {
+        size_t authority = strcspn(rest, "/?");
+        const char *colon = memchr(rest, ':', authority);
+        size_t host_len = colon ? (size_t)(colon - rest) : authority;
+        int port = colon ? atoi(colon + 1) : 80;
+        if (host_len != strlen(s->host) || strncasecmp(rest, s->host, host_len) != 0 ||
+            port != (s->port ? atoi(s->port) : 80)) return 0;
+        rest += authority;
+        if (*rest != '/') out[out_len++] = '/';
+    } else if (url[0] == '/') {
+        rest = url;
+    } else {
+        size_t scheme = strcspn(url, ":/?");
+        if (url[scheme] == ':') return 0; /* https:, data:, javascript:, ... */
+        size_t base = strcspn(s->path, "?");
+        if (url[0] != '?') {
+            while (base > 0 && s->path[base - 1] != '/') base--;
+            if (base == 0) return 0;
+        }
+        if (base >= PREFETCH_MAX_URL) return 0;
+        memcpy(out, s->path, base);
+        out_len = base;
+        rest = url;
+    }
+    size_t rest_len = strlen(rest);
+    if (out_len + rest_len >= PREFETCH_MAX_URL) return 0;
+    memcpy(out + out_len, rest, rest_len);
+    return remove_dot_segments(out, out_len + rest_len);
+}
+
+/* Whether name (len bytes) is the attribute name that ends at name_end. */
+static int attribute_is(const char *body, const char *name_end, const char *name, size_t len) {
+    if ((size_t)(name_end - body) <= len || strncasecmp(name_end - len, name, len) != 0) return 0;
+    char before = name_end[-(ptrdiff_t)len - 1];
+    return html_space(before);
+}
+
+/* The '<' of the tag an attribute at p sits in, or NULL if p isn't inside a tag. */
+static const char* enclosing_tag(const char *body, const char *p) {
+    const char *limit = p - body > PREFETCH_TAG_LOOKBACK ? p - PREFETCH_TAG_LOOKBACK : body;
+    while (p > limit) {
+        p--;
+        if (*p == '<') return p;
+        if (*p == '>') return NULL;
+    }
+    return NULL;
+}
+
+/*
+ * Scan body[s->scanned, len) and queue the links found. memchr, which glibc
+ * vectorizes, skips to each '='; only those positions are looked at more
+ * closely. A link cut off at len is picked up by the next call, once more of
+ * the body has arrived, unless final is set.
+ */
+static void prefetch_scan(LinkScan *s, const char *body, size_t len, int final) {
+    const char *p = body + s->scanned, *end = body + len, *eq;
+    while (s->links < g_prefetch_max_links && (eq = memchr(p, '=', end - p)) != NULL) {
+        p = eq + 1;
+        const char *name_end = eq;
+        while (name_end > body && html_space(name_end[-1])) name_end--;
+        int href = attribute_is(body, name_end, "href", 4);
+        if (!href && !attribute_is(body, name_end, "src", 3)) continue;
+        const char *v = eq + 1;
+        while (v < end && html_space(*v)) v++;
+        const char *v_end = NULL, *limit = end - v > PREFETCH_MAX_URL ? v + PREFETCH_MAX_URL : end;
+        if (v < end && (*v == '"' || *v == '\'')) {
+            v_end = memchr(v + 1, *v, limit - v - 1);
+            v++;
+        } else {
+            const char *q = v;
+            while (q < limit && *q != '>' && !html_space(*q)) q++;
+            if (q < limit) v_end = q;
+        }
+        if (!v_end) {
+            if (!final && limit == end) { /* the value runs past what has arrived */
+                s->scanned = eq - body;
+                return;
+            }
+            continue;
+        }
+        p = v_end;
+        const char *tag = enclosing_tag(body, name_end);
+        if (!tag || (href && (strncasecmp(tag + 1, "link", 4) != 0 || !html_space(tag[5])))) continue;
+        char path[PREFETCH_MAX_URL];
+        size_t path_len = resolve_link(s, v, v_end - v, path);
+        if (path_len > 0 && prefetch_enqueue(PREFETCH_HTML, s->origin_key, s->origin_len, s->host, s->port, path, path_len)) {
+            s->links++;
+        }
+    }
+    s->scanned = len;
+}
+
+/*
+ * Set up a scan of the response with the header block raw[0, head_len)
+ * that a miss for req is filling in under key. Returns 0 unless prefetching
+ * is on and it is a cacheable HTML page.
+ */
+static int prefetch_scan_start(LinkScan *s, const char *raw, size_t head_len, struct ParsedRequest *req,
+                               const char *key, size_t key_len) {
+    if (!g_prefetch_html || response_status(raw, head_len) != 200) return 0;
+    size_t type_len, path_len = strlen(req->path);
+    const char *type = response_find_header(raw, head_len, "Content-Type", &type_len);
+    if (!type || type_len < 9 || strncasecmp(type, "text/html", 9) != 0 || path_len > key_len ||
+        !response_cacheable(raw, head_len, time(NULL))) return 0;
+    s->origin_key = key;
+    s->origin_len = key_len - path_len; /* the key is the origin followed by the path */
+    s->host = req->host; s->port = req->port; s->path = req->path;
+    s->scanned = 0;
+    s->links = 0;
+    stat_prefetch_pages++;
+    return 1;
+}
+
+static void markov_forget(const char *key, size_t key_len);
+
+/* Fetch one queued URL into the cache, reading the response into buffer. */
+static void prefetch_fetch(PrefetchJob *job, char *buffer, size_t cap) {
+    PrefetchStats *st = &prefetch_stats[job->source];
+    if (cached_and_fresh(job->key, job->key_len)) { /* a client got there first */
+        st->present++;
+        return;
+    }
+    int remote_socket = connect_host(job->host, job->port);
+    if (remote_socket < 0) {
+        st->failed++;
+        return;
+    }
+    char request[PREFETCH_MAX_URL + 512];
+    int request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                               job->path, job->host);
+    size_t used = 0;
+    ssize_t n;
+    if (send(remote_socket, request, request_len, 0) == request_len) {
+        while (used < cap && (n = recv(remote_socket, buffer + used, cap - used, 0)) > 0) used += n;
+    }
+    close(remote_socket);
+    st->fetched_bytes += used;
+    char *prefix; size_t prefix_len; const char *body; size_t body_len;
+    if (used == 0) {
+        st->failed++;
+    } else if (used < cap && response_prepare(buffer, used, time(NULL), &prefix, &prefix_len, &body, &body_len) == 0) {
+        ((CachedResponse*)prefix)->flags |= RESPONSE_PREFETCHED | (job->source == PREFETCH_MARKOV ? RESPONSE_PREDICTED : 0);
+        put_in_cache_prefixed(cache, job->key, job->key_len, prefix, prefix_len, body, body_len);
+        free(prefix);
+        st->stored++;
+        st->stored_bytes += body_len;
+    } else {
+        st->skipped++; /* too large, or not cacheable */
+        if (job->source == PREFETCH_MARKOV) markov_forget(job->key, job->key_len); /* don't predict it again */
+    }
+}
+
+void* prefetch_thread(void *arg) {
+    size_t cap = g_prefetch_max_bytes + RESPONSE_MAX_HEADER_BYTES;
+    char *buffer = (char*)malloc(cap);
+    while (1) {
+        pthread_mutex_lock(&prefetch_queue.lock);
+        while (prefetch_queue.size == 0 && server_running) pthread_cond_wait(&prefetch_queue.not_empty, &prefetch_queue.lock);
+        PrefetchJob *job = server_running ? prefetch_queue.head : NULL; /* queued jobs are dropped at shutdown */
+        if (job) {
+            prefetch_queue.head = job->next; if (!prefetch_queue.head) prefetch_queue.tail = NULL;
+            prefetch_queue.size--;
+        }
+        pthread_mutex_unlock(&prefetch_queue.lock);
+        if (!job) break;
+        if (buffer) prefetch_fetch(job, buffer, cap);
+        free(job);
+    }
+    free(buffer);
+    return NULL;
+}
+
+/* --- MARKOV PREFETCH --- */
+/*
+ * API clients repeat sequences: after A they ask for B. With
+ * prefetch_markov on, the proxy learns these pairs online from each
+ * client's request stream. The model is a fixed table of
+ * prefetch_markov_entries slots, direct-mapped by key hash. A slot holds,
+ * for one key, the MARKOV_SUCCESSORS keys that most often followed it from
+ * the same client within MARKOV_GAP_MS. Counts are halved when a key's total
+ * reaches MARKOV_MAX_COUNT, so the model follows changes in the traffic. A
+ * successor that accounts for at least prefetch_markov_confidence percent of
+ * a key's transitions (over at least MARKOV_MIN_SAMPLES) is predicted; when
+ * the key is requested, its predicted successors go to the prefetch workers,
+ * but only while no misses are waiting, so prefetches use idle capacity.
+ * A URL table of the same size remembers how to fetch each key seen
+ * recently. Requests take the model's lock with trylock and are not learned
+ * from if it is busy, so the request path never waits on it.
+ */
+#define MARKOV_SUCCESSORS 4
+#define MARKOV_MIN_SAMPLES 4
+#define MARKOV_MAX_COUNT 256
+#define MARKOV_GAP_MS 5000
+#define MARKOV_CLIENTS 1024
+
+typedef struct {
+    uint64_t hash;              /* key hash, 0 if the slot is unused */
+    uint32_t total;             /* transitions seen from this key (decayed with the counts) */
+    struct { uint64_t hash; uint32_t count; } next[MARKOV_SUCCESSORS];
+} MarkovEntry;
+
+typedef struct {
+    uint64_t hash;
+    char *key;                  /* key, then host, port and path strings, in one allocation */
+    size_t key_len;
+    char *host, *port, *path;
+} MarkovUrl;
+
+typedef struct {
+    uint32_t ip;
+    uint64_t last;              /* hash of the client's previous request */
+    uint64_t at_ms;
+} MarkovClient;
+
+static MarkovEntry *markov_entries;
+static MarkovUrl *markov_urls;
+static MarkovClient markov_clients[MARKOV_CLIENTS];
+static uint32_t markov_size;
+pthread_mutex_t markov_lock = PTHREAD_MUTEX_INITIALIZER;
+_Atomic unsigned long stat_markov_transitions = 0, stat_markov_busy = 0;
+
+static uint64_t markov_hash(const char *key, size_t len) { /* FNV-1a; never 0 */
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) { h ^= (unsigned char)key[i]; h *= 1099511628211ULL; }
+    return h | 1;
+}
+
+void init_markov(void) {
+    markov_size = (uint32_t)g_prefetch_markov_entries;
+    markov_entries = (MarkovEntry*)calloc(markov_size, sizeof(MarkovEntry));
+    markov_urls = (MarkovUrl*)calloc(markov_size, sizeof(MarkovUrl));
+    if (!markov_entries || !markov_urls) {
+        log_message("ERROR", "Allocation for the access-sequence model failed; Markov prefetch disabled");
+        free(markov_entries); free(markov_urls);
+        markov_entries = NULL; markov_urls = NULL;
+        g_prefetch_markov = 0;
+    }
+}
+
+/* Remember how to fetch the key with hash h. Caller holds markov_lock. */
+static void markov_remember_url(uint64_t h, const char *key, size_t key_len, struct ParsedRequest *req) {
+    MarkovUrl *u = &markov_urls[h % markov_size];
+    if (u->hash == h) return;
+    size_t host_len = strlen(req->host) + 1, port_len = req->port ? strlen(req->port) + 1 : 0;
+    size_t path_len = strlen(req->path) + 1;
+    char *blob = (char*)malloc(key_len + host_len + port_len + path_len);
+    if (!blob) return;
+    free(u->key);
+    memcpy(blob, key, key_len);
+    u->hash = h; u->key = blob; u->key_len = key_len;
+    u->host = blob + key_len;
+    memcpy(u->host, req->host, host_len);
+    u->port = port_len ? u->host + host_len : NULL;
+    if (port_len) memcpy(u->port, req->port, port_len);
+    u->path = u->host + host_len + port_len;
+    memcpy(u->path, req->path, path_len);
+}
+
+/* Count a transition from -> to. Caller holds markov_lock. */
+static void markov_record(uint64_t from, uint64_t to) {
+    MarkovEntry *e = &markov_entries[from % markov_size];
+    if (e->hash != from) { /* the slot belonged to another key; it starts over */
+        memset(e, 0, sizeof(*e));
+        e->hash = from;
+    }
+    int slot = 0;
+    for (int i = 0; i < MARKOV_SUCCESSORS; i++) {
+        if (e->next[i].hash == to) { slot = i; break; }
+        if (e->next[i].count < e->next[slot].count) slot = i;
+    }
+    if (e->next[slot].hash != to) { /* replace the weakest successor */
+        e->total -= e->next[slot].count;
+        e->next[slot].hash = to;
+        e->next[slot].count = 0;
+    }
+    e->next[slot].count++;
+    if (++e->total >= MARKOV_MAX_COUNT) {
+        e->total = 0;
+        for (int i = 0; i < MARKOV_SUCCESSORS; i++) {
+            e->next[i].count /= 2;
+            e->total += e->next[i].count;
+        }
+    }
+}
+
+/*
+ * Learn from a request by client ip for key, and queue the predicted
+ * successors of key for prefetching.
+ */
+void markov_observe(uint32_t ip, const char *key, size_t key_len, struct ParsedRequest *req) {
+    uint64_t h = markov_hash(key, key_len), now_ms = monotonic_ns() / 1000000;
+    if (pthread_mutex_trylock(&markov_lock) != 0) {
+        stat_markov_busy++;
+        return;
+    }
+    markov_remember_url(h, key, key_len, req);
+    MarkovClient *c = &markov_clients[(ip * 2654435761u) % MARKOV_CLIENTS];
+    if (c->ip == ip && c->last != 0 && c->last != h && now_ms - c->at_ms <= MARKOV_GAP_MS) {
+        markov_record(c->last, h);
+        stat_markov_transitions++;
+    }
+    c->ip = ip; c->last = h; c->at_ms = now_ms;
+    const MarkovEntry *e = &markov_entries[h % markov_size];
+    if (e->hash == h && e->total >= MARKOV_MIN_SAMPLES && miss_queue.size == 0) {
+        for (int i = 0; i < MARKOV_SUCCESSORS; i++) {
+            if (e->next[i].count == 0 || e->next[i].count * 100 < e->total * (uint32_t)g_prefetch_markov_confidence) continue;
+            const MarkovUrl *u = &markov_urls[e->next[i].hash % markov_size];
+            if (u->hash != e->next[i].hash) continue; /* its URL was overwritten since */
+            size_t path_len = strlen(u->path);
+            prefetch_enqueue(PREFETCH_MARKOV, u->key, u->key_len - path_len, u->host, u->port, u->path, path_len);
+        }
+    }
+    pthread_mutex_unlock(&markov_lock);
+}
+
+/* Stop predicting key, e.g. because it can't be cached. */
+static void markov_forget(const char *key, size_t key_len) {
+    uint64_t h = markov_hash(key, key_len);
+    pthread_mutex_lock(&markov_lock);
+    MarkovUrl *u = &markov_urls[h % markov_size];
+    if (u->hash == h) {
+        free(u->key);
+        memset(u, 0, sizeof(*u));
+    }
+    pthread_mutex_unlock(&markov_lock);
+}
+
+static void log_prefetch_stats(int source, const char *name) {
+    const PrefetchStats *st = &prefetch_stats[source];
+    unsigned long stored = st->stored, used = st->used;
+    uint64_t stored_bytes = st->stored_bytes, used_bytes = st->used_bytes;
+    log_message("INFO", "%s: queued=%lu stored=%lu used=%lu (%.1f%% accuracy), %llu KB wasted of %llu KB stored "
+                "(already cached=%lu dropped=%lu skipped=%lu failed=%lu, %llu KB fetched)",
+                name, st->queued, stored, used, stored ? 100.0 * used / stored : 0.0,
+                (unsigned long long)((stored_bytes > used_bytes ? stored_bytes - used_bytes : 0) / 1024),
+                (unsigned long long)(stored_bytes / 1024), st->present, st->dropped, st->skipped, st->failed,
+                (unsigned long long)(st->fetched_bytes / 1024));
+}
+
+/* --- PEER CLUSTER --- */
+/*
+ * With `peer` lines in the configuration, the proxies behind one load
+ * balancer divide the keys among themselves instead of each caching the
+ * same popular objects. Every key has one owner, chosen by rendezvous
+ * hashing over the live peers: each peer scores hash(key, peer) and the
+ * highest score wins, so when a peer drops out only the keys it owned move.
+ * A miss on a key another peer owns is requested from that peer, marked
+ * with X-Proxy-Peer, and relayed without keeping a local copy; the owner
+ * answers from its cache or fetches and stores the object. A request from
+ * a peer is never forwarded again, so peers that briefly disagree about
+ * who is up cannot loop. A request whose X-Proxy-Peer names another
+ * configured peer (and carries X-Proxy-Peer-Secret, when peer_secret is
+ * set) skips the per-client miss and rate limits. A health thread probes
+ * every peer each peer_check_ms; a probe that has arrived by the time its
+ * connection is accepted is answered there, ahead of the queue. A peer that fails PEER_FAILS_TO_DROP probes in a row, or refuses a
+ * connection, leaves the ring until a probe succeeds again. The owner's
+ * response is held back until its status line is in; if it sends nothing,
+ * or answers 503 or 429, the miss goes to the origin instead. Once any of it
+ * has been relayed, a cut-off response just ends the connection.
+ */
+#define PEER_FAILS_TO_DROP 2
+#define PEER_HEALTH_REQUEST "GET /.peer-health HTTP/1.0\r\n\r\n"
+#define PEER_HEALTH_PREFIX "GET /.peer-health "
+
+typedef struct {
+    char name[128];             /* host:port, as every peer's configuration spells it */
+    struct sockaddr_in addr;
+    uint64_t hash;
+    _Atomic int alive;
+    int failures;               /* consecutive failed probes; health thread only */
+} Peer;
+
+Peer peers[MAX_PEERS];
+int peer_count = 0, peer_self = -1;
+_Atomic unsigned long stat_peer_fetches = 0, stat_peer_fallbacks = 0, stat_peer_requests = 0;
+
+static uint64_t peer_hash(uint64_t h, const char *s, size_t len) { /* FNV-1a, continued from h */
+    for (size_t i = 0; i < len; i++) { h ^= (unsigned char)s[i]; h *= 1099511628211ULL; }
+    return h;
+}
+static uint64_t peer_mix(uint64_t x) { /* splitmix64 finalizer: FNV alone leaves the scores correlated */
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* Resolve the configured peers and find this proxy among them. Returns the number of peers; 0 turns peering off. */
+int init_peers(void) {
+    int self_matches = 0;
+    for (int i = 0; i < g_peer_count; i++) {
+        const char *colon = strrchr(g_peers[i], ':');
+        char host[128];
+        snprintf(host, sizeof(host), "%.*s", colon ? (int)(colon - g_peers[i]) : 0, g_peers[i]);
+        struct hostent *he = colon ? gethostbyname(host) : NULL;
+        if (!he) {
+            log_message("WARN", "Ignoring peer %s: expected a resolvable host:port", g_peers[i]);
+            continue;
+        }
+        Peer *p = &peers[peer_count];
+        memset(&p->addr, 0, sizeof(p->addr));
+        p->addr.sin_family = AF_INET;
+        p->addr.sin_port = htons(atoi(colon + 1));
+        memcpy(&p->addr.sin_addr.s_addr, he->h_addr, he->h_length);
+        snprintf(p->name, sizeof(p->name), "%s", g_peers[i]);
+        p->hash = peer_hash(14695981039346656037ULL, p->name, strlen(p->name));
+        p->alive = 1; p->failures = 0;
+        int self = g_peer_self[0] ? strcmp(p->name, g_peer_self) == 0 : atoi(colon + 1) == g_port;
+        if (self && self_matches++ == 0) peer_self = peer_count;
+        peer_count++;
+    }
+    if (peer_count > 0 && self_matches != 1) {
+        log_message("WARN", "%s peer matches this proxy; set peer_self. Peering is off.", self_matches ? "More than one" : "No");
+        peer_count = 0;
+    }
+    return peer_count;
+}
+
+/* Connect to a peer, giving up after timeout_ms. Returns a blocking socket, or -1. */
+static int peer_connect(const Peer *p, int timeout_ms) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) return -1;
+    int flags = fcntl(s, F_GETFL, 0);
+    fcntl(s, F_SETFL, flags | O_NONBLOCK);
+    int rc = connect(s, (const struct sockaddr*)&p->addr, sizeof(p->addr));
+    if (rc < 0 && errno == EINPROGRESS) {
+        struct pollfd pfd = { .fd = s, .events = POLLOUT };
+        int err = 0; socklen_t len = sizeof(err);
+        if (poll(&pfd, 1, timeout_ms) == 1 && getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) rc = 0;
+    }
+    if (rc < 0) { close(s); return -1; }
+    fcntl(s, F_SETFL, flags);
+    return s;
+}
+
+static void peer_down(int i, const char *reason) {
+    if (atomic_exchange(&peers[i].alive, 0)) {
+        log_message("WARN", "Peer %s is down (%s); its keys move to the other peers", peers[i].name, reason);
+    }
+}
+
+/* The live peer that owns req's key, or -1 if this proxy does. */
+static int peer_owner(struct ParsedRequest *req) {
+    uint64_t h = 14695981039346656037ULL;
+    const char *port = req->port ? req->port : "80";
+    h = peer_hash(h, req->host, strlen(req->host));
+    h = peer_hash(h, ":", 1);
+    h = peer_hash(h, port, strlen(port));
+    h = peer_hash(h, req->path, strlen(req->path));
+    int best = -1;
+    uint64_t best_score = 0;
+    for (int i = 0; i < peer_count; i++) {
+        if (i != peer_self && !peers[i].alive) continue;
+        uint64_t score = peer_mix(h ^ peers[i].hash);
+        if (best < 0 || score > best_score) { best = i; best_score = score; }
+    }
+    return best == peer_self ? -1 : best;
+}
+
+/* Peer to fetch a miss from: -1 unless peering is on, another peer owns the key and the request isn't from a peer. */
+static int peer_route(struct ParsedRequest *req, const char *request, size_t len) {
+    if (peer_count == 0) return -1;
+    size_t vlen;
+    if (response_find_header(request, len, "X-Proxy-Peer", &vlen)) { stat_peer_requests++; return -1; }
+    return peer_owner(req);
+}
+
+static int peer_probe(const Peer *p) {
+    int s = peer_connect(p, g_peer_timeout_ms);
+    if (s < 0) return -1;
+    struct timeval tv = { g_peer_timeout_ms / 1000, (g_peer_timeout_ms % 1000) * 1000 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char reply[64];
+    ssize_t n = send(s, PEER_HEALTH_REQUEST, strlen(PEER_HEALTH_REQUEST), 0) > 0 ? recv(s, reply, sizeof(reply) - 1, 0) : -1;
+    close(s);
+    return n >= 12 && strncmp(reply + 9, "200", 3) == 0 ? 0 : -1;
+}
+
+/* Whether a request carrying X-Proxy-Peer really comes from another peer. */
+static int peer_request_verified(const char *request, size_t len) {
+    size_t vlen, slen;
+    const char *v = response_find_header(request, len, "X-Proxy-Peer", &vlen);
+    if (!v) return 0;
+    if (g_peer_secret[0]) {
+        const char *secret = response_find_header(request, len, "X-Proxy-Peer-Secret", &slen);
+        if (!secret || slen != strlen(g_peer_secret) || memcmp(secret, g_peer_secret, slen) != 0) return 0;
+    }
+    for (int i = 0; i < peer_count; i++) {
+        if (i != peer_self && strlen(peers[i].name) == vlen && memcmp(peers[i].name, v, vlen) == 0) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Answer a health probe on a connection just accepted, if its bytes are
+ * already in, so probes are not queued behind client requests and a busy
+ * proxy is not dropped from the ring. Never waits. Returns 1 if it was one.
+ */
+static int peer_answer_health(int fd) {
+    char head[sizeof(PEER_HEALTH_PREFIX)];
+    size_t want = strlen(PEER_HEALTH_PREFIX);
+    ssize_t n = recv(fd, head, want, MSG_PEEK | MSG_DONTWAIT);
+    if (n != (ssize_t)want || strncmp(head, PEER_HEALTH_PREFIX, want) != 0) return 0;
+    const char *healthy = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+    send(fd, healthy, strlen(healthy), 0);
+    return 1;
+}
+
+void* peer_health_thread(void *arg) {
+    while (server_running) {
+        for (int i = 0; i < peer_count && server_running; i++) {
+            if (i == peer_self) continue;
+            Peer *p = &peers[i];
+            if (peer_probe(p) == 0) {
+                p->failures = 0;
+                if (!atomic_exchange(&p->alive, 1)) log_message("INFO", "Peer %s is up; it owns its keys again", p->name);
+            } else if (++p->failures >= PEER_FAILS_TO_DROP) {
+                peer_down(i, "health check failed");
+            }
+        }
+        for (int waited = 0; waited < g_peer_check_ms && server_running; waited += 100) usleep(100 * 1000);
+    }
+    return NULL;
+}
+
+/* --- PERFORMANCE COUNTERS --- */
+/*
+ * dTLB load misses for the whole process, counted from startup (the counter
+ * is inherited by worker threads created after it is opened). Logged at
+ * shutdown so benchmark runs can compare cache_huge_pages on and off.
+ */
+static int dtlb_fd = -1;
+void open_dtlb_counter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    dtlb_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (dtlb_fd < 0) log_message("INFO", "dTLB miss counter unavailable: %s", strerror(errno));
+}
+void log_perf_counters(void) {
+    CacheMemStats ms;
+    cachemem_stats(&ms);
+    uint64_t count;
+    if (dtlb_fd >= 0 && read(dtlb_fd, &count, sizeof(count)) == sizeof(count)) {
+        log_message("INFO", "dTLB load misses: %llu (cache memory: %s)", (unsigned long long)count,
+                    cachemem_mode_name(ms.mode));
+    }
+    if (ms.mode != CACHEMEM_HEAP) {
+        log_message("INFO", "Cache region: size=%zuMB used=%zuMB live=%zuMB heap_fallbacks=%lu",
+                    ms.region_size >> 20, ms.region_used >> 20, ms.live_bytes >> 20, ms.heap_fallbacks);
+    }
+}
+
+/* --- I/O BUFFER POOL STATS --- */
+void log_bufpool_stats(void) {
+    for (int c = 0; c < BUF_CLASS_COUNT; c++) {
+        BufPoolStats s;
+        bufpool_stats(c, &s);
+        double hit_rate = s.gets ? 100.0 * (s.local_hits + s.global_hits) / s.gets : 0.0;
+        log_message("INFO", "Buffer pool %zuKB: gets=%lu hit_rate=%.1f%% (local=%lu global=%lu) mallocs=%lu in_use=%ld high_water=%ld allocated=%ld",
+                    s.buf_size / 1024, s.gets, hit_rate, s.local_hits, s.global_hits, s.mallocs,
+                    s.in_use, s.in_use_high_water, s.allocated);
+    }
 }
 
 /* --- SIGNAL HANDLING for Graceful Shutdown --- */
@@ -240,8 +2331,13 @@ void signal_handler(int sig) {
 
 /* --- MAIN SERVER LOGIC --- */
 int main(void) {
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+    /* No SA_RESTART: accept() must return EINTR so the main loop sees the shutdown. */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
     signal(SIGPIPE, SIG_IGN); // Ignore broken pipe signals
 
     load_configuration("proxy.conf");
@@ -250,17 +2346,92 @@ int main(void) {
     log_file = fopen("proxy.log", "a");
     if (!log_file) { perror("fopen log file"); exit(EXIT_FAILURE); }
     pthread_mutex_init(&log_mutex, NULL);
+    if (g_access_log_path[0]) {
+        access_log_file = fopen(g_access_log_path, "a");
+        if (!access_log_file) log_message("ERROR", "Cannot open access log %s: %s", g_access_log_path, strerror(errno));
+        else setvbuf(access_log_file, NULL, _IOFBF, 1 << 16);
+    }
     
+    find_cgroup_dir();
+    if (g_cache_auto) configure_auto_cache_size();
     log_message("INFO", "Server starting with configuration: Port=%d, Threads=%d, CacheSize=%zuMB", 
                 g_port, g_thread_pool_size, g_max_cache_size / (1024*1024));
+    log_message("INFO", "Miss pool: Threads=%d", g_miss_pool_size);
+    log_message("INFO", "Per-client limits: MaxConcurrent=%d, MaxQueued=%d, FairQuantum=%d",
+                g_client_max_concurrent, g_client_max_queued, g_fair_quantum);
 
-    cache = create_cache(g_max_cache_size, CACHE_HASHTABLE_SIZE);
+    if (g_cache_shared[0]) {
+        char err[256];
+        cache = create_shared_cache(g_cache_shared, g_max_cache_size, g_max_element_size, log_message, err, sizeof(err));
+        if (!cache) {
+            log_message("WARN", "Cannot use shared cache %s (%s); using a private cache.", g_cache_shared, err);
+            g_cache_shared[0] = '\0';
+        } else if (g_cache_huge_pages) {
+            log_message("WARN", "cache_huge_pages is ignored for a shared cache.");
+        }
+    }
+    if (!cache) {
+        CacheMemMode mem_mode = cachemem_init(g_max_cache_size, g_cache_huge_pages);
+        if (g_cache_huge_pages && mem_mode == CACHEMEM_HEAP) {
+            log_message("WARN", "Could not map a huge-page cache region; using the heap.");
+        }
+        log_message("INFO", "Cache object memory: %s", cachemem_mode_name(mem_mode));
+        cache = create_cache(g_max_cache_size, g_max_element_size, CACHE_HASHTABLE_SIZE);
+        cache->log = log_message;
+    }
+    cache_target_capacity = g_max_cache_size;
+    if (g_cache_chunk_bytes < 4096) g_cache_chunk_bytes = 4096;
+    if (g_cache_chunk_bytes + sizeof(CachedChunk) > g_max_element_size) g_cache_chunk_bytes = g_max_element_size - sizeof(CachedChunk);
+    if (g_cache_large_objects) log_message("INFO", "Large objects: cached in %zuKB chunks", g_cache_chunk_bytes / 1024);
+    if (g_cache_large_objects && g_origin_range_streams > 0) {
+        log_message("INFO", "Large misses: fetched with %d parallel range streams", g_origin_range_streams);
+    }
+    if (g_prefetch_max_bytes + RESPONSE_MAX_HEADER_BYTES > g_max_element_size) {
+        g_prefetch_max_bytes = g_max_element_size > RESPONSE_MAX_HEADER_BYTES ? g_max_element_size - RESPONSE_MAX_HEADER_BYTES : 0;
+    }
+    if (g_prefetch_html) {
+        log_message("INFO", "HTML prefetch: %d threads, up to %d links per page, objects up to %zuKB",
+                    g_prefetch_threads, g_prefetch_max_links, g_prefetch_max_bytes / 1024);
+    }
+    if (g_prefetch_markov) init_markov();
+    if (init_peers() > 0) {
+        log_message("INFO", "Peer cluster: %d peers, this proxy is %s; health checks every %dms", peer_count,
+                    peers[peer_self].name, g_peer_check_ms);
+    }
+    if (g_prefetch_markov) {
+        log_message("INFO", "Markov prefetch: %d model entries, confidence %d%%, %d threads, objects up to %zuKB",
+                    g_prefetch_markov_entries, g_prefetch_markov_confidence, g_prefetch_threads, g_prefetch_max_bytes / 1024);
+    }
+    int prefetching = g_prefetch_html || g_prefetch_markov;
+    init_rate_limits();
+    bufpool_init(g_bufpool_global_max);
     init_task_queue(MAX_CLIENTS);
+    init_miss_queue();
+    open_dtlb_counter();
 
+    /* Workers inherit a mask that blocks shutdown signals, so they are always delivered to the main thread. */
+    sigset_t shutdown_signals, old_mask;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, &old_mask);
     pthread_t threads[g_thread_pool_size];
     for (int i = 0; i < g_thread_pool_size; i++) {
         pthread_create(&threads[i], NULL, worker_thread, NULL);
     }
+    pthread_t miss_threads[g_miss_pool_size];
+    for (int i = 0; i < g_miss_pool_size; i++) {
+        pthread_create(&miss_threads[i], NULL, miss_worker_thread, NULL);
+    }
+    pthread_t prefetch_threads[prefetching ? g_prefetch_threads : 1];
+    for (int i = 0; prefetching && i < g_prefetch_threads; i++) {
+        pthread_create(&prefetch_threads[i], NULL, prefetch_thread, NULL);
+    }
+    pthread_t monitor_thread;
+    if (g_cache_pressure_monitor) pthread_create(&monitor_thread, NULL, memory_monitor_thread, NULL);
+    pthread_t health_thread;
+    if (peer_count) pthread_create(&health_thread, NULL, peer_health_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
 
     int server_fd;
     struct sockaddr_in address;
@@ -280,24 +2451,90 @@ int main(void) {
     printf("Proxy server listening on port %d...\n", g_port);
 
     while (server_running) {
-        int client_socket = accept(server_fd, NULL, NULL);
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_socket = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
         if (client_socket < 0) {
             if (errno == EINTR && !server_running) break;
             log_message("ERROR", "accept failed: %s", strerror(errno));
             continue;
         }
-        enqueue_task(client_socket);
+        if (peer_count && peer_answer_health(client_socket)) {
+            close(client_socket);
+            continue;
+        }
+        if (enqueue_task(client_socket, ntohl(client_addr.sin_addr.s_addr)) < 0) {
+            char ip_str[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &client_addr.sin_addr, ip_str, sizeof(ip_str));
+            log_message("WARN", "Client %s exceeded its queue limit (%d). Rejecting.", ip_str, g_client_max_queued);
+            const char *busy_resp = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+            send(client_socket, busy_resp, strlen(busy_resp), 0);
+            close(client_socket);
+        }
     }
 
     log_message("INFO", "Shutting down server...");
+    pthread_mutex_lock(&task_queue.lock);
     pthread_cond_broadcast(&task_queue.not_empty);
+    pthread_cond_broadcast(&task_queue.not_full);
+    pthread_mutex_unlock(&task_queue.lock);
     for (int i = 0; i < g_thread_pool_size; i++) {
         pthread_join(threads[i], NULL);
     }
+    pthread_mutex_lock(&miss_queue.lock);
+    pthread_cond_broadcast(&miss_queue.not_empty);
+    pthread_mutex_unlock(&miss_queue.lock);
+    for (int i = 0; i < g_miss_pool_size; i++) {
+        pthread_join(miss_threads[i], NULL);
+    }
+    pthread_mutex_lock(&prefetch_queue.lock);
+    pthread_cond_broadcast(&prefetch_queue.not_empty);
+    pthread_mutex_unlock(&prefetch_queue.lock);
+    for (int i = 0; prefetching && i < g_prefetch_threads; i++) {
+        pthread_join(prefetch_threads[i], NULL);
+    }
+    if (g_cache_pressure_monitor) pthread_join(monitor_thread, NULL);
+    if (peer_count) pthread_join(health_thread, NULL);
+    log_message("INFO", "Fast-lane hits: %lu, misses dispatched: %lu", stat_fast_hits, stat_misses_dispatched);
+    if (g_hit_zerocopy_bytes) {
+        log_message("INFO", "Zero-copy hits: %lu (%lu sends copied by the kernel, %lu left pinned)",
+                    stat_zerocopy_hits, stat_zerocopy_copied, stat_zerocopy_stuck);
+    }
+    if (stat_large_fills || stat_chunk_hits || stat_chunks_refetched) {
+        log_message("INFO", "Large objects: fills=%lu chunks stored=%lu chunk hits=%lu refetched=%lu",
+                    stat_large_fills, stat_chunks_stored, stat_chunk_hits, stat_chunks_refetched);
+    }
+    if (stat_parallel_fills) {
+        log_message("INFO", "Parallel range fills: %lu (%lu range requests, %lu failed)",
+                    stat_parallel_fills, stat_range_requests, stat_range_failures);
+    }
+    if (g_prefetch_html) {
+        log_message("INFO", "HTML prefetch: %lu pages scanned", stat_prefetch_pages);
+        log_prefetch_stats(PREFETCH_HTML, "HTML prefetch");
+    }
+    if (g_prefetch_markov) {
+        log_message("INFO", "Markov prefetch: %lu transitions learned (%lu requests skipped while the model was busy)",
+                    stat_markov_transitions, stat_markov_busy);
+        log_prefetch_stats(PREFETCH_MARKOV, "Markov prefetch");
+    }
+    if (peer_count) {
+        log_message("INFO", "Peer cluster: %lu misses fetched from owners (%lu fell back to the origin), %lu requests served for peers",
+                    stat_peer_fetches, stat_peer_fallbacks, stat_peer_requests);
+    }
+    log_bufpool_stats();
+    log_message("INFO", "Request arenas: %dKB blocks, high_water=%zu bytes", REQUEST_ARENA_SIZE / 1024, stat_arena_high_water);
+    log_perf_counters();
+    log_cache_stats();
+    log_message("INFO", "Interned hostnames: %u", intern_count());
+    if (g_cache_shared[0]) {
+        close_shared_cache(cache);
+        log_message("INFO", "Detached from shared cache %s", g_cache_shared);
+    }
     
     close(server_fd);
     log_message("INFO", "Server shut down cleanly.");
     
+    if (access_log_file) fclose(access_log_file);
     fclose(log_file);
     pthread_mutex_destroy(&log_mutex);
     for(int i = 0; i < blacklist_count; i++) free(blacklist[i]);
@@ -307,105 +2544,289 @@ int main(void) {
 
 void* worker_thread(void *arg) {
     while (1) {
-        int client_socket = dequeue_task();
-        if (client_socket == -1) break;
-        handle_request(client_socket);
-        close(client_socket);
+        Task *task = dequeue_task();
+        if (task == NULL) break;
+        if (handle_request(task) == 0) {
+            close(task->socket);
+            finish_task(task);
+        }
     }
     return NULL;
 }
 
-void handle_request(int client_socket) {
-    char *buffer = (char*)malloc(MAX_REQUEST_LEN);
-    if (!buffer) return;
-    bzero(buffer, MAX_REQUEST_LEN);
-
-    ssize_t bytes_read = recv(client_socket, buffer, MAX_REQUEST_LEN - 1, 0);
-    if (bytes_read <= 0) {
-        free(buffer);
+static void run_miss_job(MissJob *job) {
+    ResponseInfo info = {0, 0};
+    if (job->large) {
+        uint32_t fetched = serve_large_object(job->task->socket, job->req, job->buffer, job->large, job->large_slot,
+                                              &job->rate, &info);
+        release_cache_node(cache, job->large_slot);
+        log_access(job->task->bucket->ip, &job->task->started, job->req, &info, fetched ? "PARTIAL" : "HIT");
         return;
     }
+    if (job->cache_key) handle_http_request(job->task->socket, job->req, job->cache_key, job->key_len, job->peer, &job->rate, &info);
+    else handle_connect_request(job->task->socket, job->req, &job->rate, &info);
+    log_access(job->task->bucket->ip, &job->task->started, job->req, &info, !job->cache_key ? "TUNNEL" : info.peer ? "PEER" : "MISS");
+}
+
+void* miss_worker_thread(void *arg) {
+    while (1) {
+        MissJob *job = dequeue_miss();
+        if (job == NULL) break;
+        run_miss_job(job);
+        close(job->task->socket);
+        finish_task(job->task); /* job lives in the task's arena */
+    }
+    return NULL;
+}
+
+/*
+ * Binary cache key: interned host id (4 bytes), port (2 bytes), path. If the
+ * intern table is full the id is INTERN_NONE and the NUL-terminated host
+ * name follows the port instead. Intern ids are private to a process, so a
+ * shared cache always keys on the host name.
+ */
+static char* make_cache_key(Arena *arena, struct ParsedRequest *req, uint32_t host_id, size_t *key_len) {
+    if (req->host == NULL || req->path == NULL) {
+        log_message("ERROR", "Cannot generate cache key from incomplete request.");
+        return NULL;
+    }
+    uint16_t port = req->port ? (uint16_t)atoi(req->port) : 80;
+    size_t host_len = host_id == INTERN_NONE ? strlen(req->host) + 1 : 0;
+    size_t path_len = strlen(req->path);
+    *key_len = sizeof(host_id) + sizeof(port) + host_len + path_len;
+    char *cache_key = (char *)arena_alloc(arena, *key_len);
+    if (!cache_key) { log_message("ERROR", "Allocation for cache_key failed"); return NULL; }
+    char *p = cache_key;
+    memcpy(p, &host_id, sizeof(host_id)); p += sizeof(host_id);
+    memcpy(p, &port, sizeof(port)); p += sizeof(port);
+    memcpy(p, req->host, host_len); p += host_len;
+    memcpy(p, req->path, path_len);
+    return cache_key;
+}
+
+/* Cache-Control: only-if-cached (RFC 9111, 5.2.1.7): answer from the cache or with a 504. */
+static int only_if_cached(const char *request, size_t len) {
+    size_t vlen;
+    const char *v = response_find_header(request, len, "Cache-Control", &vlen);
+    for (size_t i = 0; v && i + 14 <= vlen; i++) {
+        if (strncasecmp(v + i, "only-if-cached", 14) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Front stage. Returns 1 if the request now belongs to the miss pool. */
+int handle_request(Task *task) {
+    int client_socket = task->socket;
+    task->buffer = bufpool_get(MAX_REQUEST_LEN, &task->buffer_cap);
+    char *buffer = task->buffer;
+    if (!buffer) return 0;
+
+    ssize_t bytes_read = recv(client_socket, buffer, MAX_REQUEST_LEN - 1, 0);
+    if (bytes_read <= 0) return 0;
+    buffer[bytes_read] = '\0';
+    if (access_log_file) clock_gettime(CLOCK_REALTIME, &task->started);
     
-    struct ParsedRequest *req = ParsedRequest_create();
+    if (peer_count && strncmp(buffer, PEER_HEALTH_PREFIX, strlen(PEER_HEALTH_PREFIX)) == 0) { /* arrived late */
+        const char *healthy = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+        send(client_socket, healthy, strlen(healthy), 0);
+        return 0;
+    }
+
+    struct ParsedRequest *req = ParsedRequest_create_in(&task->arena);
+    if (!req) return 0;
     if (ParsedRequest_parse(req, buffer, bytes_read) < 0) {
         log_message("ERROR", "Failed to parse request.");
     } else {
+        RateContext rate = { NULL, NULL };
+        task->from_peer = peer_count && peer_request_verified(buffer, bytes_read);
         if (is_blacklisted(req->host)) {
             log_message("WARN", "Blocked blacklisted host: %s", req->host);
             const char *forbidden_req = "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n";
             send(client_socket, forbidden_req, strlen(forbidden_req), 0);
-        } else if (req->method && strcmp(req->method, "CONNECT") == 0) {
-            handle_connect_request(client_socket, req);
+            log_access(task->bucket->ip, &task->started, req, &(ResponseInfo){403, 0}, "DENIED");
+        } else if (!task->from_peer && !rate_admit(task->bucket->ip, req->host, &rate)) {
+            log_message("WARN", "Rate limit exceeded for request to %s", req->host);
+            const char *limited_resp = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+            send(client_socket, limited_resp, strlen(limited_resp), 0);
+            log_access(task->bucket->ip, &task->started, req, &(ResponseInfo){429, 0}, "LIMITED");
         } else {
-            handle_http_request(client_socket, req, buffer, bytes_read);
+            int is_connect = req->method && strcmp(req->method, "CONNECT") == 0;
+            size_t key_len = 0;
+            /* Interned only once admitted, so refused requests cannot fill the table */
+            uint32_t host_id = is_connect || g_cache_shared[0] || !req->host ? INTERN_NONE
+                             : intern_host(req->host, strlen(req->host));
+            char *cache_key = is_connect ? NULL : make_cache_key(&task->arena, req, host_id, &key_len);
+            int cached_only = cache_key && only_if_cached(buffer, bytes_read);
+            if (g_prefetch_markov && cache_key && !cached_only) markov_observe(task->bucket->ip, cache_key, key_len, req);
+            uint32_t slot = CACHE_NIL;
+            CacheNode *cached_item = cache_key ? get_from_cache(cache, cache_key, key_len, &slot) : NULL;
+            if (cached_item && !response_is_fresh(response_meta(cache_node_data(cached_item)), time(NULL))) {
+                release_cache_node(cache, slot); /* stale: refetch, the new copy replaces it */
+                cached_item = NULL;
+            }
+            CacheNode *large = NULL; /* chunked objects may need the origin, so they go to the miss pool */
+            if (cached_item && (response_meta(cache_node_data(cached_item))->flags & RESPONSE_CHUNKED)) {
+                large = cached_item;
+                cached_item = NULL;
+            }
+            if (cached_item) {
+                rate_throttle(&rate, cached_item->data_size);
+                if (response_meta(cache_node_data(cached_item))->flags & RESPONSE_PREFETCHED) prefetch_note_hit(cached_item);
+                ResponseInfo info = {0, 0};
+                int head_only = req->method && strcmp(req->method, "HEAD") == 0;
+                if (send_cached_response(client_socket, cached_item, head_only, &info) == 0) release_cache_node(cache, slot);
+                log_access(task->bucket->ip, &task->started, req, &info, "HIT");
+                stat_fast_hits++;
+            } else if (cached_only && !large) {
+                const char *not_cached = "HTTP/1.1 504 Gateway Timeout\r\nX-Cache: MISS\r\nContent-Length: 0\r\n\r\n";
+                send(client_socket, not_cached, strlen(not_cached), 0);
+                log_access(task->bucket->ip, &task->started, req, &(ResponseInfo){504, 0}, "MISS");
+            } else if ((is_connect || cache_key) && handoff_task(task) < 0) {
+                log_message("WARN", "Too many outstanding misses for client; rejecting request to %s", req->host);
+                const char *busy_resp = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+                send(client_socket, busy_resp, strlen(busy_resp), 0);
+                log_access(task->bucket->ip, &task->started, req, &(ResponseInfo){503, 0}, "BUSY");
+                if (large) release_cache_node(cache, slot);
+            } else if (is_connect || cache_key) {
+                MissJob *job = (MissJob*)arena_alloc(&task->arena, sizeof(MissJob));
+                MissJob local_job;
+                MissJob *j = job ? job : &local_job;
+                j->task = task; j->buffer = buffer; j->req = req; j->rate = rate; j->cache_key = cache_key; j->key_len = key_len;
+                j->large = large; j->large_slot = slot;
+                j->peer = is_connect || large ? -1 : peer_route(req, buffer, bytes_read);
+                if (!job) { /* out of memory: serve it inline */
+                    run_miss_job(j);
+                    return 0;
+                }
+                stat_misses_dispatched++;
+                enqueue_miss(job);
+                return 1;
+            }
         }
     }
-    ParsedRequest_destroy(req);
-    free(buffer);
+    return 0;
 }
 
-void handle_http_request(int client_socket, struct ParsedRequest *req, const char* original_request, int request_len) {
-    // Correctly generate the cache key
-    if (req->host == NULL || req->path == NULL) {
-        log_message("ERROR", "Cannot generate cache key from incomplete request.");
-        return;
-    }
-    size_t key_len = strlen(req->host) + strlen(req->path) + 1;
-    char *cache_key = (char *)malloc(key_len);
-    if (!cache_key) { log_message("ERROR", "malloc for cache_key failed"); return; }
-    snprintf(cache_key, key_len, "%s%s", req->host, req->path);
-    
-    CacheNode *cached_item = get_from_cache(cache_key);
-    if (cached_item) {
-        send(client_socket, cached_item->data, cached_item->data_size, 0);
-        free(cache_key);
-        return;
-    }
-
-    int remote_port = req->port ? atoi(req->port) : 80;
-    struct hostent *host = gethostbyname(req->host);
-    if (!host) {
-        log_message("ERROR", "Cannot resolve hostname for HTTP: %s", req->host);
-        free(cache_key);
+/* Fetch a miss from the origin, or from `peer` (if not -1), which owns the key; only origin responses are stored. */
+void handle_http_request(int client_socket, struct ParsedRequest *req, const char *cache_key, size_t key_len, int peer, const RateContext *rate, ResponseInfo *info) {
+    int remote_socket = peer >= 0 ? peer_connect(&peers[peer], g_peer_timeout_ms) : connect_origin(req);
+    if (remote_socket < 0 && peer >= 0) {
+        peer_down(peer, "connection failed");
+        stat_peer_fallbacks++;
+        handle_http_request(client_socket, req, cache_key, key_len, -1, rate, info);
         return;
     }
+    if (remote_socket < 0) return;
 
-    int remote_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in remote_addr;
-    remote_addr.sin_family = AF_INET;
-    remote_addr.sin_port = htons(remote_port);
-    bcopy((char*)host->h_addr, (char*)&remote_addr.sin_addr.s_addr, host->h_length);
-    
-    if (connect(remote_socket, (struct sockaddr*)&remote_addr, sizeof(remote_addr)) == 0) {
-        char new_request[MAX_REQUEST_LEN];
+    int fall_back = 0;
+    char new_request[MAX_REQUEST_LEN];
+    if (peer >= 0) {
+        snprintf(new_request, sizeof(new_request),
+                 "GET http://%s%s%s%s %s\r\nHost: %s\r\nX-Proxy-Peer: %s\r\n%s%s%sConnection: close\r\n\r\n",
+                 req->host, req->port ? ":" : "", req->port ? req->port : "", req->path, req->version, req->host,
+                 peers[peer_self].name, g_peer_secret[0] ? "X-Proxy-Peer-Secret: " : "", g_peer_secret,
+                 g_peer_secret[0] ? "\r\n" : "");
+        log_message("INFO", "Fetching %s%s from peer %s", req->host, req->path, peers[peer].name);
+        stat_peer_fetches++;
+        info->peer = 1;
+    } else {
         snprintf(new_request, sizeof(new_request), 
                  "GET %s %s\r\nHost: %s\r\nConnection: close\r\n\r\n",
                  req->path, req->version, req->host);
-        
         log_message("INFO", "Forwarding new HTTP request for %s", req->host);
-        send(remote_socket, new_request, strlen(new_request), 0);
-
-        char *response_buffer = (char*)malloc(g_max_element_size);
-        if (response_buffer) {
-            ssize_t total_response_size = 0;
-            ssize_t response_bytes;
-            while ((response_bytes = recv(remote_socket, response_buffer + total_response_size, g_max_element_size - total_response_size, 0)) > 0) {
-                send(client_socket, response_buffer + total_response_size, response_bytes, 0);
-                total_response_size += response_bytes;
+    }
+    send(remote_socket, new_request, strlen(new_request), 0);
+
+    /* Start in a pooled buffer; only responses that outgrow it move to the heap. */
+    size_t response_cap;
+    char *pooled = bufpool_get(BUF_SIZE_LARGE, &response_cap);
+    char *response_buffer = pooled;
+    if (response_buffer) {
+        if (response_cap > g_max_element_size) response_cap = g_max_element_size;
+        /* HEAD is fetched as GET so the object can be cached; the client gets only the headers */
+        int head_only = strcmp(req->method, "HEAD") == 0;
+        uint64_t client_limit = head_only ? 0 : UINT64_MAX, client_sent = 0;
+        /* The buffer holds the whole response, unless the response is being
+         * stored in chunks or relayed uncached; then it holds only the bytes
+         * from response offset `base` on. */
+        enum { FILL_WHOLE, FILL_CHUNKS, FILL_PASSTHROUGH } mode = FILL_WHOLE;
+        ChunkFill fill;
+        RangeFetch *ranges = NULL;
+        LinkScan links;
+        int scanning = 0;
+        uint64_t received = 0, base = 0;
+        size_t used = 0, head_len = 0;
+        ssize_t response_bytes;
+        while ((response_bytes = recv(remote_socket, response_buffer + used, response_cap - used, 0)) > 0) {
+            rate_throttle(rate, response_bytes);
+            if (received == 0) info->status = response_status(response_buffer, response_bytes);
+            used += response_bytes; received += response_bytes;
+            if (mode == FILL_CHUNKS) {
+                chunk_fill_feed(&fill, response_buffer + used - response_bytes, response_bytes);
+            } else if (head_len == 0 && base == 0 && (head_len = response_header_end(response_buffer, used)) > 0) {
+                if (head_only) client_limit = head_len;
+                if (peer < 0 && large_object_start(&fill, response_buffer, head_len, cache_key, key_len) == 0) {
+                    mode = FILL_CHUNKS;
+                    if (!head_only) ranges = range_fetch_start(&fill, req, rate, response_buffer, head_len);
+                    chunk_fill_feed(&fill, response_buffer + head_len, used - head_len);
+                } else if (!head_only && peer < 0) {
+                    scanning = prefetch_scan_start(&links, response_buffer, head_len, req, cache_key, key_len);
+                }
+            }
+            uint64_t sendable = received < client_limit ? received : client_limit;
+            if (peer >= 0 && head_len == 0 && used < response_cap) sendable = 0; /* until the status is known */
+            if (peer >= 0 && head_len > 0 && client_sent == 0 && (info->status == 503 || info->status == 429)) {
+                log_message("WARN", "Peer %s answered %d for %s%s", peers[peer].name, info->status, req->host, req->path);
+                break;
+            }
+            if (sendable > client_sent) {
+                send(client_socket, response_buffer + (client_sent - base), sendable - client_sent, 0);
+                client_sent = sendable;
             }
-            if (total_response_size > 0) {
-                put_in_cache(cache_key, response_buffer, total_response_size);
+            if (scanning && mode == FILL_WHOLE) prefetch_scan(&links, response_buffer + head_len, used - head_len, 0);
+            if (ranges && fill.pos >= fill.chunk_size) break; /* the helpers are fetching the rest */
+            if (mode == FILL_WHOLE && used == response_cap) {
+                if (response_cap == g_max_element_size) {
+                    mode = FILL_PASSTHROUGH; /* too large to cache whole: relay the rest */
+                } else {
+                    size_t new_cap = response_cap * 2 < g_max_element_size ? response_cap * 2 : g_max_element_size;
+                    char *grown = (char*)(response_buffer == pooled ? malloc(new_cap) : realloc(response_buffer, new_cap));
+                    if (!grown) break;
+                    if (response_buffer == pooled) memcpy(grown, pooled, used);
+                    response_buffer = grown; response_cap = new_cap;
+                }
+            }
+            if (mode != FILL_WHOLE) {
+                if (mode == FILL_PASSTHROUGH && client_sent == client_limit) break; /* HEAD: headers sent */
+                base = received; used = 0;
             }
-            free(response_buffer);
         }
-    } else {
-        log_message("ERROR", "Failed to connect to remote host for HTTP: %s", req->host);
+        fall_back = peer >= 0 && client_sent == 0;
+        info->bytes = head_only || head_len == 0 ? 0 : received - head_len;
+        if (scanning && mode == FILL_WHOLE) prefetch_scan(&links, response_buffer + head_len, used - head_len, 1);
+        char *prefix; size_t prefix_len; const char *body; size_t body_len;
+        if (peer < 0 && mode == FILL_WHOLE && used > 0 &&
+            response_prepare(response_buffer, used, time(NULL), &prefix, &prefix_len, &body, &body_len) == 0) {
+            put_in_cache_prefixed(cache, cache_key, key_len, prefix, prefix_len, body, body_len);
+            free(prefix);
+        } else if (mode == FILL_CHUNKS) {
+            if (ranges) info->bytes += range_fetch_finish(ranges, &fill, client_socket);
+            log_message("INFO", "Cached %u of %llu chunks of %s", fill.stored,
+                        (unsigned long long)((fill.length + fill.chunk_size - 1) / fill.chunk_size), req->path);
+            chunk_fill_free(&fill);
+        }
+        if (response_buffer != pooled) free(response_buffer);
+        bufpool_put(pooled, BUF_SIZE_LARGE);
     }
     close(remote_socket);
-    free(cache_key);
+    if (fall_back) { /* nothing from the owner was relayed */
+        stat_peer_fallbacks++;
+        info->peer = 0; info->status = 0;
+        handle_http_request(client_socket, req, cache_key, key_len, -1, rate, info);
+    }
 }
 
-void handle_connect_request(int client_socket, struct ParsedRequest *req) {
+void handle_connect_request(int client_socket, struct ParsedRequest *req, const RateContext *rate, ResponseInfo *info) {
     log_message("INFO", "CONNECT request for %s:%s", req->host, req->port);
     int remote_port = req->port ? atoi(req->port) : 443;
     struct hostent *host = gethostbyname(req->host);
@@ -432,39 +2853,47 @@ void handle_connect_request(int client_socket, struct ParsedRequest *req) {
         close(remote_socket);
         return;
     }
+    info->status = 200;
 
     log_message("INFO", "Tunnel established for %s:%d. Forwarding data.", req->host, remote_port);
 
-    fd_set read_fds;
-    int max_fd = (client_socket > remote_socket) ? client_socket : remote_socket;
-    
-    while (server_running) {
-        FD_ZERO(&read_fds);
-        FD_SET(client_socket, &read_fds);
-        FD_SET(remote_socket, &read_fds);
+    size_t buffer_cap;
+    char *buffer = bufpool_get(BUF_SIZE_MEDIUM, &buffer_cap);
+    if (!buffer) {
+        log_message("ERROR", "No buffer available for tunnel to %s", req->host);
+        close(remote_socket);
+        return;
+    }
+
+    /* poll() rather than select(): busy proxies hold descriptors past FD_SETSIZE */
+    struct pollfd fds[2] = { { .fd = client_socket, .events = POLLIN }, { .fd = remote_socket, .events = POLLIN } };
 
-        struct timeval tv = { .tv_sec = 60, .tv_usec = 0 }; // Increased timeout
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, &tv);
+    while (server_running) {
+        int activity = poll(fds, 2, 60 * 1000);
         if (activity < 0) {
-            log_message("ERROR", "select() failed in tunnel: %s", strerror(errno));
+            if (errno == EINTR) continue;
+            log_message("ERROR", "poll() failed in tunnel: %s", strerror(errno));
             break;
         }
         if (activity == 0) continue;
 
-        char buffer[MAX_REQUEST_LEN];
         ssize_t bytes;
 
-        if (FD_ISSET(client_socket, &read_fds)) {
-            if ((bytes = recv(client_socket, buffer, sizeof(buffer), 0)) <= 0) break;
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if ((bytes = recv(client_socket, buffer, buffer_cap, 0)) <= 0) break;
+            rate_throttle(rate, bytes);
             if (send(remote_socket, buffer, bytes, 0) <= 0) break;
         }
 
-        if (FD_ISSET(remote_socket, &read_fds)) {
-            if ((bytes = recv(remote_socket, buffer, sizeof(buffer), 0)) <= 0) break;
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if ((bytes = recv(remote_socket, buffer, buffer_cap, 0)) <= 0) break;
+            rate_throttle(rate, bytes);
             if (send(client_socket, buffer, bytes, 0) <= 0) break;
+            info->bytes += bytes;
         }
     }
     
     log_message("INFO", "Tunnel closed for %s:%d", req->host, remote_port);
+    bufpool_put(buffer, buffer_cap);
     close(remote_socket);
 }
@@ -1,14 +1,49 @@
 // test_client.c
-// An improved client that sends a more complete HTTP/1.0 request.
+// A test client and load generator for the proxy.
+//
+// Without options it behaves like the original client: it sends one
+// HTTP/1.0 request through the proxy and prints the response.
+//
+// With load options it drives many connections from a single epoll loop,
+// either closed-loop (each connection sends its next request as soon as the
+// previous one completes) or open-loop (-r: requests are issued on a fixed
+// schedule no matter how slowly the proxy answers). In open-loop mode
+// latency is measured from the moment a request was *scheduled*, not from
+// when a free connection finally sent it, so queueing delay caused by a
+// stalled proxy shows up in the percentiles instead of being hidden
+// (coordinated omission).
+//
+// Replay mode (-R) reads a proxy access log and re-issues its requests with
+// their original relative timing, optionally sped up or slowed down (-S).
+// Every logged URL is mapped onto the local origin stub (-O) with the logged
+// body size, so a production trace can be replayed offline.
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <netdb.h>
 
 #define BUFFER_SIZE 8192
+#define MAX_HEADER_LEN 16384
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB * 48)
+#define TIMER_EVENT UINT32_MAX
+#define IDLE_SETUP_TIMEOUT_NS 10000000000ULL
 
 // A simple helper function to extract the hostname from a full URL
 void get_hostname_from_url(const char *url, char *hostname, int len) {
@@ -33,16 +68,8 @@ void get_hostname_from_url(const char *url, char *hostname, int len) {
     }
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <proxy_host> <proxy_port> <URL_to_fetch>\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
-    char *proxy_host = argv[1];
-    int proxy_port = atoi(argv[2]);
-    char *url = argv[3];
-
+/* --- Single request mode (the original test client) --- */
+int run_single_request(const char *proxy_host, int proxy_port, const char *url) {
     // --- Connect to the proxy server ---
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (sock_fd < 0) {
@@ -106,3 +133,808 @@ int main(int argc, char *argv[]) {
 
     return 0;
 }
+
+/* --- Load generator options --- */
+typedef struct {
+    int connections;
+    long max_requests;     // 0 = unlimited
+    double duration;       // seconds
+    double rate;           // requests/sec, 0 = closed loop
+    int keep_alive;
+    double zipf_s;
+    const char *url_file;
+    const char *tunnel_target;  // host:port for CONNECT mode
+    size_t payload;             // bytes per tunnel exchange
+    int idle_tunnels;           // extra tunnels held open without traffic
+    int json;
+    const char *trace_file;     // access log to replay
+    double speed;               // replay time scale, 0 = as fast as possible
+    const char *origin;         // host:port of the origin stub for replay
+} LoadOptions;
+
+static LoadOptions opt;
+
+/* --- Latency histogram (log-linear, ~1.5% precision, microseconds) --- */
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+static int hist_index(uint64_t v) {
+    if (v < 2 * HIST_SUB) return (int)v;
+    int exp = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    int idx = exp * HIST_SUB + (int)(v >> exp);
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_value(int idx) {
+    if (idx < 2 * HIST_SUB) return (uint64_t)idx;
+    int exp = idx / HIST_SUB - 1;
+    uint64_t sub = (uint64_t)(idx - exp * HIST_SUB);
+    return (sub << exp) + ((1ULL << exp) >> 1);
+}
+
+static void hist_record(Histogram *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max) h->max = v;
+}
+
+static uint64_t hist_percentile(const Histogram *h, double p) {
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)ceil(p / 100.0 * h->total);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+/* --- URL selection --- */
+typedef struct {
+    char *url;
+    char host[256];
+} Target;
+
+static Target *targets;
+static int target_count, target_cap;
+static double *zipf_cdf;
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t xorshift64(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Returns the new target's index
+static int add_target(const char *url) {
+    if (target_count == target_cap) {
+        target_cap = target_cap ? target_cap * 2 : 1024;
+        targets = (Target *)realloc(targets, sizeof(Target) * target_cap);
+    }
+    Target *t = &targets[target_count];
+    t->url = strdup(url);
+    get_hostname_from_url(url, t->host, sizeof(t->host));
+    return target_count++;
+}
+
+static int load_url_file(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); return -1; }
+    char line[2048];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] && line[0] != '#') add_target(line);
+    }
+    fclose(f);
+    return 0;
+}
+
+/* --- Trace replay --- */
+typedef struct {
+    uint64_t offset_ns;         // since the first request in the trace
+    int target;
+} TraceEvent;
+
+static TraceEvent *trace;
+static size_t trace_count, trace_skipped, trace_tunnels;
+
+static uint64_t str_hash(const char *s) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*s) { h ^= (unsigned char)*s++; h *= 1099511628211ULL; }
+    return h;
+}
+
+static int cmp_event(const void *a, const void *b) {
+    const TraceEvent *x = (const TraceEvent *)a, *y = (const TraceEvent *)b;
+    return x->offset_ns < y->offset_ns ? -1 : x->offset_ns > y->offset_ns;
+}
+
+// Reads an access log (see proxy.conf: access_log). Each distinct
+// host:port/path becomes one origin stub object whose size is the largest
+// body the log recorded for it. CONNECT tunnels are counted and skipped.
+static int load_trace(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); return -1; }
+    size_t slots = 1 << 16, cap = 0;
+    int *index = (int *)malloc(sizeof(int) * slots);
+    memset(index, 0xFF, sizeof(int) * slots);
+    size_t *sizes = NULL;
+    double first = -1;
+    char line[4096], method[16], where[2048];
+    double when;
+    int status;
+    size_t bytes;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lf %*s %15s %2047s %d %zu", &when, method, where, &status, &bytes) != 5) {
+            trace_skipped++;
+            continue;
+        }
+        if (strcmp(method, "CONNECT") == 0) { trace_tunnels++; continue; }
+        if (!strchr(where, '/')) { trace_skipped++; continue; }
+        if ((size_t)target_count * 2 >= slots) {  // keep the index at most half full
+            int *grown = (int *)malloc(sizeof(int) * slots * 2);
+            memset(grown, 0xFF, sizeof(int) * slots * 2);
+            for (int i = 0; i < target_count; i++) {
+                size_t b = str_hash(targets[i].url) & (slots * 2 - 1);
+                while (grown[b] >= 0) b = (b + 1) & (slots * 2 - 1);
+                grown[b] = i;
+            }
+            free(index);
+            index = grown;
+            slots *= 2;
+        }
+        char url[2304];
+        snprintf(url, sizeof(url), "http://%s/h/%s", opt.origin, where);
+        size_t b = str_hash(url) & (slots - 1);
+        while (index[b] >= 0 && strcmp(targets[index[b]].url, url) != 0) b = (b + 1) & (slots - 1);
+        if (index[b] < 0) {
+            index[b] = add_target(url);
+            sizes = (size_t *)realloc(sizes, sizeof(size_t) * target_cap);
+            sizes[index[b]] = 0;
+        }
+        if (bytes > sizes[index[b]]) sizes[index[b]] = bytes;
+        if (trace_count == cap) {
+            cap = cap ? cap * 2 : 4096;
+            trace = (TraceEvent *)realloc(trace, sizeof(TraceEvent) * cap);
+        }
+        if (first < 0 || when < first) first = when;
+        trace[trace_count].offset_ns = (uint64_t)(when * 1e3);  // ms resolution, rebased below
+        trace[trace_count++].target = index[b];
+    }
+    fclose(f);
+    free(index);
+    uint64_t base = (uint64_t)(first * 1e3);
+    for (size_t i = 0; i < trace_count; i++) trace[i].offset_ns = (trace[i].offset_ns - base) * 1000000ULL;
+    qsort(trace, trace_count, sizeof(TraceEvent), cmp_event);  // the log is written in completion order
+    for (int i = 0; i < target_count; i++) {
+        char *url = targets[i].url;
+        size_t n = strlen(url) + 32;
+        targets[i].url = (char *)malloc(n);
+        snprintf(targets[i].url, n, "%s%csize=%zu", url, strchr(url, '?') ? '&' : '?', sizes[i]);
+        free(url);
+    }
+    free(sizes);
+    return 0;
+}
+
+// Rank i (0-based) is chosen with probability proportional to 1/(i+1)^s
+static void build_zipf(double s) {
+    zipf_cdf = (double *)malloc(sizeof(double) * target_count);
+    double sum = 0;
+    for (int i = 0; i < target_count; i++) {
+        sum += 1.0 / pow(i + 1, s);
+        zipf_cdf[i] = sum;
+    }
+    for (int i = 0; i < target_count; i++) zipf_cdf[i] /= sum;
+}
+
+static Target *pick_target(void) {
+    double u = (xorshift64() >> 11) * (1.0 / 9007199254740992.0);
+    int lo = 0, hi = target_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) lo = mid + 1; else hi = mid;
+    }
+    return &targets[lo];
+}
+
+/* --- Connections --- */
+typedef enum { C_CLOSED, C_IDLE, C_CONNECTING, C_HANDSHAKE, C_SENDING, C_READING } ConnState;
+typedef enum { CH_SIZE, CH_DATA, CH_DATA_END, CH_TRAILER } ChunkState;
+
+typedef struct {
+    int fd;
+    ConnState state;
+    int tunnel_ready;
+    int idle_only;              // holds a tunnel open and never sends
+    uint64_t bytes;             // payload bytes echoed back, for fairness
+    // current request
+    char *out; size_t out_len, out_off;
+    uint64_t intended_ns, sent_ns;
+    int target;                 // replay: index into targets, else -1 to pick one
+    // response parsing
+    char *head; size_t head_len; int headers_done;
+    int status; long long content_length; int chunked; int close_after;
+    long long body_read;
+    ChunkState ch_state; long long ch_left; size_t ch_line_len;
+} Conn;
+
+static struct sockaddr_in proxy_addr;
+static int epfd;
+static Conn *conns;
+static char *tunnel_payload;
+static Histogram hist_corrected, hist_service;
+static uint64_t completed, errors, non_2xx, bytes_in, issued;
+static int idle_established, idle_failed;
+typedef struct {
+    uint64_t intended_ns;
+    int target;
+} Pending;
+
+static Pending *pending;       // open loop: scheduled requests waiting for a connection
+static size_t pending_head, pending_count, pending_cap;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void set_events(Conn *c, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.u32 = (uint32_t)(c - conns) };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void close_conn(Conn *c) {
+    if (c->fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->state = C_CLOSED;
+    c->tunnel_ready = 0;
+}
+
+static int open_conn(Conn *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) return -1;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLOUT, .data.u32 = (uint32_t)(c - conns) };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    c->state = C_CONNECTING;
+    return 0;
+}
+
+static void reset_response(Conn *c) {
+    c->head_len = 0; c->headers_done = 0;
+    c->status = 0; c->content_length = -1; c->chunked = 0;
+    c->close_after = !opt.keep_alive && !c->tunnel_ready;  // tunnels stay open between exchanges
+    c->body_read = 0;
+    c->ch_state = CH_SIZE; c->ch_left = 0; c->ch_line_len = 0;
+}
+
+static void build_request(Conn *c) {
+    if (opt.tunnel_target) {
+        c->out = tunnel_payload;
+        c->out_len = opt.payload;
+    } else {
+        Target *t = c->target >= 0 ? &targets[c->target] : pick_target();
+        free(c->out);
+        size_t n = strlen(t->url) + strlen(t->host) + 128;
+        c->out = (char *)malloc(n);
+        c->out_len = (size_t)snprintf(c->out, n, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                                      t->url, t->host, opt.keep_alive ? "keep-alive" : "close");
+    }
+    c->out_off = 0;
+    reset_response(c);
+}
+
+static void begin_exchange(Conn *c) {
+    if (opt.tunnel_target && !c->tunnel_ready) {
+        // Send the CONNECT first; the exchange starts once the tunnel is up
+        static char connect_req[512];
+        c->out_len = (size_t)snprintf(connect_req, sizeof(connect_req),
+                                      "CONNECT %s HTTP/1.1\r\nHost: %s\r\n\r\n", opt.tunnel_target, opt.tunnel_target);
+        c->out = connect_req;
+        c->out_off = 0;
+        reset_response(c);
+        c->state = C_HANDSHAKE;
+    } else {
+        build_request(c);
+        c->state = C_SENDING;
+    }
+    set_events(c, EPOLLOUT);
+}
+
+// Start a request on a connection; intended is the scheduled start time
+static void start_request(Conn *c, uint64_t intended, int target) {
+    c->intended_ns = intended;
+    c->target = target;
+    c->sent_ns = 0;
+    issued++;
+    if (c->fd < 0 && open_conn(c) < 0) {
+        errors++;
+        c->state = C_CLOSED;
+        return;
+    }
+    if (c->state == C_IDLE) begin_exchange(c);
+}
+
+static void finish_idle(Conn *c, int ok) {
+    if (ok) {
+        idle_established++;
+        c->state = C_IDLE;
+        set_events(c, EPOLLIN);  // only to notice the proxy closing it
+        return;
+    }
+    if (c->tunnel_ready) idle_established--;
+    idle_failed++;
+    close_conn(c);
+}
+
+static void finish_request(Conn *c, int ok) {
+    if (c->idle_only) { finish_idle(c, 0); return; }
+    uint64_t t = now_ns();
+    if (ok) {
+        completed++;
+        if (!opt.tunnel_target && (c->status < 200 || c->status > 299)) non_2xx++;
+        hist_record(&hist_corrected, (t - c->intended_ns) / 1000);
+        hist_record(&hist_service, (t - (c->sent_ns ? c->sent_ns : c->intended_ns)) / 1000);
+    } else {
+        errors++;
+    }
+    if (!ok || c->close_after) close_conn(c);
+    else { c->state = C_IDLE; set_events(c, 0); }
+}
+
+// Parse the status line and the framing headers once the header block is complete
+static void parse_headers(Conn *c) {
+    c->head[c->head_len] = '\0';
+    sscanf(c->head, "HTTP/%*d.%*d %d", &c->status);
+    for (char *line = strstr(c->head, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        char *h = line + 2;
+        if (strncasecmp(h, "Content-Length:", 15) == 0) c->content_length = atoll(h + 15);
+        else if (strncasecmp(h, "Transfer-Encoding:", 18) == 0 && strstr(h, "chunked")) c->chunked = 1;
+        else if (strncasecmp(h, "Connection:", 11) == 0 && strncasecmp(h + 11 + strspn(h + 11, " "), "close", 5) == 0) c->close_after = 1;
+    }
+    if (strncmp(c->head, "HTTP/1.0", 8) == 0) c->close_after = 1;
+    if (c->content_length < 0 && !c->chunked) c->close_after = 1;  // body ends at EOF
+}
+
+// Returns 1 when the response body is complete
+static int consume_body(Conn *c, const char *p, size_t n) {
+    c->body_read += n;
+    if (!c->chunked) return c->content_length >= 0 && c->body_read >= c->content_length;
+    for (size_t i = 0; i < n; ) {
+        switch (c->ch_state) {
+        case CH_SIZE:
+            if (p[i] == '\n') {
+                c->ch_state = c->ch_left == 0 ? CH_TRAILER : CH_DATA;
+                c->ch_line_len = 0;
+            } else if (c->ch_line_len++ < 16 && isxdigit((unsigned char)p[i])) {
+                c->ch_left = c->ch_left * 16 + (isdigit((unsigned char)p[i]) ? p[i] - '0' : (tolower((unsigned char)p[i]) - 'a' + 10));
+            } else {
+                c->ch_line_len = 17;  // chunk extension or CR: ignore the rest of the line
+            }
+            i++;
+            break;
+        case CH_DATA: {
+            size_t take = (size_t)c->ch_left < n - i ? (size_t)c->ch_left : n - i;
+            c->ch_left -= take;
+            i += take;
+            if (c->ch_left == 0) c->ch_state = CH_DATA_END;
+            break;
+        }
+        case CH_DATA_END:
+            if (p[i++] == '\n') c->ch_state = CH_SIZE;
+            break;
+        case CH_TRAILER:
+            if (p[i] == '\n') {
+                if (c->ch_line_len == 0) return 1;
+                c->ch_line_len = 0;
+            } else if (p[i] != '\r') {
+                c->ch_line_len++;
+            }
+            i++;
+            break;
+        }
+    }
+    return 0;
+}
+
+static void on_readable(Conn *c) {
+    char buf[65536];
+    for (;;) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n == 0) {
+            // EOF completes a response only when it was delimited by close
+            int ok = c->state == C_READING && c->headers_done && !c->chunked && c->content_length < 0;
+            c->close_after = 1;
+            finish_request(c, ok);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            finish_request(c, 0);
+            return;
+        }
+        bytes_in += (uint64_t)n;
+        if (c->state == C_READING && opt.tunnel_target) {
+            c->body_read += n;
+            c->bytes += (uint64_t)n;
+            if (c->body_read >= (long long)opt.payload) { finish_request(c, 1); return; }
+            continue;
+        }
+        size_t off = 0;
+        if (!c->headers_done) {
+            size_t take = (size_t)n < MAX_HEADER_LEN - 1 - c->head_len ? (size_t)n : MAX_HEADER_LEN - 1 - c->head_len;
+            memcpy(c->head + c->head_len, buf, take);
+            size_t old = c->head_len;
+            c->head_len += take;
+            c->head[c->head_len] = '\0';
+            char *end = strstr(c->head, "\r\n\r\n");
+            if (!end) {
+                if (c->head_len >= MAX_HEADER_LEN - 1) { finish_request(c, 0); return; }
+                continue;
+            }
+            size_t hlen = (size_t)(end - c->head) + 4;
+            off = hlen - old;
+            c->head_len = hlen;
+            c->headers_done = 1;
+            parse_headers(c);
+            if (c->state == C_HANDSHAKE) {
+                if (c->status != 200) { finish_request(c, 0); return; }
+                c->tunnel_ready = 1;
+                if (c->idle_only) { finish_idle(c, 1); return; }
+                begin_exchange(c);
+                return;
+            }
+        }
+        if (consume_body(c, buf + off, (size_t)n - off)) { finish_request(c, 1); return; }
+    }
+}
+
+static void on_writable(Conn *c) {
+    if (c->state == C_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) { finish_request(c, 0); return; }
+        c->state = C_IDLE;
+        begin_exchange(c);
+        return;
+    }
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            finish_request(c, 0);
+            return;
+        }
+        c->out_off += (size_t)n;
+    }
+    if (c->state == C_SENDING) {
+        c->sent_ns = now_ns();
+        c->state = C_READING;
+    }
+    set_events(c, EPOLLIN);
+}
+
+static int is_free(Conn *c) {
+    return c->state == C_IDLE || c->state == C_CLOSED;
+}
+
+static void pending_push(uint64_t t, int target) {
+    if (pending_count == pending_cap) {
+        size_t ncap = pending_cap ? pending_cap * 2 : 1024;
+        Pending *np = (Pending *)malloc(sizeof(Pending) * ncap);
+        for (size_t i = 0; i < pending_count; i++) np[i] = pending[(pending_head + i) % pending_cap];
+        free(pending);
+        pending = np;
+        pending_cap = ncap;
+        pending_head = 0;
+    }
+    pending[(pending_head + pending_count++) % pending_cap] = (Pending){ t, target };
+}
+
+static Pending pending_pop(void) {
+    Pending p = pending[pending_head];
+    pending_head = (pending_head + 1) % pending_cap;
+    pending_count--;
+    return p;
+}
+
+// Requests follow a schedule (rate or trace timing) rather than completions
+static int open_loop(void) {
+    return opt.rate > 0 || (opt.trace_file && opt.speed > 0);
+}
+
+// Jain's fairness index over the active tunnels' echoed bytes (1.0 = perfectly even)
+static double tunnel_fairness(double elapsed, double *min_mib, double *max_mib) {
+    double sum = 0, sum_sq = 0;
+    *min_mib = -1; *max_mib = 0;
+    for (int i = 0; i < opt.connections; i++) {
+        double x = (double)conns[i].bytes;
+        double mib = x / elapsed / (1024.0 * 1024.0);
+        sum += x;
+        sum_sq += x * x;
+        if (*min_mib < 0 || mib < *min_mib) *min_mib = mib;
+        if (mib > *max_mib) *max_mib = mib;
+    }
+    return sum_sq > 0 ? sum * sum / (opt.connections * sum_sq) : 0;
+}
+
+static void print_results(double elapsed) {
+    double rps = completed / elapsed;
+    double fairness = 0, min_mib = 0, max_mib = 0;
+    if (opt.tunnel_target) fairness = tunnel_fairness(elapsed, &min_mib, &max_mib);
+    double mbps = bytes_in / elapsed / (1024.0 * 1024.0);
+    const Histogram *h = open_loop() ? &hist_corrected : &hist_service;
+    const char *mode = opt.tunnel_target ? "tunnel" : opt.trace_file ? "replay" : "http";
+    if (opt.json) {
+        printf("{\"mode\":\"%s\",\"loop\":\"%s\",\"connections\":%d,\"duration_s\":%.3f,"
+               "\"requests\":%llu,\"errors\":%llu,\"non_2xx\":%llu,\"backlog\":%zu,"
+               "\"rps\":%.1f,\"bytes\":%llu,\"mib_per_s\":%.2f,"
+               "\"latency_us\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},"
+               "\"service_us\":{\"p50\":%llu,\"p99\":%llu}",
+               mode, open_loop() ? "open" : "closed", opt.connections, elapsed,
+               (unsigned long long)completed, (unsigned long long)errors, (unsigned long long)non_2xx, pending_count,
+               rps, (unsigned long long)bytes_in, mbps,
+               (unsigned long long)hist_percentile(h, 50), (unsigned long long)hist_percentile(h, 90),
+               (unsigned long long)hist_percentile(h, 99), (unsigned long long)hist_percentile(h, 99.9),
+               (unsigned long long)h->max,
+               (unsigned long long)hist_percentile(&hist_service, 50), (unsigned long long)hist_percentile(&hist_service, 99));
+        if (opt.tunnel_target) {
+            printf(",\"fairness\":%.4f,\"tunnel_min_mib_per_s\":%.2f,\"tunnel_max_mib_per_s\":%.2f,"
+                   "\"idle_requested\":%d,\"idle_established\":%d",
+                   fairness, min_mib, max_mib, opt.idle_tunnels, idle_established);
+        }
+        if (opt.trace_file) {
+            printf(",\"speed\":%g,\"trace_events\":%zu,\"trace_objects\":%d,\"trace_span_s\":%.3f,"
+                   "\"trace_tunnels_skipped\":%zu,\"trace_lines_skipped\":%zu",
+                   opt.speed, trace_count, target_count, trace_count ? trace[trace_count - 1].offset_ns / 1e9 : 0.0,
+                   trace_tunnels, trace_skipped);
+        }
+        printf("}\n");
+        return;
+    }
+    printf("--- Results (%s, %s loop, %d connections, %.2fs) ---\n",
+           opt.tunnel_target ? "CONNECT tunnels" : opt.trace_file ? "trace replay" : "HTTP", open_loop() ? "open" : "closed",
+           opt.connections, elapsed);
+    if (opt.trace_file) {
+        char pace[32] = "full speed";
+        if (opt.speed > 0) snprintf(pace, sizeof(pace), "%gx speed", opt.speed);
+        printf("Trace: %zu requests to %d objects over %.3fs, replayed at %s; skipped %zu tunnels, %zu bad lines\n",
+               trace_count, target_count, trace_count ? trace[trace_count - 1].offset_ns / 1e9 : 0.0,
+               pace, trace_tunnels, trace_skipped);
+    }
+    printf("Requests: %llu completed, %llu errors, %llu non-2xx, %zu never sent (backlog)\n",
+           (unsigned long long)completed, (unsigned long long)errors, (unsigned long long)non_2xx, pending_count);
+    printf("Throughput: %.1f req/s, %.2f MiB/s received\n", rps, mbps);
+    printf("Latency (us)%s: p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu\n",
+           open_loop() ? ", corrected for coordinated omission" : ", service time (use -r for corrected)",
+           (unsigned long long)hist_percentile(h, 50), (unsigned long long)hist_percentile(h, 90),
+           (unsigned long long)hist_percentile(h, 99), (unsigned long long)hist_percentile(h, 99.9),
+           (unsigned long long)h->max);
+    if (opt.tunnel_target) {
+        printf("Tunnels: fairness %.3f, per-tunnel %.2f..%.2f MiB/s", fairness, min_mib, max_mib);
+        if (opt.idle_tunnels) printf(", %d of %d idle tunnels open", idle_established, opt.idle_tunnels);
+        printf("\n");
+    }
+}
+
+static void dispatch_events(int tfd, int timeout_ms) {
+    struct epoll_event events[256];
+    int n = epoll_wait(epfd, events, 256, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.u32 == TIMER_EVENT) {
+            uint64_t expirations;
+            if (read(tfd, &expirations, sizeof(expirations)) < 0) { /* spurious wakeup */ }
+            continue;
+        }
+        Conn *c = &conns[events[i].data.u32];
+        if (c->fd < 0) continue;
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            if (c->state == C_CONNECTING) on_writable(c);
+            else on_readable(c);
+        } else if (events[i].events & EPOLLOUT) {
+            on_writable(c);
+        }
+    }
+}
+
+static int run_load(const char *proxy_host, int proxy_port) {
+    struct hostent *server = gethostbyname(proxy_host);
+    if (server == NULL) {
+        fprintf(stderr, "ERROR, no such host: %s\n", proxy_host);
+        return EXIT_FAILURE;
+    }
+    memset(&proxy_addr, 0, sizeof(proxy_addr));
+    proxy_addr.sin_family = AF_INET;
+    memcpy(&proxy_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+    proxy_addr.sin_port = htons(proxy_port);
+
+    if (opt.tunnel_target) {
+        tunnel_payload = (char *)malloc(opt.payload);
+        for (size_t i = 0; i < opt.payload; i++) tunnel_payload[i] = (char)('a' + i % 26);
+    } else {
+        if (target_count == 0) {
+            fprintf(stderr, "No URLs to request (give a URL, -u FILE or -R FILE)\n");
+            return EXIT_FAILURE;
+        }
+        if (!opt.trace_file) build_zipf(opt.zipf_s);
+    }
+
+    epfd = epoll_create1(0);
+    // The open-loop schedule is driven by an absolute timer so sends are not
+    // rounded to epoll's millisecond timeout
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct epoll_event tev = { .events = EPOLLIN, .data.u32 = TIMER_EVENT };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &tev);
+    int total_conns = opt.connections + opt.idle_tunnels;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    conns = (Conn *)calloc(total_conns, sizeof(Conn));
+    for (int i = 0; i < total_conns; i++) {
+        conns[i].fd = -1;
+        conns[i].state = C_CLOSED;
+        conns[i].head = (char *)malloc(MAX_HEADER_LEN);
+        conns[i].idle_only = i >= opt.connections;
+    }
+
+    // Idle tunnels are set up before the measured run starts
+    if (opt.idle_tunnels > 0) {
+        uint64_t deadline = now_ns() + IDLE_SETUP_TIMEOUT_NS;
+        for (int i = opt.connections; i < total_conns; i++) {
+            if (open_conn(&conns[i]) < 0) idle_failed++;
+        }
+        while (idle_established + idle_failed < opt.idle_tunnels && now_ns() < deadline) dispatch_events(tfd, 100);
+        bytes_in = 0;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(opt.duration * 1e9);
+    uint64_t interval = opt.rate > 0 ? (uint64_t)(1e9 / opt.rate) : 0;
+    uint64_t next_due = start;
+    size_t next_event = 0;  // replay: next trace entry to schedule
+    for (;;) {
+        uint64_t t = now_ns();
+        if (opt.trace_file && opt.speed > 0 && next_event < trace_count) {
+            next_due = start + (uint64_t)(trace[next_event].offset_ns / opt.speed);
+        }
+        int issuing = t < end && (opt.max_requests == 0 || issued + pending_count < (uint64_t)opt.max_requests) &&
+                      (!opt.trace_file || next_event < trace_count);
+
+        if (open_loop()) {
+            // Open loop: everything that is due joins the backlog, then free connections drain it
+            while (issuing && next_due <= t && (opt.max_requests == 0 || issued + pending_count < (uint64_t)opt.max_requests)) {
+                if (opt.trace_file) {
+                    pending_push(next_due, trace[next_event++].target);
+                    if (next_event == trace_count) { issuing = 0; break; }
+                    next_due = start + (uint64_t)(trace[next_event].offset_ns / opt.speed);
+                } else {
+                    pending_push(next_due, -1);
+                    next_due += interval;
+                }
+            }
+            for (int i = 0; i < opt.connections && pending_count > 0; i++) {
+                if (is_free(&conns[i])) {
+                    Pending p = pending_pop();
+                    start_request(&conns[i], p.intended_ns, p.target);
+                }
+            }
+        } else if (issuing) {
+            for (int i = 0; i < opt.connections; i++) {
+                if (is_free(&conns[i]) && (opt.max_requests == 0 || issued < (uint64_t)opt.max_requests) &&
+                    (!opt.trace_file || next_event < trace_count)) {
+                    start_request(&conns[i], t, opt.trace_file ? trace[next_event++].target : -1);
+                }
+            }
+        }
+
+        int busy = 0;
+        for (int i = 0; i < opt.connections; i++) busy |= !is_free(&conns[i]);
+        if (!issuing && !busy) break;
+        if (t >= end + 2000000000ULL) break;  // grace period for in-flight requests
+
+        if (open_loop() && issuing) {
+            struct itimerspec its = { .it_value = { .tv_sec = next_due / 1000000000ULL, .tv_nsec = next_due % 1000000000ULL } };
+            timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+        }
+        dispatch_events(tfd, 100);
+    }
+
+    print_results((now_ns() - start) / 1e9);
+    for (int i = 0; i < total_conns; i++) close_conn(&conns[i]);
+    close(tfd);
+    return errors > 0 && completed == 0 ? EXIT_FAILURE : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s <proxy_host> <proxy_port> <URL_to_fetch>\n"
+            "       %s [options] <proxy_host> <proxy_port> [URL]\n"
+            "Load options:\n"
+            "  -c N          concurrent connections (default 1)\n"
+            "  -n N          stop after N requests\n"
+            "  -d SEC        stop after SEC seconds (default 10)\n"
+            "  -r RATE       open loop: schedule RATE requests/sec\n"
+            "  -k            keep-alive: reuse connections when possible\n"
+            "  -u FILE       URL list, one per line\n"
+            "  -z S          Zipf exponent over the URL list (default 0 = uniform)\n"
+            "  -T HOST:PORT  CONNECT tunnel mode: echo payloads through tunnels\n"
+            "  -b BYTES      payload per tunnel exchange (default 4096)\n"
+            "  -i N          with -T: also hold N idle tunnels open during the run\n"
+            "  -s SEED       random seed for URL selection\n"
+            "  -R FILE       replay a proxy access log against the origin stub\n"
+            "  -S SPEED      replay time scale (default 1; 0 = as fast as possible)\n"
+            "  -O HOST:PORT  origin stub that replayed URLs are mapped to (default 127.0.0.1:9080)\n"
+            "  -j            print results as JSON\n",
+            prog, prog);
+}
+
+int main(int argc, char *argv[]) {
+    opt.connections = 1;
+    opt.duration = 10;
+    opt.payload = 4096;
+    opt.speed = 1;
+    opt.origin = "127.0.0.1:9080";
+    int load_mode = 0, c;
+    while ((c = getopt(argc, argv, "c:n:d:r:ku:z:T:b:i:s:R:S:O:j")) != -1) {
+        load_mode = 1;
+        switch (c) {
+        case 'c': opt.connections = atoi(optarg); break;
+        case 'n': opt.max_requests = atol(optarg); break;
+        case 'd': opt.duration = atof(optarg); break;
+        case 'r': opt.rate = atof(optarg); break;
+        case 'k': opt.keep_alive = 1; break;
+        case 'u': opt.url_file = optarg; break;
+        case 'z': opt.zipf_s = atof(optarg); break;
+        case 'T': opt.tunnel_target = optarg; break;
+        case 'b': opt.payload = (size_t)atol(optarg); break;
+        case 'i': opt.idle_tunnels = atoi(optarg); break;
+        case 's': rng_state = strtoull(optarg, NULL, 10) | 1; break;
+        case 'R': opt.trace_file = optarg; break;
+        case 'S': opt.speed = atof(optarg); break;
+        case 'O': opt.origin = optarg; break;
+        case 'j': opt.json = 1; break;
+        default: usage(argv[0]); exit(EXIT_FAILURE);
+        }
+    }
+    int nargs = argc - optind;
+    if (!load_mode) {
+        if (nargs != 3) {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        return run_single_request(argv[optind], atoi(argv[optind + 1]), argv[optind + 2]);
+    }
+    if (nargs < 2 || opt.connections < 1 || opt.payload == 0 || opt.idle_tunnels < 0 ||
+        (opt.idle_tunnels > 0 && !opt.tunnel_target) || opt.speed < 0 ||
+        (opt.trace_file && (opt.tunnel_target || opt.url_file || opt.rate > 0 || nargs > 2))) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    // -n alone, or a replay, runs to completion
+    if ((opt.max_requests > 0 || opt.trace_file) && opt.duration == 10) opt.duration = 1e9;
+
+    if (opt.trace_file && load_trace(opt.trace_file) < 0) exit(EXIT_FAILURE);
+    if (opt.url_file && load_url_file(opt.url_file) < 0) exit(EXIT_FAILURE);
+    if (nargs >= 3) add_target(argv[optind + 2]);
+    return run_load(argv[optind], atoi(argv[optind + 1]));
+}